@@ -132,6 +132,19 @@ extern int BCMINIT(nvram_commit)(void);
  */
 extern int BCMINIT(nvram_getall)(char *buf, int count);
 
+/*
+ * Batch changes: between nvram_txn_begin() and nvram_txn_commit(),
+ * nvram_set() and nvram_unset() are only recorded, and the commit applies
+ * all of them at once.
+ * @param	changed	if not NULL, set to a malloc'd "a\0b\0\0" list of the
+ *			variables that actually changed
+ * @return	number of variables changed or < 0 on error
+ */
+extern int nvram_txn_begin(void);
+extern int nvram_txn_commit(char **changed);
+extern void nvram_txn_abort(void);
+extern int nvram_set_many(const struct nvram_tuple *t, char **changed);
+
 extern int file2nvram(char *filename, char *varname);
 extern int nvram2file(char *varname, char *filename);
 
@@ -237,6 +237,187 @@ nvram_set(const char *name, const char *value)
 	return ret;
 }
 
+struct nvram_entry {
+	char *name;
+	char *value;	/* NULL to unset */
+	int next;	/* in the same hash chain */
+	int skip;	/* a later entry has the same name */
+	int new;	/* tuple made by this list */
+};
+
+/*
+ * Mark entries with the same name as a later one; only the last one
+ * counts, which is also what applying them in order would leave.
+ */
+static int
+nvram_list_dups(struct nvram_entry *list, int count)
+{
+	int *chain;
+	unsigned int size, h;
+	char *p;
+	int i, j;
+
+	for (size = 16; size < count; size <<= 1);
+	if (!(chain = kmalloc(size * sizeof(int), GFP_KERNEL)))
+		return -ENOMEM;
+	memset(chain, 0xff, size * sizeof(int));
+
+	for (i = count - 1; i >= 0; i--) {
+		for (h = 0, p = list[i].name; *p; p++)
+			h = 31 * h + *p;
+		h &= size - 1;
+		for (j = chain[h]; j >= 0 && strcmp(list[j].name, list[i].name); j = list[j].next);
+		list[i].skip = (j >= 0);
+		list[i].next = chain[h];
+		chain[h] = i;
+	}
+
+	kfree(chain);
+	return 0;
+}
+
+/*
+ * Space a list takes in nvram_buf: appended, all of its changed values
+ * as they are written, and grown, what it adds to a consolidated
+ * nvram_buf, with room for one value to be written before the old
+ * one is let go. Should be locked.
+ */
+static void
+nvram_list_space(struct nvram_entry *list, int count, unsigned long *appended, unsigned long *grown)
+{
+	unsigned long len, old, max = 0;
+	char *value;
+	int i;
+
+	*appended = *grown = 0;
+	for (i = 0; i < count; i++) {
+		if (list[i].skip || !list[i].value)
+			continue;
+		value = _nvram_get(list[i].name);
+		if (value && !strcmp(value, list[i].value))
+			continue;
+		len = strlen(list[i].value) + 1;
+		old = value ? strlen(value) + 1 : 0;
+		*appended += len;
+		if (len > old)
+			*grown += len - old;
+		if (len > max)
+			max = len;
+	}
+	*grown += max;
+}
+
+/* Set, consolidating space if it runs out. Should be locked. */
+static int
+nvram_list_set(struct nvram_entry *e, struct nvram_header *header)
+{
+	int ret;
+
+	if ((ret = _nvram_set(e->name, e->value)) && header) {
+		if ((ret = _nvram_commit(header)) == 0)
+			ret = _nvram_set(e->name, e->value);
+	}
+	return ret;
+}
+
+/*
+ * Set and unset a list of "name=value\0" or "name\0" entries, all of it
+ * or none of it, under one nvram_lock hold so that nobody sees it half
+ * applied. If the changed values don't fit in what's left of nvram_buf,
+ * it is consolidated and then only has to have room for what the list
+ * adds. New names get their tuples first and are taken back if one
+ * can't be allocated; after that, with space made sure of and only the
+ * last entry for each name applied, setting and unsetting can't fail.
+ */
+static int
+nvram_set_list(char *buf, char *end)
+{
+	unsigned long flags;
+	unsigned long appended, grown;
+	int ret = 0;
+	int count, i;
+	char *name, *next;
+	struct nvram_entry *list;
+	struct nvram_header *header = NULL;
+
+	for (count = 0, name = buf; (name < end) && (*name); name = next) {
+		next = name + strlen(name) + 1;
+		count++;
+	}
+	if (count == 0)
+		return 0;
+
+	if (!(list = kmalloc(count * sizeof(struct nvram_entry), GFP_KERNEL)))
+		return -ENOMEM;
+	for (i = 0, name = buf; i < count; i++, name = next) {
+		next = name + strlen(name) + 1;
+		list[i].value = name;
+		list[i].name = strsep(&list[i].value, "=");
+		list[i].new = 0;
+	}
+	if ((ret = nvram_list_dups(list, count))) {
+		kfree(list);
+		return ret;
+	}
+
+	down(&nvram_sem);
+	spin_lock_irqsave(&nvram_lock, flags);
+
+	nvram_list_space(list, count, &appended, &grown);
+	if (nvram_offset + appended > NVRAM_SPACE) {
+		/* The buffer to consolidate with can't be allocated locked */
+		spin_unlock_irqrestore(&nvram_lock, flags);
+		if (!(header = kmalloc(NVRAM_SPACE, GFP_KERNEL))) {
+			ret = -ENOMEM;
+			goto done;
+		}
+		spin_lock_irqsave(&nvram_lock, flags);
+
+		nvram_list_space(list, count, &appended, &grown);
+		if ((nvram_offset + appended > NVRAM_SPACE) &&
+		    ((ret = _nvram_commit(header)) == 0) &&
+		    (nvram_offset + grown > NVRAM_SPACE))
+			ret = -ENOMEM;
+		if (ret)
+			goto unlock;
+	}
+
+	/* Tuples for new names */
+	for (i = 0; i < count; i++) {
+		if (list[i].skip || !list[i].value || _nvram_get(list[i].name))
+			continue;
+		if ((ret = nvram_list_set(&list[i], header))) {
+			/* Out of memory for tuples, take back the ones made */
+			while (--i >= 0) {
+				if (list[i].new)
+					_nvram_unset(list[i].name);
+			}
+			goto unlock;
+		}
+		list[i].new = 1;
+	}
+
+	/* Everything else */
+	for (i = 0; i < count; i++) {
+		if (list[i].skip || list[i].new)
+			continue;
+		if (!list[i].value)
+			_nvram_unset(list[i].name);
+		else
+			nvram_list_set(&list[i], header);
+	}
+
+ unlock:
+	spin_unlock_irqrestore(&nvram_lock, flags);
+ done:
+	up(&nvram_sem);
+	if (header)
+		kfree(header);
+	kfree(list);
+
+	return ret;
+}
+
 char *
 real_nvram_get(const char *name)
 {
@@ -472,11 +653,11 @@ done:
 static ssize_t
 dev_nvram_write(struct file *file, const char *buf, size_t count, loff_t *ppos)
 {
-	char tmp[100], *name = tmp, *value;
+	char tmp[100], *name = tmp;
 	ssize_t ret;
 
-	if (count > sizeof(tmp)) {
-		if (!(name = kmalloc(count, GFP_KERNEL)))
+	if (count >= sizeof(tmp)) {
+		if (!(name = kmalloc(count + 1, GFP_KERNEL)))
 			return -ENOMEM;
 	}
 
@@ -484,13 +665,10 @@ dev_nvram_write(struct file *file, const char *buf, size_t count, loff_t *ppos)
 		ret = -EFAULT;
 		goto done;
 	}
+	name[count] = '\0';
 
-	value = name;
-	name = strsep(&value, "=");
-	if (value)
-		ret = nvram_set(name, value) ? : count;
-	else
-		ret = nvram_unset(name) ? : count;
+	/* One entry, or several separated by \0 */
+	ret = nvram_set_list(name, name + count) ? : count;
 
  done:
 	if (name != tmp)
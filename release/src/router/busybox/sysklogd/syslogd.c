@@ -29,7 +29,7 @@
 #include <netinet/in.h>
 #endif
 
-#if ENABLE_FEATURE_IPC_SYSLOG
+#if ENABLE_FEATURE_IPC_SYSLOG || ENABLE_FEATURE_SYSLOGD_INDEX
 #include <sys/ipc.h>
 #include <sys/sem.h>
 #include <sys/shm.h>
@@ -51,6 +51,41 @@ enum {
 	DNS_WAIT_SEC = 2 * 60,
 };
 
+#if ENABLE_FEATURE_SYSLOGD_INDEX
+/* Message index, httpd/log.c must be in sync.
+ * The ring holds records back to back. A record that does not fit
+ * at the end goes to offset 0, and readers find out by seq not
+ * matching. The writer moves first/first_seq past anything it is
+ * about to overwrite before writing, so a reader that still sees
+ * first_seq <= its seq after copying a record got a good copy. */
+enum { SLOG_KEY = 0x534c4f47 }; /* "SLOG" */
+#define SLOG_MAGIC 0x534c0002
+
+struct slog_hdr {
+	uint32_t magic;
+	uint32_t size;                 /* of data[] */
+	uint32_t pid;                  /* of the syslogd writing it */
+	volatile uint32_t first;       /* offset of the oldest record */
+	volatile uint32_t next;        /* where the next one goes */
+	volatile uint32_t first_seq;
+	volatile uint32_t next_seq;
+	char data[1];
+};
+
+struct slog_rec {
+	uint32_t seq;
+	uint32_t time;
+	uint32_t bloom[2];             /* lowercase bigrams in text[] */
+	uint16_t len;                  /* of text[], with the \n */
+	uint8_t pri;
+	uint8_t msg;                   /* offset of the message in text[] */
+	uint8_t tag;                   /* offset of the tag, 0 if none */
+	uint8_t tag_len;
+	uint16_t reserved;
+	char text[0];
+};
+#endif
+
 /* Semaphore operation structures */
 struct shbuf_ds {
 	int32_t size;   /* size of data - 1 */
@@ -101,6 +136,10 @@ struct globals {
 
 #if ENABLE_FEATURE_IPC_SYSLOG
 	struct shbuf_ds *shbuf;
+#endif
+#if ENABLE_FEATURE_SYSLOGD_INDEX
+	int idx_shmid;
+	struct slog_hdr *idx;
 #endif
 	time_t last_log_time;
 	/* localhost's name. We print only first 64 chars */
@@ -291,6 +330,225 @@ void log_to_shmem(const char *msg);
 #endif /* FEATURE_IPC_SYSLOG */
 
 
+#if ENABLE_FEATURE_SYSLOGD_INDEX
+static void slog_cleanup(void)
+{
+	if (G.idx) {
+		shmdt(G.idx);
+		shmctl(G.idx_shmid, IPC_RMID, NULL);
+		G.idx = NULL;
+	}
+}
+
+static void slog_load(void);
+
+static void slog_init(void)
+{
+	unsigned size;
+
+	/* about what the log files hold, plus a record header and
+	 * padding for each line of 64 bytes or so */
+	size = G.logFileSize;
+	if (ENABLE_FEATURE_ROTATE_LOGFILE && size)
+		size = size * (G.logFileRotate + 1) / 64 * (64 + sizeof(struct slog_rec) + 3);
+	else
+		size = 128 * 1024;
+	if (size < 16 * 1024)
+		size = 16 * 1024;
+
+	G.idx_shmid = shmget(SLOG_KEY, size, IPC_CREAT | 0644);
+	if (G.idx_shmid == -1 && errno == EINVAL) {
+		/* left over from an instance with another size */
+		shmctl(shmget(SLOG_KEY, 0, 0), IPC_RMID, NULL);
+		G.idx_shmid = shmget(SLOG_KEY, size, IPC_CREAT | 0644);
+	}
+	if (G.idx_shmid == -1) {
+		bb_perror_msg("shmget");
+		return;
+	}
+	G.idx = shmat(G.idx_shmid, NULL, 0);
+	if (G.idx == (void*) -1L) {
+		bb_perror_msg("shmat");
+		G.idx = NULL;
+		return;
+	}
+	memset(G.idx, 0, size);
+	G.idx->size = (size - offsetof(struct slog_hdr, data)) & ~3;
+	G.idx->pid = getpid();
+	slog_load();
+	G.idx->magic = SLOG_MAGIC;
+}
+
+/* drop the records that start in [from, to) */
+static void slog_evict(uint32_t from, uint32_t to)
+{
+	struct slog_hdr *h = G.idx;
+	struct slog_rec *r;
+	uint32_t n;
+
+	while (h->first_seq != h->next_seq && h->first >= from && h->first < to) {
+		r = (struct slog_rec *)(h->data + h->first);
+		n = h->first + ((sizeof(*r) + r->len + 3) & ~3);
+		if (h->first_seq + 1 == h->next_seq)
+			n = h->next;
+		else if (n + sizeof(*r) > h->size || ((struct slog_rec *)(h->data + n))->seq != h->first_seq + 1)
+			n = 0;
+		h->first = n;
+		h->first_seq++;
+	}
+}
+
+static void slog_add(int pri, const char *text, int msg, time_t t)
+{
+	struct slog_hdr *h = G.idx;
+	struct slog_rec *r;
+	uint32_t pos, len;
+	const char *p;
+	unsigned a, b, k;
+	int i;
+
+	len = strlen(text);
+	if (len > 0xffff)
+		len = 0xffff;
+	pos = (sizeof(*r) + len + 3) & ~3;
+	if (pos > h->size / 2)
+		return;
+
+	if (h->next + pos > h->size) {
+		slog_evict(h->next, h->size);
+		if (h->first_seq == h->next_seq)
+			h->first = 0;
+		h->next = 0;
+	}
+	slog_evict(h->next, h->next + pos);
+	if (h->first_seq == h->next_seq)
+		h->first = h->next;
+
+	r = (struct slog_rec *)(h->data + h->next);
+	r->seq = h->next_seq;
+	r->time = t;
+	r->len = len;
+	r->pri = pri;
+	r->msg = (msg < 256) ? msg : 0;
+	r->tag = 0;
+	r->tag_len = 0;
+
+	/* "tag: ..." or "tag[pid]: ..." */
+	if (r->msg) {
+		for (p = text + msg; isalnum(*p) || *p == '_' || *p == '-' || *p == '.' || *p == '/'; p++)
+			continue;
+		if ((*p == ':' || *p == '[') && p != text + msg && p - (text + msg) < 256) {
+			r->tag = msg;
+			r->tag_len = p - (text + msg);
+		}
+	}
+
+	r->bloom[0] = r->bloom[1] = 0;
+	a = 0;
+	for (i = 0; i < len; i++) {
+		b = tolower((unsigned char)text[i]);
+		if (i) {
+			k = ((a * 31) + b) & 63;
+			r->bloom[k >> 5] |= 1 << (k & 31);
+		}
+		a = b;
+	}
+	memcpy(r->text, text, len);
+
+	h->next += pos;
+	h->next_seq++;
+}
+
+/* a line from one of our log files, "Mmm dd hh:mm:ss host fac.pri msg" */
+static void slog_load_line(char *line, time_t now)
+{
+	static const char months[] ALIGN1 = "JanFebMarAprMayJunJulAugSepOctNovDec";
+	struct tm tm;
+	const CODE *c;
+	char *p, *q;
+	int pri, msg;
+	time_t t;
+
+	if (strlen(line) < 17 || line[15] != ' ')
+		return;
+
+	/* no year in there, so the last 12 months */
+	t = now;
+	memcpy(&tm, localtime(&now), sizeof(tm));
+	for (p = (char *)months; *p && strncmp(p, line, 3) != 0; p += 3)
+		continue;
+	if (*p && sscanf(line + 4, "%d %d:%d:%d", &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) == 4) {
+		tm.tm_mon = (p - months) / 3;
+		tm.tm_isdst = -1;
+		t = mktime(&tm);
+		if (t > now + 24 * 60 * 60) {
+			tm.tm_year--;
+			tm.tm_isdst = -1;
+			t = mktime(&tm);
+		}
+	}
+
+	pri = LOG_USER | LOG_NOTICE;
+	msg = 16;
+	if (!(option_mask32 & OPT_small)) {
+		/* skip the host, then parse_fac_prio_20()'s output */
+		p = strchr(line + 16, ' ');
+		if (!p || !(q = strchr(++p, ' ')))
+			return;
+		msg = q + 1 - line;
+		*q = '\0';
+		if (sscanf(p, "<%d>", &pri) != 1 && (q = strchr(p, '.')) != NULL) {
+			*q++ = '\0';
+			for (c = facilitynames; c->c_name && strcmp(c->c_name, p) != 0; c++)
+				continue;
+			if (c->c_name) {
+				pri = c->c_val;
+				for (c = prioritynames; c->c_name && strcmp(c->c_name, q) != 0; c++)
+					continue;
+				pri |= c->c_name ? c->c_val : LOG_NOTICE;
+			}
+			q[-1] = '.';
+		}
+		line[msg - 1] = ' ';
+	}
+	slog_add(pri, line, msg, t);
+}
+
+/* Fill the ring from the files, oldest first, so it starts out
+ * holding what they do rather than empty after a restart. */
+static void slog_load(void)
+{
+	char name[strlen(G.logFilePath) + 3 + 1];
+	char line[1024];
+	FILE *fp;
+	time_t now;
+	int i, skip;
+
+	now = time(NULL);
+	for (i = ENABLE_FEATURE_ROTATE_LOGFILE ? G.logFileRotate : 0; i >= 0; i--) {
+		if (i)
+			sprintf(name, "%s.%d", G.logFilePath, i - 1);
+		else
+			strcpy(name, G.logFilePath);
+		fp = fopen(name, "r");
+		if (!fp)
+			continue;
+		skip = 0;
+		while (fgets(line, sizeof(line), fp)) {
+			/* too long for the ring anyway */
+			if (!strchr(line, '\n')) {
+				skip = 1;
+				continue;
+			}
+			if (!skip)
+				slog_load_line(line, now);
+			skip = 0;
+		}
+		fclose(fp);
+	}
+}
+#endif
+
 /* Print a message to the log file. */
 static void log_locally(time_t now, char *msg)
 {
@@ -443,6 +701,11 @@ static void timestamp_and_log(int pri, char *msg, int len)
 		sprintf(G.printbuf, "%s %.64s %s %s\n", timestamp, G.hostname, res, msg);
 	}
 
+#if ENABLE_FEATURE_SYSLOGD_INDEX
+	if (G.idx)
+		slog_add(pri, G.printbuf, strlen(G.printbuf) - strlen(msg) - 1, time(NULL));
+#endif
+
 	/* Log message locally (to file or shared mem) */
 	log_locally(now, G.printbuf);
 }
@@ -576,6 +839,11 @@ static void do_syslogd(void)
 	if (ENABLE_FEATURE_IPC_SYSLOG && (option_mask32 & OPT_circularlog)) {
 		ipcsyslog_init();
 	}
+#if ENABLE_FEATURE_SYSLOGD_INDEX
+	else if (!ENABLE_FEATURE_REMOTE_LOG || (option_mask32 & OPT_locallog)) {
+		slog_init();
+	}
+#endif
 
 	timestamp_and_log_internal("syslogd started: BusyBox v" BB_VER);
 
@@ -648,6 +916,9 @@ static void do_syslogd(void)
 	puts("syslogd exiting");
 	if (ENABLE_FEATURE_IPC_SYSLOG)
 		ipcsyslog_cleanup();
+#if ENABLE_FEATURE_SYSLOGD_INDEX
+	slog_cleanup();
+#endif
 	kill_myself_with_sig(bb_got_signal);
 #undef recvbuf
 }
@@ -0,0 +1,526 @@
+/* dnsmasq is Copyright (c) 2000-2010 Simon Kelley
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 dated June, 1991, or
+   (at your option) version 3 dated 29 June, 2007.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Domain blocklists. A list is a text file of domain names, one per line;
+   hosts-file style lines ("0.0.0.0 name") and # comments are accepted.
+   The list is compiled once into <file>.idx: a header, an array of offsets
+   and the names themselves, lower-cased, character-reversed and sorted, so
+   that "ads.example.com" is stored as "moc.elpmaxe.sda". A query or any of
+   its parent domains is then a prefix of the reversed query ending on a
+   label boundary, which is one binary search per label. The index is
+   mmapped read-only so 100k+ names cost page cache, not heap, and are
+   shared with the TCP children. */
+
+#include "dnsmasq.h"
+#include <sys/mman.h>
+
+#define BLOCKLIST_MAGIC 0x64626c31 /* "dbl1" */
+#define BLOCKLIST_Y2K   946684800  /* schedules are ignored before the clock is set */
+
+struct blocklist_hdr {
+  u32 magic;
+  u32 count;      /* number of names */
+  u32 strsize;    /* bytes of name data following the index */
+  u32 list_mtime; /* source list this was compiled from */
+  u32 list_size;
+};
+
+static char *sort_names;
+
+static int name_cmp(const void *a, const void *b)
+{
+  return strcmp(sort_names + *(const u32 *)a, sort_names + *(const u32 *)b);
+}
+
+/* compare the first len chars of key with a NUL-terminated name */
+static int key_cmp(const char *key, size_t len, const char *name)
+{
+  int r = strncmp(key, name, len);
+
+  if (r == 0 && name[len] != 0)
+    return -1;
+  return r;
+}
+
+static int bl_search(u32 *index, u32 count, char *names, const char *key, size_t len)
+{
+  u32 lo = 0, hi = count;
+
+  while (lo < hi)
+    {
+      u32 mid = lo + ((hi - lo) >> 1);
+      int r = key_cmp(key, len, names + index[mid]);
+
+      if (r == 0)
+	return 1;
+      if (r < 0)
+	hi = mid;
+      else
+	lo = mid + 1;
+    }
+
+  return 0;
+}
+
+/* rev is a reversed name, try it and each parent domain */
+static int bl_lookup(u32 *index, u32 count, char *names, const char *rev, size_t len)
+{
+  size_t i;
+
+  if (count == 0)
+    return 0;
+
+  for (i = 1; i <= len; i++)
+    if ((i == len || rev[i] == '.') && bl_search(index, count, names, rev, i))
+      return 1;
+
+  return 0;
+}
+
+/* lower-case, strip wildcards and trailing dots, validate and reverse
+   in place. Returns the start of the name or NULL if it is not usable. */
+static char *reverse_name(char *p)
+{
+  size_t len, i;
+  char c;
+
+  while (*p == '*' || *p == '.')
+    p++;
+  len = strlen(p);
+  while (len != 0 && p[len - 1] == '.')
+    p[--len] = 0;
+  if (len == 0 || len >= MAXDNAME)
+    return NULL;
+
+  for (i = 0; i < len; i++)
+    {
+      c = tolower((unsigned char)p[i]);
+      if (!isalnum((unsigned char)c) && c != '-' && c != '.' && c != '_')
+	return NULL;
+      p[i] = c;
+    }
+
+  for (i = 0; i < len / 2; i++)
+    {
+      c = p[i];
+      p[i] = p[len - 1 - i];
+      p[len - 1 - i] = c;
+    }
+
+  return p;
+}
+
+/* Build the index image for a text list in memory. */
+static unsigned char *compile_list(struct blocklist *bl, struct stat *st, size_t *image_len)
+{
+  FILE *f;
+  char *text, *line, *next, *tok, *s;
+  u32 *raw, *index, count, n, i;
+  size_t len, strsize;
+  unsigned char *image = NULL;
+  struct blocklist_hdr *hdr;
+
+  if (!(f = fopen(bl->file, "r")))
+    {
+      my_syslog(LOG_ERR, _("failed to load blocklist %s: %s"), bl->file, strerror(errno));
+      return NULL;
+    }
+
+  if (!(text = whine_malloc(st->st_size + 1)))
+    {
+      fclose(f);
+      return NULL;
+    }
+  len = fread(text, 1, st->st_size, f);
+  fclose(f);
+  text[len] = 0;
+
+  for (n = 1, s = text; *s; s++)
+    if (*s == '\n')
+      n++;
+
+  if (!(raw = whine_malloc(n * sizeof(u32))))
+    {
+      free(text);
+      return NULL;
+    }
+
+  /* pick out the last token of each line and reverse it in place */
+  for (count = 0, line = text; line; line = next)
+    {
+      if ((next = strchr(line, '\n')))
+	*next++ = 0;
+      if ((s = strchr(line, '#')))
+	*s = 0;
+
+      for (tok = NULL, s = strtok(line, " \t\r"); s; s = strtok(NULL, " \t\r"))
+	tok = s;
+
+      if (tok && (tok = reverse_name(tok)))
+	raw[count++] = tok - text;
+    }
+
+  sort_names = text;
+  qsort(raw, count, sizeof(u32), name_cmp);
+
+  /* drop duplicates and names already covered by a parent domain,
+     which sorts before them, then pack what's left contiguously */
+  for (n = 0, strsize = 0, i = 0; i < count; i++)
+    {
+      char *name = text + raw[i];
+
+      if (!bl_lookup(raw, n, text, name, strlen(name)))
+	{
+	  raw[n++] = raw[i];
+	  strsize += strlen(name) + 1;
+	}
+    }
+
+  len = sizeof(struct blocklist_hdr) + n * sizeof(u32) + strsize;
+  if ((image = whine_malloc(len)))
+    {
+      hdr = (struct blocklist_hdr *)image;
+      hdr->magic = BLOCKLIST_MAGIC;
+      hdr->count = n;
+      hdr->strsize = strsize;
+      hdr->list_mtime = (u32)st->st_mtime;
+      hdr->list_size = (u32)st->st_size;
+
+      index = (u32 *)(hdr + 1);
+      s = (char *)(index + n);
+      for (strsize = 0, i = 0; i < n; i++)
+	{
+	  index[i] = strsize;
+	  strcpy(s + strsize, text + raw[i]);
+	  strsize += strlen(text + raw[i]) + 1;
+	}
+      *image_len = len;
+    }
+
+  free(raw);
+  free(text);
+
+  return image;
+}
+
+static int check_image(unsigned char *image, size_t len, struct stat *st)
+{
+  struct blocklist_hdr *hdr = (struct blocklist_hdr *)image;
+
+  return len >= sizeof(struct blocklist_hdr) &&
+    hdr->magic == BLOCKLIST_MAGIC &&
+    hdr->list_mtime == (u32)st->st_mtime &&
+    hdr->list_size == (u32)st->st_size &&
+    len == sizeof(struct blocklist_hdr) + hdr->count * sizeof(u32) + hdr->strsize;
+}
+
+static unsigned char *map_index(char *path, struct stat *st, size_t *len)
+{
+  struct stat ist;
+  unsigned char *map;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) == -1)
+    return NULL;
+
+  map = NULL;
+  if (fstat(fd, &ist) == 0 && ist.st_size != 0)
+    {
+      *len = ist.st_size;
+      if ((map = mmap(NULL, *len, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+	map = NULL;
+      else if (!check_image(map, *len, st))
+	{
+	  munmap(map, *len);
+	  map = NULL;
+	}
+    }
+
+  close(fd);
+  return map;
+}
+
+static void unload_list(struct blocklist *bl)
+{
+  if (bl->map)
+    {
+      if (bl->mapped)
+	munmap(bl->map, bl->map_len);
+      else
+	free(bl->map);
+    }
+  bl->map = NULL;
+  bl->count = 0;
+}
+
+static void load_list(struct blocklist *bl)
+{
+  struct stat st;
+  char *path;
+  unsigned char *image;
+  size_t len;
+  int fd;
+
+  if (stat(bl->file, &st) == -1)
+    {
+      my_syslog(LOG_ERR, _("failed to load blocklist %s: %s"), bl->file, strerror(errno));
+      unload_list(bl);
+      return;
+    }
+
+  if (bl->map && st.st_mtime == bl->mtime && st.st_size == bl->size)
+    return;
+
+  unload_list(bl);
+  bl->mtime = st.st_mtime;
+  bl->size = st.st_size;
+
+  if (!(path = whine_malloc(strlen(bl->file) + 9)))
+    return;
+
+  /* an up-to-date index from a previous run? */
+  sprintf(path, "%s.idx", bl->file);
+  if ((image = map_index(path, &st, &len)))
+    bl->mapped = 1;
+  else if ((image = compile_list(bl, &st, &len)))
+    {
+      /* write it out and map that so the pages are clean and shared;
+	 if we can't, just keep the heap copy. */
+      bl->mapped = 0;
+      sprintf(path, "%s.idx.new", bl->file);
+      if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) != -1)
+	{
+	  int ok = read_write(fd, image, len, 0);
+
+	  close(fd);
+	  if (ok)
+	    {
+	      char *dest = whine_malloc(strlen(bl->file) + 5);
+	      unsigned char *map;
+
+	      if (dest)
+		{
+		  sprintf(dest, "%s.idx", bl->file);
+		  if (rename(path, dest) == 0 && (map = map_index(dest, &st, &len)))
+		    {
+		      free(image);
+		      image = map;
+		      bl->mapped = 1;
+		    }
+		  free(dest);
+		}
+	    }
+	  unlink(path);
+	}
+    }
+
+  free(path);
+
+  if ((bl->map = image))
+    {
+      struct blocklist_hdr *hdr = (struct blocklist_hdr *)image;
+
+      bl->map_len = len;
+      bl->count = hdr->count;
+      bl->index = (u32 *)(hdr + 1);
+      bl->names = (char *)(bl->index + hdr->count);
+      bl->logged = 0;
+    }
+}
+
+/* Load or compile any lists which have changed. */
+void blocklist_init(void)
+{
+  struct blocklist *bl;
+
+  for (bl = daemon->blocklists; bl; bl = bl->next)
+    load_list(bl);
+}
+
+void blocklist_reload(void)
+{
+  struct blocklist *bl;
+
+  blocklist_init();
+
+  /* blocklist_init() at startup happens before logging has started */
+  for (bl = daemon->blocklists; bl; bl = bl->next)
+    if (bl->map && !bl->logged)
+      {
+	my_syslog(LOG_INFO, _("blocklist %s: %u domains, %uK %s"), bl->file,
+		  bl->count, (unsigned int)((bl->map_len + 1023) / 1024),
+		  bl->mapped ? _("mapped") : _("in memory"));
+	bl->logged = 1;
+      }
+}
+
+/* Same semantics as the rrule schedules: times are minutes from midnight,
+   begin > end spans midnight into the following day, -1 means all day. */
+static int in_sched(int now_mins, int now_dow, int begin, int end, int dow)
+{
+  if (begin < 0 || end < 0)
+    return (dow & now_dow) != 0;
+
+  if (begin < end)
+    return (dow & now_dow) != 0 && now_mins >= begin && now_mins < end;
+
+  if ((now_dow & dow) != 0 && now_mins >= begin)
+    return 1;
+
+  /* did it start yesterday? */
+  now_dow = (now_dow == 1) ? (1 << 6) : (now_dow >> 1);
+
+  return (now_dow & dow) != 0 && now_mins < end;
+}
+
+static void update_rules(void)
+{
+  static time_t last = 0;
+  struct blocklist_rule *rule;
+  struct tm *tms;
+  int now_mins = 0, now_dow = 0;
+  /* not dnsmasq_time(), which is uptime with HAVE_BROKEN_RTC */
+  time_t now = time(NULL);
+
+  if (now / 60 == last / 60 && last != 0)
+    return;
+  last = now;
+
+  if (now >= BLOCKLIST_Y2K)
+    {
+      tms = localtime(&now);
+      now_dow = 1 << tms->tm_wday;
+      now_mins = tms->tm_hour * 60 + tms->tm_min;
+    }
+
+  for (rule = daemon->blocklist_rules; rule; rule = rule->next)
+    {
+      if (now < BLOCKLIST_Y2K)
+	rule->active = rule->begin < 0 && rule->end < 0 && rule->dow == 0x7f;
+      else
+	rule->active = in_sched(now_mins, now_dow, rule->begin, rule->end, rule->dow);
+    }
+}
+
+#ifdef HAVE_DHCP
+/* MAC address of a client from its lease, or NULL */
+static unsigned char *client_hwaddr(union mysockaddr *addr)
+{
+  struct dhcp_lease *lease;
+
+  if (addr->sa.sa_family == AF_INET &&
+      (lease = lease_find_by_addr(addr->in.sin_addr)) &&
+      lease->hwaddr_type == ARPHRD_ETHER && lease->hwaddr_len == ETHER_ADDR_LEN)
+    return lease->hwaddr;
+
+  return NULL;
+}
+#endif
+
+static int rule_has_client(struct blocklist_rule *rule, union mysockaddr *addr,
+			   unsigned char **hwaddr, int *hwaddr_done)
+{
+  struct blocklist_client *client;
+
+  if (!rule->clients)
+    return 1;
+
+  for (client = rule->clients; client; client = client->next)
+    {
+      if (client->flags & BLC_MAC)
+	{
+#ifdef HAVE_DHCP
+	  /* looked up at most once per query */
+	  if (!*hwaddr_done)
+	    {
+	      *hwaddr = client_hwaddr(addr);
+	      *hwaddr_done = 1;
+	    }
+	  if (*hwaddr && memcmp(*hwaddr, client->hwaddr, ETHER_ADDR_LEN) == 0)
+	    break;
+#endif
+	}
+      else if (addr->sa.sa_family == AF_INET &&
+	       ntohl(addr->in.sin_addr.s_addr) >= ntohl(client->start.s_addr) &&
+	       ntohl(addr->in.sin_addr.s_addr) <= ntohl(client->end.s_addr))
+	break;
+    }
+
+  /* listed clients are exempt in an "except" rule */
+  return rule->except ? !client : client != NULL;
+}
+
+/* Returns true if name is blocked for the client at addr. */
+int blocklist_match(char *name, union mysockaddr *addr)
+{
+  struct blocklist *bl;
+  struct blocklist_rule *rule;
+  unsigned char *hwaddr = NULL;
+  int hwaddr_done = 0;
+  char rev[MAXDNAME];
+  size_t len, i;
+
+  if (!daemon->blocklists || (len = strlen(name)) == 0 || len >= MAXDNAME)
+    return 0;
+
+  for (i = 0; i < len; i++)
+    rev[i] = tolower((unsigned char)name[len - 1 - i]);
+
+  for (bl = daemon->blocklists; bl; bl = bl->next)
+    if (!bl->tag && bl_lookup(bl->index, bl->count, bl->names, rev, len))
+      return 1;
+
+  if (!daemon->blocklist_rules)
+    return 0;
+
+  update_rules();
+
+  for (rule = daemon->blocklist_rules; rule; rule = rule->next)
+    if (rule->active && rule_has_client(rule, addr, &hwaddr, &hwaddr_done))
+      for (bl = daemon->blocklists; bl; bl = bl->next)
+	if (bl->tag && strcmp(bl->tag, rule->tag) == 0 &&
+	    bl_lookup(bl->index, bl->count, bl->names, rev, len))
+	  return 1;
+
+  return 0;
+}
+
+/* Answer a blocked query in place, returns the new packet length. */
+size_t blocklist_reply(HEADER *header, size_t qlen, unsigned short qtype, char *name)
+{
+  struct all_addr addr;
+  unsigned short flags = F_NXDOMAIN;
+
+  memset(&addr, 0, sizeof(addr));
+  daemon->queries_blocked++;
+
+  if (daemon->blocklist_null)
+    {
+      if (qtype & F_IPV4)
+	flags = F_IPV4;
+#ifdef HAVE_IPV6
+      else if (qtype & F_IPV6)
+	flags = F_IPV6;
+#endif
+      else
+	flags = F_NOERR;
+    }
+
+  log_query(((flags == F_NXDOMAIN || flags == F_NOERR) ? (F_NEG | qtype) : 0) | flags | F_CONFIG | F_FORWARD,
+	    name, &addr, NULL);
+
+  return setup_reply(header, qlen, &addr, flags, daemon->local_ttl);
+}
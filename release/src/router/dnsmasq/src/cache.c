@@ -251,6 +251,12 @@ static int is_expired(time_t now, struct crec *crecp)
   if (difftime(now, crecp->ttd) < 0)
     return 0;
   
+  /* With --cache-stale, answers from upstream are kept past their TTL
+     and given out while a refresh is in flight or upstream is down. */
+  if (!(crecp->flags & (F_NEG | F_DHCP | F_HOSTS)) && 
+      difftime(now, crecp->ttd) < (double)daemon->cache_stale)
+    return 0;
+
   return 1;
 }
 
@@ -463,6 +469,8 @@ struct crec *cache_insert(char *name, struct all_addr *addr,
     new->addr.cname.cache = NULL;
   
   new->ttd = now + (time_t)ttl;
+  new->refreshed = 0;
+  new->hits = 0;
   new->next = new_chain;
   new_chain = new;
 
@@ -492,6 +500,38 @@ void cache_end_insert(void)
   new_chain = NULL;
 }
 
+/* Called when answering a query for name from crecp, the first record
+   found for it. Records that are stale, or popular and about to expire,
+   are refreshed from upstream in the background. */
+void cache_hit(struct crec *crecp, char *name, unsigned short type, time_t now)
+{
+  int refresh = 0;
+
+  if (crecp->flags & (F_HOSTS | F_DHCP | F_IMMORTAL))
+    return;
+
+  daemon->queries_cached++;
+  if (crecp->hits != 0xffff)
+    crecp->hits++;
+
+  if (difftime(now, crecp->ttd) > 0)
+    {
+      daemon->queries_stale++;
+      refresh = 1;
+    }
+  else if (daemon->prefetch_hits != 0 && !(crecp->flags & F_NEG) &&
+	   crecp->hits >= daemon->prefetch_hits &&
+	   difftime(crecp->ttd, now) <= (double)daemon->prefetch_secs)
+    refresh = 1;
+
+  if (refresh && 
+      (crecp->refreshed == 0 || difftime(now, crecp->refreshed) >= REFRESH_RETRY))
+    {
+      crecp->refreshed = now;
+      prefetch_query(name, type);
+    }
+}
+
 struct crec *cache_find_by_name(struct crec *crecp, char *name, time_t now, unsigned short prot)
 {
   struct crec *ans;
@@ -1134,6 +1174,10 @@ void dump_cache(time_t now)
 	    daemon->cachesize, cache_live_freed, cache_inserted);
   my_syslog(LOG_INFO, _("queries forwarded %u, queries answered locally %u"), 
 	    daemon->queries_forwarded, daemon->local_answer);
+  my_syslog(LOG_INFO, _("cache hits %u, misses %u, stale answers %u, prefetches %u"), 
+	    daemon->queries_cached, daemon->queries_forwarded, daemon->queries_stale, daemon->queries_prefetched);
+  if (daemon->blocklists)
+    my_syslog(LOG_INFO, _("queries blocked %u"), daemon->queries_blocked);
 
   if (!addrbuff && !(addrbuff = whine_malloc(ADDRSTRLEN)))
     return;
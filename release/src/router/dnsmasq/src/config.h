@@ -32,6 +32,11 @@
 #define DECLINE_BACKOFF 600 /* disable DECLINEd static addresses for this long */
 #define DHCP_PACKET_MAX 16384 /* hard limit on DHCP packet size */
 #define SMALLDNAME 40 /* most domain names are smaller than this */
+#define PREFETCH_HITS 3 /* default --cache-prefetch: refresh records hit this often */
+#define PREFETCH_SECS 10 /* and this close to expiry */
+#define REFRESH_RETRY 10 /* don't refresh the same record more often than this */
+#define STALE_TTL 30 /* TTL of answers from expired records, see RFC 8767 */
+#define STALE_SECS 3600 /* default --cache-stale: keep records this long after expiry */
 #define HOSTSFILE "/etc/hosts"
 #define ETHERSFILE "/etc/ethers"
 #ifdef __uClinux__
@@ -606,6 +606,90 @@ struct dhcp_netid *run_tag_if(struct dhcp_netid *tags)
   return tags;
 }
 
+/* Allocation bitmaps cover at most a /16, bigger ranges probe each address. */
+#define MAP_MAX_ADDRS 65536
+
+static unsigned int context_size(struct dhcp_context *c)
+{
+  return 1 + ntohl(c->end.s_addr) - ntohl(c->start.s_addr);
+}
+
+static int in_map(struct dhcp_context *c, struct in_addr addr, unsigned int *bit)
+{
+  unsigned int a = ntohl(addr.s_addr);
+
+  if (a < ntohl(c->start.s_addr) || a > ntohl(c->end.s_addr))
+    return 0;
+
+  *bit = a - ntohl(c->start.s_addr);
+  return 1;
+}
+
+/* Called by lease.c as leases come and go, to keep lease_map in step. */
+void context_mark_lease(struct in_addr addr, int used)
+{
+  struct dhcp_context *c;
+  unsigned int bit;
+
+  for (c = daemon->dhcp; c; c = c->next)
+    if (c->lease_map && in_map(c, addr, &bit))
+      {
+	if (used)
+	  c->lease_map[bit >> 5] |= 1u << (bit & 31);
+	else
+	  c->lease_map[bit >> 5] &= ~(1u << (bit & 31));
+      }
+}
+
+/* Build the bitmaps for a context on first use. lease_map has a bit set for
+   each address with a lease, static_map for each address reserved by a
+   dhcp-host and for the .0 and .255 addresses we never hand out (see below).
+   Bits past the end of the range are set in both. */
+static int context_maps(struct dhcp_context *c)
+{
+  unsigned int i, size = context_size(c), words = (size + 31) / 32;
+  struct dhcp_config *config;
+  struct in_addr addr;
+
+  if (size > MAP_MAX_ADDRS)
+    return 0;
+
+  if (!c->lease_map)
+    {
+      if (!(c->lease_map = whine_malloc(words * sizeof(unsigned int))))
+	return 0;
+      memset(c->lease_map, 0, words * sizeof(unsigned int));
+      for (i = 0; i < size; i++)
+	{
+	  addr.s_addr = htonl(ntohl(c->start.s_addr) + i);
+	  if (lease_find_by_addr(addr))
+	    c->lease_map[i >> 5] |= 1u << (i & 31);
+	}
+      for (; i < words * 32; i++)
+	c->lease_map[i >> 5] |= 1u << (i & 31);
+    }
+
+  if (!c->static_map)
+    {
+      if (!(c->static_map = whine_malloc(words * sizeof(unsigned int))))
+	return 0;
+      memset(c->static_map, 0, words * sizeof(unsigned int));
+      for (config = daemon->dhcp_conf; config; config = config->next)
+	if ((config->flags & CONFIG_ADDR) && in_map(c, config->addr, &i))
+	  c->static_map[i >> 5] |= 1u << (i & 31);
+      for (i = 0; i < size; i++)
+	{
+	  unsigned int a = ntohl(c->start.s_addr) + i;
+	  if (IN_CLASSC(a) && ((a & 0xff) == 0xff || (a & 0xff) == 0))
+	    c->static_map[i >> 5] |= 1u << (i & 31);
+	}
+      for (; i < words * 32; i++)
+	c->static_map[i >> 5] |= 1u << (i & 31);
+    }
+
+  return 1;
+}
+
 int address_allocate(struct dhcp_context *context,
 		     struct in_addr *addrp, unsigned char *hwaddr, int hw_len, 
 		     struct dhcp_netid *netids, time_t now)   
@@ -614,10 +698,10 @@ int address_allocate(struct dhcp_context *context,
      a particular hwaddr/clientid/hostname in our configuration.
      Try to return from contexts which match netids first. */
 
-  struct in_addr start, addr;
+  struct in_addr addr;
   struct dhcp_context *c, *d;
-  int i, pass;
-  unsigned int j; 
+  int i, pass, maps;
+  unsigned int j, size, off, n; 
 
   /* hash hwaddr: use the SDBM hashing algorithm.  Seems to give good
      dispersal even with similarly-valued "strings". */ 
@@ -632,82 +716,96 @@ int address_allocate(struct dhcp_context *context,
 	continue;
       else
 	{
-	  /* pick a seed based on hwaddr then iterate until we find a free address. */
-	  start.s_addr = addr.s_addr = 
-	    htonl(ntohl(c->start.s_addr) + 
-		  ((j + c->addr_epoch) % (1 + ntohl(c->end.s_addr) - ntohl(c->start.s_addr))));
+	  /* pick a seed based on hwaddr then iterate until we find a free address. 
+	     With the bitmaps, whole words of taken addresses are skipped at once. */
+	  size = context_size(c);
+	  off = (j + c->addr_epoch) % size;
+	  maps = context_maps(c);
 	  
-	  do {
-	    /* eliminate addresses in use by the server. */
-	    for (d = context; d; d = d->current)
-	      if (addr.s_addr == d->router.s_addr)
-		break;
+	  for (n = 0; n < size; n++, off = (off + 1 == size) ? 0 : off + 1)
+	    {
+	      if (maps)
+		{
+		  unsigned int used = c->lease_map[off >> 5] | c->static_map[off >> 5];
+		  
+		  if ((off & 31) == 0 && used == ~0u && off + 32 <= size && n + 32 <= size)
+		    {
+		      n += 31;
+		      off += 31;
+		      continue;
+		    }
+		  
+		  if (used & (1u << (off & 31)))
+		    continue;
+		}
 
-	    /* Addresses which end in .255 and .0 are broken in Windows even when using 
-	       supernetting. ie dhcp-range=192.168.0.1,192.168.1.254,255,255,254.0
-	       then 192.168.0.255 is a valid IP address, but not for Windows as it's
-	       in the class C range. See  KB281579. We therefore don't allocate these 
-	       addresses to avoid hard-to-diagnose problems. Thanks Bill. */	    
-	    if (!d &&
-		!lease_find_by_addr(addr) && 
-		!config_find_by_address(daemon->dhcp_conf, addr) &&
-		(!IN_CLASSC(ntohl(addr.s_addr)) || 
-		 ((ntohl(addr.s_addr) & 0xff) != 0xff && ((ntohl(addr.s_addr) & 0xff) != 0x0))))
-	      {
-		struct ping_result *r, *victim = NULL;
-		int count, max = (int)(0.6 * (((float)PING_CACHE_TIME)/
-					      ((float)PING_WAIT)));
-		
-		*addrp = addr;
-
-		if (daemon->options & OPT_NO_PING)
-		  return 1;
-		
-		/* check if we failed to ping addr sometime in the last
-		   PING_CACHE_TIME seconds. If so, assume the same situation still exists.
-		   This avoids problems when a stupid client bangs
-		   on us repeatedly. As a final check, if we did more
-		   than 60% of the possible ping checks in the last 
-		   PING_CACHE_TIME, we are in high-load mode, so don't do any more. */
-		for (count = 0, r = daemon->ping_results; r; r = r->next)
-		  if (difftime(now, r->time) >  (float)PING_CACHE_TIME)
-		    victim = r; /* old record */
-		  else if (++count == max || r->addr.s_addr == addr.s_addr)
-		    return 1;
-		    
-		if (icmp_ping(addr))
-		  /* address in use: perturb address selection so that we are
-		     less likely to try this address again. */
-		  c->addr_epoch++;
-		else
-		  {
-		    /* at this point victim may hold an expired record */
-		    if (!victim)
-		      {
-			if ((victim = whine_malloc(sizeof(struct ping_result))))
-			  {
-			    victim->next = daemon->ping_results;
-			    daemon->ping_results = victim;
-			  }
-		      }
-		    
-		    /* record that this address is OK for 30s 
-		       without more ping checks */
-		    if (victim)
-		      {
-			victim->addr = addr;
-			victim->time = now;
-		      }
+	      addr.s_addr = htonl(ntohl(c->start.s_addr) + off);
+
+	      /* eliminate addresses in use by the server. */
+	      for (d = context; d; d = d->current)
+		if (addr.s_addr == d->router.s_addr)
+		  break;
+	      
+	      /* Addresses which end in .255 and .0 are broken in Windows even when using 
+		 supernetting. ie dhcp-range=192.168.0.1,192.168.1.254,255,255,254.0
+		 then 192.168.0.255 is a valid IP address, but not for Windows as it's
+		 in the class C range. See  KB281579. We therefore don't allocate these 
+		 addresses to avoid hard-to-diagnose problems. Thanks Bill. */	    
+	      if (!d &&
+		  (maps ||
+		   (!lease_find_by_addr(addr) && 
+		    !config_find_by_address(daemon->dhcp_conf, addr) &&
+		    (!IN_CLASSC(ntohl(addr.s_addr)) || 
+		     ((ntohl(addr.s_addr) & 0xff) != 0xff && ((ntohl(addr.s_addr) & 0xff) != 0x0))))))
+		{
+		  struct ping_result *r, *victim = NULL;
+		  int count, max = (int)(0.6 * (((float)PING_CACHE_TIME)/
+						((float)PING_WAIT)));
+		  
+		  *addrp = addr;
+		  
+		  if (daemon->options & OPT_NO_PING)
 		    return 1;
-		  }
-	      }
-
-	    addr.s_addr = htonl(ntohl(addr.s_addr) + 1);
-	    
-	    if (addr.s_addr == htonl(ntohl(c->end.s_addr) + 1))
-	      addr = c->start;
-	    
-	  } while (addr.s_addr != start.s_addr);
+		  
+		  /* check if we failed to ping addr sometime in the last
+		     PING_CACHE_TIME seconds. If so, assume the same situation still exists.
+		     This avoids problems when a stupid client bangs
+		     on us repeatedly. As a final check, if we did more
+		     than 60% of the possible ping checks in the last 
+		     PING_CACHE_TIME, we are in high-load mode, so don't do any more. */
+		  for (count = 0, r = daemon->ping_results; r; r = r->next)
+		    if (difftime(now, r->time) >  (float)PING_CACHE_TIME)
+		      victim = r; /* old record */
+		    else if (++count == max || r->addr.s_addr == addr.s_addr)
+		      return 1;
+		  
+		  if (icmp_ping(addr))
+		    /* address in use: perturb address selection so that we are
+		       less likely to try this address again. */
+		    c->addr_epoch++;
+		  else
+		    {
+		      /* at this point victim may hold an expired record */
+		      if (!victim)
+			{
+			  if ((victim = whine_malloc(sizeof(struct ping_result))))
+			    {
+			      victim->next = daemon->ping_results;
+			      daemon->ping_results = victim;
+			    }
+			}
+		      
+		      /* record that this address is OK for 30s 
+			 without more ping checks */
+		      if (victim)
+			{
+			  victim->addr = addr;
+			  victim->time = now;
+			}
+		      return 1;
+		    }
+		}
+	    }
 	}
   return 0;
 }
@@ -1000,8 +1098,16 @@ void dhcp_update_configs(struct dhcp_config *configs)
      restore the status-quo ante first. */
   
   struct dhcp_config *config;
+  struct dhcp_context *context;
   struct crec *crec;
 
+  /* dhcp-host addresses may have changed, rebuild on next allocation. */
+  for (context = daemon->dhcp; context; context = context->next)
+    {
+      free(context->static_map);
+      context->static_map = NULL;
+    }
+
   for (config = configs; config; config = config->next)
     if (config->flags & CONFIG_ADDR_HOSTS)
       config->flags &= ~(CONFIG_ADDR | CONFIG_ADDR_HOSTS);
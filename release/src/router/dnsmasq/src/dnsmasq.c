@@ -169,6 +169,7 @@ int main (int argc, char **argv)
 	 to the lease-script init process. */
       lease_init(now);
       dhcp_init();
+      lease_query_init();	// zzz
     }
 #endif
 
@@ -195,7 +196,11 @@ int main (int argc, char **argv)
     die(_("failed to create listening socket: %s"), NULL, EC_BADNET);
   
   if (daemon->port != 0)
-    cache_init();
+    {
+      cache_init();
+      /* compile any blocklist indexes while we can still write them */
+      blocklist_init();
+    }
     
   if (daemon->options & OPT_DBUS)
 #ifdef HAVE_DBUS
@@ -608,6 +613,16 @@ int main (int argc, char **argv)
 	      FD_SET(daemon->pxefd, &rset);
 	      bump_maxfd(daemon->pxefd, &maxfd);
 	    }
+	  if (daemon->leasequeryfd != -1)
+	    {
+	      FD_SET(daemon->leasequeryfd, &rset);
+	      bump_maxfd(daemon->leasequeryfd, &maxfd);
+	    }
+	  if (daemon->leasequeryconn != -1)
+	    {
+	      FD_SET(daemon->leasequeryconn, &rset);
+	      bump_maxfd(daemon->leasequeryconn, &maxfd);
+	    }
 	}
 #endif
 
@@ -695,6 +710,10 @@ int main (int argc, char **argv)
 	    dhcp_packet(now, 0);
 	  if (daemon->pxefd != -1 && FD_ISSET(daemon->pxefd, &rset))
 	    dhcp_packet(now, 1);
+	  if (daemon->leasequeryconn != -1 && FD_ISSET(daemon->leasequeryconn, &rset))
+	    lease_query_read(now);
+	  if (daemon->leasequeryfd != -1 && FD_ISSET(daemon->leasequeryfd, &rset))
+	    lease_query(now);
 	}
 
 #  ifdef HAVE_SCRIPT
@@ -984,7 +1003,10 @@ void poll_resolv(int force, int do_reload, time_t now)
 void clear_cache_and_reload(time_t now)
 {
   if (daemon->port != 0)
-    cache_reload();
+    {
+      cache_reload();
+      blocklist_reload();
+    }
   
 #ifdef HAVE_DHCP
   if (daemon->dhcp)
@@ -1160,7 +1182,10 @@ static void check_dns_listeners(fd_set *set, time_t now)
 	      /* Arrange for SIGALARM after CHILD_LIFETIME seconds to
 		 terminate the process. */
 	      if (!(daemon->options & OPT_DEBUG))
-		alarm(CHILD_LIFETIME);
+		{
+		  alarm(CHILD_LIFETIME);
+		  prefetch_disable();
+		}
 #endif
 
 	      /* start with no upstream connections. */
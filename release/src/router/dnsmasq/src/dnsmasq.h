@@ -264,6 +264,8 @@ union bigname {
 struct crec { 
   struct crec *next, *prev, *hash_next;
   time_t ttd; /* time to die */
+  time_t refreshed; /* last prefetch sent for this record */
+  unsigned short hits;
   int uid; 
   union {
     struct all_addr addr;
@@ -397,7 +399,39 @@ struct frec {
   int fd, forwardall, norebind;
   unsigned int crc;
   time_t time;
-  struct frec *next;
+  char inuse, hashed;
+  struct frec *next, *prev; /* free list, or in-use list oldest first */
+  struct frec *hash_next, *sender_next;
+};
+
+/* domain blocklists, see blocklist.c */
+struct blocklist {
+  char *file, *tag; /* tag NULL means applies to all clients, always */
+  time_t mtime;
+  off_t size;
+  unsigned char *map;
+  size_t map_len;
+  int mapped, logged;
+  unsigned int count, *index;
+  char *names;
+  struct blocklist *next;
+};
+
+#define BLC_MAC   1
+
+struct blocklist_client {
+  int flags;
+  unsigned char hwaddr[ETHER_ADDR_LEN];
+  struct in_addr start, end;
+  struct blocklist_client *next;
+};
+
+/* apply the lists tagged "tag" to clients while in the rrule-style schedule */
+struct blocklist_rule {
+  char *tag;
+  int begin, end, dow, except, active;
+  struct blocklist_client *clients;
+  struct blocklist_rule *next;
 };
 
 /* actions in the daemon->helper RPC */
@@ -417,6 +451,7 @@ struct dhcp_lease {
   char new;              /* newly created */
   char changed;          /* modified */
   char aux_changed;      /* CLID or expiry changed */
+  char unsaved;          /* not yet appended to the lease file */
   time_t expires;        /* lease expiry */
 #ifdef HAVE_BROKEN_RTC
   unsigned int length;
@@ -428,6 +463,7 @@ struct dhcp_lease {
   unsigned int extradata_len, extradata_size;
   int last_interface;
   struct dhcp_lease *next;
+  struct dhcp_lease *addr_next, *hw_next, *clid_next; /* hash chains */
 };
 
 struct dhcp_netid {
@@ -558,6 +594,7 @@ struct dhcp_context {
   int flags;
   char *interface;
   struct dhcp_netid netid, *filter;
+  unsigned int *lease_map, *static_map; /* one bit per address in range, see address_allocate() */
   struct dhcp_context *next, *current;
 };
 
@@ -680,13 +717,21 @@ extern struct daemon {
   struct tftp_prefix *if_prefix; /* per-interface TFTP prefixes */
   struct interface_list *tftp_interfaces; /* interfaces for limited TFTP service */
   int tftp_unlimited;
+  struct blocklist *blocklists;
+  struct blocklist_rule *blocklist_rules;
+  int blocklist_null;
 
   /* globally used stuff for DNS */
   char *packet; /* packet buffer */
   int packet_buff_sz; /* size of above */
   char *namebuff; /* MAXDNAME size buffer */
-  unsigned int local_answer, queries_forwarded;
-  struct frec *frec_list;
+  unsigned int local_answer, queries_forwarded, queries_blocked;
+  unsigned int queries_cached, queries_stale, queries_prefetched;
+  int prefetch_hits;
+  unsigned long prefetch_secs, cache_stale;
+  struct frec *frecs, *frec_free, *frec_oldest, *frec_newest;
+  struct frec **frec_hash, **frec_sender; /* by new_id, by orig_id/crc/source */
+  unsigned int frec_mask;
   struct serverfd *sfds;
   struct irec *interfaces;
   struct listener *listeners;
@@ -701,7 +746,7 @@ extern struct daemon {
   int v6pktinfo; 
 
   /* DHCP state */
-  int dhcpfd, helperfd, pxefd; 
+  int dhcpfd, helperfd, pxefd, leasequeryfd, leasequeryconn; 
 #if defined(HAVE_LINUX_NETWORK)
   int netlinkfd;
 #elif defined(HAVE_BSD_NETWORK)
@@ -737,6 +782,7 @@ struct crec *cache_find_by_name(struct crec *crecp,
 				char *name, time_t now, unsigned short  prot);
 void cache_end_insert(void);
 void cache_start_insert(void);
+void cache_hit(struct crec *crecp, char *name, unsigned short type, time_t now);
 struct crec *cache_insert(char *name, struct all_addr *addr,
 			  time_t now, unsigned long ttl, unsigned short flags);
 void cache_reload(void);
@@ -807,6 +853,8 @@ void reread_dhcp(void);
 
 /* forward.c */
 void reply_query(int fd, int family, time_t now);
+void prefetch_query(char *name, unsigned short type);
+void prefetch_disable(void);
 void receive_query(struct listener *listen, time_t now);
 unsigned char *tcp_request(int confd, time_t now,
 			   struct in_addr local_addr, struct in_addr netmask);
@@ -827,6 +875,12 @@ int iface_check(int family, struct all_addr *addr, char *name, int *indexp);
 int fix_fd(int fd);
 struct in_addr get_ifaddr(char *intr);
 
+/* blocklist.c */
+void blocklist_init(void);
+void blocklist_reload(void);
+int blocklist_match(char *name, union mysockaddr *addr);
+size_t blocklist_reply(HEADER *header, size_t qlen, unsigned short qtype, char *name);
+
 /* dhcp.c */
 #ifdef HAVE_DHCP
 void dhcp_init(void);
@@ -848,6 +902,7 @@ struct dhcp_config *find_config(struct dhcp_config *configs,
 				unsigned char *clid, int clid_len,
 				unsigned char *hwaddr, int hw_len, 
 				int hw_type, char *hostname);
+void context_mark_lease(struct in_addr addr, int used);
 void dhcp_update_configs(struct dhcp_config *configs);
 void dhcp_read_ethers(void);
 void check_dhcp_hosts(int fatal);
@@ -860,6 +915,9 @@ char *get_domain(struct in_addr addr);
 /* lease.c */
 #ifdef HAVE_DHCP
 void lease_update_file(time_t now);
+void lease_query_init(void);
+void lease_query(time_t now);
+void lease_query_read(time_t now);
 void lease_update_dns();
 void lease_init(time_t now);
 struct dhcp_lease *lease_allocate(struct in_addr addr);
@@ -22,6 +22,7 @@ static struct frec *lookup_frec_by_sender(unsigned short id,
 					  unsigned int crc);
 static unsigned short get_id(unsigned int crc);
 static void free_frec(struct frec *f);
+static void hash_frec(struct frec *f);
 static struct randfd *allocate_rfd(int family);
 
 /* Send a UDP packet with its source address set as "source" 
@@ -263,6 +264,7 @@ static int forward_query(int udpfd, union mysockaddr *udpaddr,
 	  forward->forwardall = 0;
 	  forward->norebind = norebind;
 	  header->id = htons(forward->new_id);
+	  hash_frec(forward);
 
 	  /* In strict_order mode, always try servers in the order 
 	     specified in resolv.conf, if a domain is given 
@@ -473,6 +475,61 @@ static size_t process_reply(HEADER *header, time_t now,
   return resize_packet(header, n, pheader, plen);
 }
 
+/* A refresh for a cached name is queued by cache_hit() while a query is
+   being answered and sent once the answer has gone, as a query of our own.
+   Its frec has no client, so the reply only updates the cache.
+   A forked TCP child never gets to send it, so it doesn't queue one. */
+static char *prefetch_name = NULL;
+static unsigned short prefetch_type;
+static int prefetch_off = 0;
+
+void prefetch_disable(void)
+{
+  prefetch_off = 1;
+}
+
+void prefetch_query(char *name, unsigned short type)
+{
+  if (prefetch_off)
+    return;
+
+  if (!prefetch_name && !(prefetch_name = whine_malloc(MAXDNAME)))
+    return;
+  
+  strcpy(prefetch_name, name);
+  prefetch_type = type;
+}
+
+static void prefetch_send(time_t now)
+{
+  HEADER *header = (HEADER *)daemon->packet;
+  unsigned char *p;
+  union mysockaddr source;
+  struct all_addr dest;
+
+  if (!prefetch_name || !*prefetch_name)
+    return;
+
+  memset(header, 0, sizeof(HEADER));
+  header->id = htons(rand16());
+  header->rd = 1;
+  header->opcode = QUERY;
+  header->qdcount = htons(1);
+
+  p = do_rfc1035_name((unsigned char *)(header+1), prefetch_name);
+  *p++ = 0;
+  PUTSHORT(prefetch_type, p);
+  PUTSHORT(C_IN, p);
+  *prefetch_name = 0;
+
+  memset(&source, 0, sizeof(source));
+  source.sa.sa_family = AF_INET;
+  memset(&dest, 0, sizeof(dest));
+
+  if (forward_query(-1, &source, &dest, 0, header, p - (unsigned char *)header, now, NULL))
+    daemon->queries_prefetched++;
+}
+
 /* sets new last_server */
 void reply_query(int fd, int family, time_t now)
 {
@@ -570,7 +627,7 @@ void reply_query(int fd, int family, time_t now)
       if (!(daemon->options & OPT_NO_REBIND))
 	check_rebind = 0;
       
-      if ((nn = process_reply(header, now, server, (size_t)n, check_rebind)))
+      if ((nn = process_reply(header, now, server, (size_t)n, check_rebind)) && forward->fd != -1)
 	{
 	  header->id = htons(forward->orig_id);
 	  header->ra = 1; /* recursion if available */
@@ -586,7 +643,7 @@ void receive_query(struct listener *listen, time_t now)
 {
   HEADER *header = (HEADER *)daemon->packet;
   union mysockaddr source_addr;
-  unsigned short type;
+  unsigned short type, gotname;
   struct all_addr dst_addr;
   struct in_addr netmask, dst_addr_4;
   size_t m;
@@ -728,7 +785,7 @@ void receive_query(struct listener *listen, time_t now)
       netmask = ((struct sockaddr_in *) &ifr.ifr_addr)->sin_addr;
     }
   
-  if (extract_request(header, (size_t)n, daemon->namebuff, &type))
+  if ((gotname = extract_request(header, (size_t)n, daemon->namebuff, &type)))
     {
       char types[20];
 
@@ -744,8 +801,11 @@ void receive_query(struct listener *listen, time_t now)
 #endif
     }
 
-  m = answer_request (header, ((char *) header) + PACKETSZ, (size_t)n, 
-		      dst_addr_4, netmask, now);
+  if (gotname && blocklist_match(daemon->namebuff, &source_addr))
+    m = blocklist_reply(header, (size_t)n, gotname, daemon->namebuff);
+  else
+    m = answer_request (header, ((char *) header) + PACKETSZ, (size_t)n, 
+			dst_addr_4, netmask, now);
   if (m >= 1)
     {
       send_from(listen->fd, daemon->options & OPT_NOWILD, (char *)header, 
@@ -757,6 +817,8 @@ void receive_query(struct listener *listen, time_t now)
     daemon->queries_forwarded++;
   else
     daemon->local_answer++;
+
+  prefetch_send(now);
 }
 
 /* The daemon forks before calling this: it should deal with one connection,
@@ -770,6 +832,8 @@ unsigned char *tcp_request(int confd, time_t now,
   size_t m;
   unsigned short qtype, gotname;
   unsigned char c1, c2;
+  union mysockaddr peer_addr;
+  socklen_t peer_len;
   /* Max TCP packet + slop */
   unsigned char *packet = whine_malloc(65536 + MAXDNAME + RRFIXEDSZ);
   HEADER *header;
@@ -787,13 +851,13 @@ unsigned char *tcp_request(int confd, time_t now,
 	continue;
       
       header = (HEADER *)packet;
+      peer_len = sizeof(union mysockaddr);
+      if (getpeername(confd, (struct sockaddr *)&peer_addr, &peer_len) == -1)
+	peer_addr.sa.sa_family = AF_UNSPEC;
       
       if ((gotname = extract_request(header, (unsigned int)size, daemon->namebuff, &qtype)))
 	{
-	  union mysockaddr peer_addr;
-	  socklen_t peer_len = sizeof(union mysockaddr);
-	  
-	  if (getpeername(confd, (struct sockaddr *)&peer_addr, &peer_len) != -1)
+	  if (peer_addr.sa.sa_family != AF_UNSPEC)
 	    {
 	      char types[20];
 
@@ -811,8 +875,11 @@ unsigned char *tcp_request(int confd, time_t now,
 	}
       
       /* m > 0 if answered from cache */
-      m = answer_request(header, ((char *) header) + 65536, (unsigned int)size, 
-			 local_addr, netmask, now);
+      if (gotname && blocklist_match(daemon->namebuff, &peer_addr))
+	m = blocklist_reply(header, (unsigned int)size, gotname, daemon->namebuff);
+      else
+	m = answer_request(header, ((char *) header) + 65536, (unsigned int)size, 
+			   local_addr, netmask, now);
 
       /* Do this by steam now we're not in the select() loop */
       check_log_writer(NULL); 
@@ -928,20 +995,115 @@ unsigned char *tcp_request(int confd, time_t now,
     }
 }
 
+/* In-flight queries live in a pool of daemon->ftabsize records allocated
+   in one go. Records in use are on a list in allocation order, which is
+   also expiry order since f->time is only set there, so the oldest is
+   always at the head. They are also hashed by new_id, for replies, and by
+   (orig_id, crc, source), for client retries, so neither a reply nor a new
+   query has to scan the table. */
+static int frec_init(void)
+{
+  unsigned int i, size;
+
+  for (size = 16; size < (unsigned int)daemon->ftabsize; size <<= 1);
+  
+  if (!(daemon->frecs = whine_malloc(daemon->ftabsize * sizeof(struct frec))) ||
+      !(daemon->frec_hash = whine_malloc(2 * size * sizeof(struct frec *))))
+    {
+      free(daemon->frecs);
+      daemon->frecs = NULL;
+      return 0;
+    }
+  
+  memset(daemon->frecs, 0, daemon->ftabsize * sizeof(struct frec));
+  memset(daemon->frec_hash, 0, 2 * size * sizeof(struct frec *));
+  daemon->frec_sender = daemon->frec_hash + size;
+  daemon->frec_mask = size - 1;
+
+  for (i = 0; i < (unsigned int)daemon->ftabsize; i++)
+    {
+      daemon->frecs[i].next = daemon->frec_free;
+      daemon->frec_free = &daemon->frecs[i];
+    }
+  
+  return 1;
+}
+
+static unsigned int sender_hash(unsigned short id, union mysockaddr *addr, unsigned int crc)
+{
+  unsigned int h = id ^ crc;
+
+  if (addr->sa.sa_family == AF_INET)
+    h ^= addr->in.sin_addr.s_addr ^ addr->in.sin_port;
+#ifdef HAVE_IPV6
+  else
+    {
+      unsigned int a;
+      memcpy(&a, &addr->in6.sin6_addr.s6_addr[12], sizeof(a));
+      h ^= a ^ addr->in6.sin6_port;
+    }
+#endif
+
+  h ^= h >> 16;
+  return h & daemon->frec_mask;
+}
+
+static void hash_frec(struct frec *f)
+{
+  struct frec **up = &daemon->frec_hash[f->new_id & daemon->frec_mask];
+  
+  f->hash_next = *up;
+  *up = f;
+
+  up = &daemon->frec_sender[sender_hash(f->orig_id, &f->source, f->crc)];
+  f->sender_next = *up;
+  *up = f;
+  f->hashed = 1;
+}
+
+static void unhash_frec(struct frec *f)
+{
+  struct frec **up;
+
+  for (up = &daemon->frec_hash[f->new_id & daemon->frec_mask]; *up; up = &(*up)->hash_next)
+    if (*up == f)
+      {
+	*up = f->hash_next;
+	break;
+      }
+  
+  for (up = &daemon->frec_sender[sender_hash(f->orig_id, &f->source, f->crc)]; *up; up = &(*up)->sender_next)
+    if (*up == f)
+      {
+	*up = f->sender_next;
+	break;
+      }
+
+  f->hashed = 0;
+}
+
 static struct frec *allocate_frec(time_t now)
 {
   struct frec *f;
   
-  if ((f = (struct frec *)whine_malloc(sizeof(struct frec))))
+  if ((f = daemon->frec_free))
     {
-      f->next = daemon->frec_list;
+      daemon->frec_free = f->next;
       f->time = now;
       f->sentto = NULL;
       f->rfd4 = NULL;
 #ifdef HAVE_IPV6
       f->rfd6 = NULL;
 #endif
-      daemon->frec_list = f;
+      f->inuse = 1;
+      
+      /* newest goes at the end */
+      f->next = NULL;
+      if ((f->prev = daemon->frec_newest))
+	f->prev->next = f;
+      else
+	daemon->frec_oldest = f;
+      daemon->frec_newest = f;
     }
 
   return f;
@@ -985,6 +1147,9 @@ static struct randfd *allocate_rfd(int family)
 
 static void free_frec(struct frec *f)
 {
+  if (!f->inuse)
+    return;
+
   if (f->rfd4 && --(f->rfd4->refcount) == 0)
     close(f->rfd4->fd);
     
@@ -997,73 +1162,63 @@ static void free_frec(struct frec *f)
     
   f->rfd6 = NULL;
 #endif
+
+  if (f->hashed)
+    unhash_frec(f);
+  
+  if (f->prev)
+    f->prev->next = f->next;
+  else
+    daemon->frec_oldest = f->next;
+  if (f->next)
+    f->next->prev = f->prev;
+  else
+    daemon->frec_newest = f->prev;
+
+  f->inuse = 0;
+  f->next = daemon->frec_free;
+  daemon->frec_free = f;
 }
 
 /* if wait==NULL return a free or older than TIMEOUT record.
-   else return *wait zero if one available, or *wait is delay to
-   when the oldest in-use record will expire. Impose an absolute
-   limit of 4*TIMEOUT before we wipe things (for random sockets) */
+   else return NULL and set *wait zero if one is available, or to
+   the delay until the oldest in-use record will expire. Impose an
+   absolute limit of 4*TIMEOUT before we wipe things (for random sockets) */
 struct frec *get_new_frec(time_t now, int *wait)
 {
-  struct frec *f, *oldest, *target;
-  int count;
+  struct frec *oldest;
   
   if (wait)
     *wait = 0;
 
-  for (f = daemon->frec_list, oldest = NULL, target =  NULL, count = 0; f; f = f->next, count++)
-    if (!f->sentto)
-      target = f;
-    else 
-      {
-	if (difftime(now, f->time) >= 4*TIMEOUT)
-	  {
-	    free_frec(f);
-	    target = f;
-	  }
-	
-	if (!oldest || difftime(f->time, oldest->time) <= 0)
-	  oldest = f;
-      }
-
-  if (target)
+  if (!daemon->frecs && !frec_init())
     {
-      target->time = now;
-      return target;
+      /* wait one second on malloc failure */
+      if (wait)
+	*wait = 1;
+      return NULL;
     }
+
+  while ((oldest = daemon->frec_oldest) && difftime(now, oldest->time) >= 4*TIMEOUT)
+    free_frec(oldest);
+
+  if (daemon->frec_free)
+    return wait ? NULL : allocate_frec(now);
   
-  /* can't find empty one, use oldest if there is one
-     and it's older than timeout */
-  if (oldest && ((int)difftime(now, oldest->time)) >= TIMEOUT)
-    { 
-      /* keep stuff for twice timeout if we can by allocating a new
-	 record instead */
-      if (difftime(now, oldest->time) < 2*TIMEOUT && 
-	  count <= daemon->ftabsize &&
-	  (f = allocate_frec(now)))
-	return f;
-
-      if (!wait)
-	{
-	  free_frec(oldest);
-	  oldest->time = now;
-	}
-      return oldest;
+  /* can't find empty one, use oldest if it's older than timeout */
+  if (((int)difftime(now, oldest->time)) >= TIMEOUT)
+    {
+      if (wait)
+	return NULL;
+      free_frec(oldest);
+      return allocate_frec(now);
     }
   
   /* none available, calculate time 'till oldest record expires */
-  if (count > daemon->ftabsize)
-    {
-      if (oldest && wait)
-	*wait = oldest->time + (time_t)TIMEOUT - now;
-      return NULL;
-    }
+  if (wait)
+    *wait = oldest->time + (time_t)TIMEOUT - now;
   
-  if (!(f = allocate_frec(now)) && wait)
-    /* wait one second on malloc failure */
-    *wait = 1;
-
-  return f; /* OK if malloc fails and this is NULL */
+  return NULL;
 }
  
 /* crc is all-ones if not known. */
@@ -1071,7 +1226,10 @@ static struct frec *lookup_frec(unsigned short id, unsigned int crc)
 {
   struct frec *f;
 
-  for(f = daemon->frec_list; f; f = f->next)
+  if (!daemon->frecs)
+    return NULL;
+
+  for (f = daemon->frec_hash[id & daemon->frec_mask]; f; f = f->hash_next)
     if (f->sentto && f->new_id == id && 
 	(f->crc == crc || crc == 0xffffffff))
       return f;
@@ -1085,7 +1243,10 @@ static struct frec *lookup_frec_by_sender(unsigned short id,
 {
   struct frec *f;
   
-  for(f = daemon->frec_list; f; f = f->next)
+  if (!daemon->frecs)
+    return NULL;
+
+  for (f = daemon->frec_sender[sender_hash(id, addr, crc)]; f; f = f->sender_next)
     if (f->sentto &&
 	f->orig_id == id && 
 	f->crc == crc &&
@@ -1098,11 +1259,14 @@ static struct frec *lookup_frec_by_sender(unsigned short id,
 /* A server record is going away, remove references to it */
 void server_gone(struct server *server)
 {
-  struct frec *f;
+  struct frec *f, *next;
   
-  for (f = daemon->frec_list; f; f = f->next)
-    if (f->sentto && f->sentto == server)
-      free_frec(f);
+  for (f = daemon->frec_oldest; f; f = next)
+    {
+      next = f->next;
+      if (f->sentto && f->sentto == server)
+	free_frec(f);
+    }
   
   if (daemon->last_server == server)
     daemon->last_server = NULL;
@@ -21,6 +21,151 @@
 static struct dhcp_lease *leases = NULL, *old_leases = NULL;
 static int dns_dirty, file_dirty, leases_left;
 
+/* The lease file is a journal: changed leases are appended to it and
+   removed ones get a "-" record, the last record for an address wins.
+   It is rewritten from scratch once it holds too many dead records. */
+#define JOURNAL_SLACK 64
+static int journal_lines, journal_compact;
+static struct in_addr *journal_del;
+static int journal_del_count, journal_del_size;
+
+/* Current leases are also hashed by address, hardware address and
+   client-id so that DHCP packets don't have to walk the list. */
+static struct dhcp_lease **hash_addr, **hash_hw, **hash_clid;
+static unsigned int hash_mask;
+
+static unsigned int hash_bytes(unsigned char *p, int len)
+{
+  unsigned int j = 0;
+
+  /* SDBM, as in address_allocate() */
+  while (len--)
+    j = *p++ + (j << 6) + (j << 16) - j;
+
+  return j & hash_mask;
+}
+
+static struct dhcp_lease **addr_bucket(struct in_addr addr)
+{
+  return &hash_addr[ntohl(addr.s_addr) & hash_mask];
+}
+
+static void hash_lease_hw(struct dhcp_lease *lease)
+{
+  struct dhcp_lease **up;
+
+  if (lease->hwaddr_len > DHCP_CHADDR_MAX)
+    return; /* not set yet */
+
+  up = &hash_hw[hash_bytes(lease->hwaddr, lease->hwaddr_len)];
+  lease->hw_next = *up;
+  *up = lease;
+}
+
+static void unhash_lease_hw(struct dhcp_lease *lease)
+{
+  struct dhcp_lease **up;
+
+  if (lease->hwaddr_len > DHCP_CHADDR_MAX)
+    return;
+
+  for (up = &hash_hw[hash_bytes(lease->hwaddr, lease->hwaddr_len)]; *up; up = &(*up)->hw_next)
+    if (*up == lease)
+      {
+	*up = lease->hw_next;
+	break;
+      }
+}
+
+static void hash_lease_clid(struct dhcp_lease *lease)
+{
+  struct dhcp_lease **up;
+
+  if (!lease->clid)
+    return;
+
+  up = &hash_clid[hash_bytes(lease->clid, lease->clid_len)];
+  lease->clid_next = *up;
+  *up = lease;
+}
+
+static void unhash_lease_clid(struct dhcp_lease *lease)
+{
+  struct dhcp_lease **up;
+
+  if (!lease->clid)
+    return;
+
+  for (up = &hash_clid[hash_bytes(lease->clid, lease->clid_len)]; *up; up = &(*up)->clid_next)
+    if (*up == lease)
+      {
+	*up = lease->clid_next;
+	break;
+      }
+}
+
+static void kill_name(struct dhcp_lease *lease);
+
+static void unhash_lease(struct dhcp_lease *lease)
+{
+  struct dhcp_lease **up;
+
+  for (up = addr_bucket(lease->addr); *up; up = &(*up)->addr_next)
+    if (*up == lease)
+      {
+	*up = lease->addr_next;
+	break;
+      }
+
+  unhash_lease_hw(lease);
+  unhash_lease_clid(lease);
+}
+
+/* drop a lease superseded by a later journal record */
+static void lease_forget(struct dhcp_lease *target)
+{
+  struct dhcp_lease *lease, **up;
+
+  for (up = &leases; (lease = *up); up = &lease->next)
+    if (lease == target)
+      {
+	*up = lease->next;
+	unhash_lease(lease);
+	context_mark_lease(lease->addr, 0);
+	kill_name(lease);
+	free(lease->old_hostname);
+	free(lease->clid);
+	free(lease->extradata);
+	free(lease);
+	leases_left++;
+	break;
+      }
+}
+
+static void journal_delete(struct in_addr addr)
+{
+  if (journal_del_count == journal_del_size)
+    {
+      struct in_addr *new;
+
+      if (!(new = whine_malloc((journal_del_size + 16) * sizeof(struct in_addr))))
+	{
+	  /* can't remember it, rewrite the whole file instead */
+	  journal_compact = 1;
+	  return;
+	}
+      if (journal_del)
+	{
+	  memcpy(new, journal_del, journal_del_count * sizeof(struct in_addr));
+	  free(journal_del);
+	}
+      journal_del = new;
+      journal_del_size += 16;
+    }
+
+  journal_del[journal_del_count++] = addr;
+}
+
 void lease_init(time_t now)
 {
   unsigned long ei;
@@ -37,6 +182,13 @@ void lease_init(time_t now)
  
   leases_left = daemon->dhcp_max;
 
+  for (hash_mask = 16; hash_mask < (unsigned int)daemon->dhcp_max; hash_mask <<= 1);
+  hash_addr = safe_malloc(3 * hash_mask * sizeof(struct dhcp_lease *));
+  memset(hash_addr, 0, 3 * hash_mask * sizeof(struct dhcp_lease *));
+  hash_hw = hash_addr + hash_mask;
+  hash_clid = hash_hw + hash_mask;
+  hash_mask--;
+
   if (daemon->options & OPT_LEASE_RO)
     {
       /* run "<lease_change_script> init" once to get the
@@ -77,13 +229,21 @@ void lease_init(time_t now)
 		  &ei, daemon->dhcp_buff2, daemon->namebuff, 
 		  daemon->dhcp_buff, daemon->packet) == 5)
       {
+	addr.s_addr = inet_addr(daemon->namebuff);
+	journal_lines++;
+
+	/* a later record replaces an earlier one for the same address */
+	if ((lease = lease_find_by_addr(addr)))
+	  lease_forget(lease);
+	
+	if (strcmp(daemon->dhcp_buff2, "-") == 0)
+	  continue;
+	
 	hw_len = parse_hex(daemon->dhcp_buff2, (unsigned char *)daemon->dhcp_buff2, DHCP_CHADDR_MAX, NULL, &hw_type);
 	/* For backwards compatibility, no explict MAC address type means ether. */
 	if (hw_type == 0 && hw_len != 0)
 	  hw_type = ARPHRD_ETHER;
 	
-	addr.s_addr = inet_addr(daemon->namebuff);
-	
 	/* decode hex in place */
 	clid_len = 0;
 	if (strcmp(daemon->packet, "*") != 0)
@@ -111,7 +271,7 @@ void lease_init(time_t now)
 
 	/* set these correctly: the "old" events are generated later from
 	   the startup synthesised SIGHUP. */
-	lease->new = lease->changed = 0;
+	lease->new = lease->changed = lease->unsaved = 0;
       }
   
 #ifdef HAVE_SCRIPT
@@ -139,6 +299,9 @@ void lease_init(time_t now)
 
   /* Some leases may have expired */
   file_dirty = 0;
+  /* the file may end in a record cut short by a crash, so the
+     first update rewrites it rather than appending after that */
+  journal_compact = 1;
   lease_prune(NULL, now);
   dns_dirty = 1;
 }
@@ -171,6 +334,44 @@ static void ourprintf(int *errp, char *format, ...)
   va_end(ap);
 }
 
+static void journal_write(int *errp, struct dhcp_lease *lease, time_t now)
+{
+  int i;
+
+#if 1	// zzz
+  ourprintf(errp, "%lu ", (unsigned long)lease->expires - now);
+#else
+#ifdef HAVE_BROKEN_RTC
+  ourprintf(errp, "%u ", lease->length);
+#else
+  ourprintf(errp, "%lu ", (unsigned long)lease->expires);
+#endif
+#endif
+  if (lease->hwaddr_type != ARPHRD_ETHER || lease->hwaddr_len == 0) 
+    ourprintf(errp, "%.2x-", lease->hwaddr_type);
+  for (i = 0; i < lease->hwaddr_len; i++)
+    {
+      ourprintf(errp, "%.2x", lease->hwaddr[i]);
+      if (i != lease->hwaddr_len - 1)
+	ourprintf(errp, ":");
+    }
+
+  ourprintf(errp, " %s ", inet_ntoa(lease->addr));
+  ourprintf(errp, "%s ", lease->hostname ? lease->hostname : "*");
+  	  
+  if (lease->clid && lease->clid_len != 0)
+    {
+      for (i = 0; i < lease->clid_len - 1; i++)
+	ourprintf(errp, "%.2x:", lease->clid[i]);
+      ourprintf(errp, "%.2x\n", lease->clid[i]);
+    }
+  else
+    ourprintf(errp, "*\n");	  
+
+  lease->unsaved = 0;
+  journal_lines++;
+}
+
 void lease_update_file(time_t now)
 {
   struct dhcp_lease *lease;
@@ -180,49 +381,42 @@ void lease_update_file(time_t now)
   if (file_dirty != 0 && daemon->lease_stream)
     {
       errno = 0;
-      rewind(daemon->lease_stream);
-      if (errno != 0 || ftruncate(fileno(daemon->lease_stream), 0) != 0)
-	err = errno;
-      
-      for (lease = leases; lease; lease = lease->next)
+
+      if (journal_compact || 
+	  journal_lines + journal_del_count >= 2 * (daemon->dhcp_max - leases_left) + JOURNAL_SLACK)
 	{
-#if 1	// zzz
-	  ourprintf(&err, "%lu ", (unsigned long)lease->expires - now);
-#else
-#ifdef HAVE_BROKEN_RTC
-	  ourprintf(&err, "%u ", lease->length);
-#else
-	  ourprintf(&err, "%lu ", (unsigned long)lease->expires);
-#endif
-#endif
-	  if (lease->hwaddr_type != ARPHRD_ETHER || lease->hwaddr_len == 0) 
-	    ourprintf(&err, "%.2x-", lease->hwaddr_type);
-	  for (i = 0; i < lease->hwaddr_len; i++)
+	  rewind(daemon->lease_stream);
+	  if (errno != 0 || ftruncate(fileno(daemon->lease_stream), 0) != 0)
+	    err = errno;
+	  
+	  journal_lines = journal_del_count = 0;
+	  for (lease = leases; lease; lease = lease->next)
+	    journal_write(&err, lease, now);
+	}
+      else
+	{
+	  /* append mode: writes go to the end of the file */
+	  for (i = 0; i < journal_del_count; i++)
 	    {
-	      ourprintf(&err, "%.2x", lease->hwaddr[i]);
-	      if (i != lease->hwaddr_len - 1)
-		ourprintf(&err, ":");
+	      ourprintf(&err, "0 - %s * *\n", inet_ntoa(journal_del[i]));
+	      journal_lines++;
 	    }
+	  journal_del_count = 0;
 
-	  ourprintf(&err, " %s ", inet_ntoa(lease->addr));
-	  ourprintf(&err, "%s ", lease->hostname ? lease->hostname : "*");
-	  	  
-	  if (lease->clid && lease->clid_len != 0)
-	    {
-	      for (i = 0; i < lease->clid_len - 1; i++)
-		ourprintf(&err, "%.2x:", lease->clid[i]);
-	      ourprintf(&err, "%.2x\n", lease->clid[i]);
-	    }
-	  else
-	    ourprintf(&err, "*\n");	  
+	  for (lease = leases; lease; lease = lease->next)
+	    if (lease->unsaved)
+	      journal_write(&err, lease, now);
 	}
       
       if (fflush(daemon->lease_stream) != 0 ||
 	  fsync(fileno(daemon->lease_stream)) < 0)
 	err = errno;
       
+      /* a failed append may leave a partial record, start again */
       if (!err)
-	file_dirty = 0;
+	file_dirty = journal_compact = 0;
+      else
+	journal_compact = 1;
     }
   
   /* Set alarm for when the first lease expires + slop. */
@@ -280,6 +474,9 @@ void lease_prune(struct dhcp_lease *target, time_t now)
 	    dns_dirty = 1;
 	  
 	  *up = lease->next; /* unlink */
+	  unhash_lease(lease);
+	  context_mark_lease(lease->addr, 0);
+	  journal_delete(lease->addr);
 	  
 	  /* Put on old_leases list 'till we
 	     can run the script */
@@ -299,19 +496,19 @@ struct dhcp_lease *lease_find_by_client(unsigned char *hwaddr, int hw_len, int h
 {
   struct dhcp_lease *lease;
 
-  if (clid)
-    for (lease = leases; lease; lease = lease->next)
+  if (clid && clid_len != 0)
+    for (lease = hash_clid[hash_bytes(clid, clid_len)]; lease; lease = lease->clid_next)
       if (lease->clid && clid_len == lease->clid_len &&
 	  memcmp(clid, lease->clid, clid_len) == 0)
 	return lease;
   
-  for (lease = leases; lease; lease = lease->next)	
-    if ((!lease->clid || !clid) && 
-	hw_len != 0 && 
-	lease->hwaddr_len == hw_len &&
-	lease->hwaddr_type == hw_type &&
-	memcmp(hwaddr, lease->hwaddr, hw_len) == 0)
-      return lease;
+  if (hw_len != 0 && hw_len <= DHCP_CHADDR_MAX)
+    for (lease = hash_hw[hash_bytes(hwaddr, hw_len)]; lease; lease = lease->hw_next)	
+      if ((!lease->clid || !clid) && 
+	  lease->hwaddr_len == hw_len &&
+	  lease->hwaddr_type == hw_type &&
+	  memcmp(hwaddr, lease->hwaddr, hw_len) == 0)
+	return lease;
   
   return NULL;
 }
@@ -320,7 +517,7 @@ struct dhcp_lease *lease_find_by_addr(struct in_addr addr)
 {
   struct dhcp_lease *lease;
 
-  for (lease = leases; lease; lease = lease->next)
+  for (lease = *addr_bucket(addr); lease; lease = lease->addr_next)
     if (lease->addr.s_addr == addr.s_addr)
       return lease;
   
@@ -344,8 +541,11 @@ struct dhcp_lease *lease_allocate(struct in_addr addr)
 #endif
   lease->next = leases;
   leases = lease;
+  lease->addr_next = *addr_bucket(addr);
+  *addr_bucket(addr) = lease;
+  context_mark_lease(addr, 1);
   
-  file_dirty = 1;
+  lease->unsaved = file_dirty = 1;
   leases_left--;
 
   return lease;
@@ -366,7 +566,7 @@ void lease_set_expires(struct dhcp_lease *lease, unsigned int len, time_t now)
       dns_dirty = 1;
       lease->expires = exp;
 #ifndef HAVE_BROKEN_RTC
-      lease->aux_changed = file_dirty = 1;
+      lease->aux_changed = lease->unsaved = file_dirty = 1;
 #endif
     }
   
@@ -374,7 +574,7 @@ void lease_set_expires(struct dhcp_lease *lease, unsigned int len, time_t now)
   if (len != lease->length)
     {
       lease->length = len;
-      lease->aux_changed = file_dirty = 1; 
+      lease->aux_changed = lease->unsaved = file_dirty = 1; 
     }
 #endif
 } 
@@ -386,10 +586,12 @@ void lease_set_hwaddr(struct dhcp_lease *lease, unsigned char *hwaddr,
       hw_type != lease->hwaddr_type || 
       (hw_len != 0 && memcmp(lease->hwaddr, hwaddr, hw_len) != 0))
     {
+      unhash_lease_hw(lease);
       memcpy(lease->hwaddr, hwaddr, hw_len);
       lease->hwaddr_len = hw_len;
       lease->hwaddr_type = hw_type;
-      lease->changed = file_dirty = 1; /* run script on change */
+      hash_lease_hw(lease);
+      lease->changed = lease->unsaved = file_dirty = 1; /* run script on change */
     }
 
   /* only update clid when one is available, stops packets
@@ -400,18 +602,21 @@ void lease_set_hwaddr(struct dhcp_lease *lease, unsigned char *hwaddr,
       if (!lease->clid)
 	lease->clid_len = 0;
 
+      unhash_lease_clid(lease);
+
       if (lease->clid_len != clid_len)
 	{
-	  lease->aux_changed = file_dirty = 1;
+	  lease->aux_changed = lease->unsaved = file_dirty = 1;
 	  free(lease->clid);
 	  if (!(lease->clid = whine_malloc(clid_len)))
 	    return;
 	}
       else if (memcmp(lease->clid, clid, clid_len) != 0)
-	lease->aux_changed = file_dirty = 1;
+	lease->aux_changed = lease->unsaved = file_dirty = 1;
 	  
       lease->clid_len = clid_len;
       memcpy(lease->clid, clid, clid_len);
+      hash_lease_clid(lease);
     }
 
 }
@@ -504,7 +709,7 @@ void lease_set_hostname(struct dhcp_lease *lease, char *name, int auth)
   lease->fqdn = new_fqdn;
   lease->auth_name = auth;
   
-  file_dirty = 1;
+  lease->unsaved = file_dirty = 1;
   dns_dirty = 1; 
   lease->changed = 1; /* run script on change */
 }
@@ -545,7 +750,7 @@ int do_script_run(time_t now)
   if (old_leases)
     {
       lease = old_leases;
-                  
+		  
       /* If the lease still has an old_hostname, do the "old" action on that first */
       if (lease->old_hostname)
 	{
@@ -615,22 +820,43 @@ int do_script_run(time_t now)
 
       
 
+static void dump_leases(FILE *f, time_t now)
+{
+	struct dhcp_lease *lease;
+
+	for (lease = leases; lease; lease = lease->next) {
+		if (lease->hwaddr_type == ARPHRD_ETHER) {
+			fprintf(f, "%lu %02X:%02X:%02X:%02X:%02X:%02X %s %s\n",
+				lease->expires - now,
+				lease->hwaddr[0], lease->hwaddr[1], lease->hwaddr[2], lease->hwaddr[3], lease->hwaddr[4], lease->hwaddr[5],
+				inet_ntoa(lease->addr),
+				((lease->hostname) && (strlen(lease->hostname) > 0)) ? lease->hostname : "*");
+		}
+	}
+}
+
+static void delete_lease(char *ip, time_t now)
+{
+	struct in_addr ia;
+	struct dhcp_lease *lease;
+
+	ia.s_addr = inet_addr(ip);
+	lease = lease_find_by_addr(ia);
+	if (lease) {
+		lease_prune(lease, 0);
+		lease_update_file(now);
+	}
+}
+
 void tomato_helper(time_t now)
 {
 	FILE *f;
-	struct in_addr ia;
 	char buf[64];
-	struct dhcp_lease *lease;
 
 	// if delete exists...
 	if ((f = fopen("/var/tmp/dhcp/delete", "r")) != NULL) {
 		while (fgets(buf, sizeof(buf), f)) {
-			ia.s_addr = inet_addr(buf);
-			lease = lease_find_by_addr(ia);
-			if (lease) {
-				lease_prune(lease, 0);
-				lease_update_file(now);
-			}
+			delete_lease(buf, now);
 		}
 		fclose(f);
 		unlink("/var/tmp/dhcp/delete");
@@ -638,23 +864,96 @@ void tomato_helper(time_t now)
 
 	// dump the leases file
 	if ((f = fopen("/var/tmp/dhcp/leases.!", "w")) != NULL) {
-		for (lease = leases; lease; lease = lease->next) {
-			if (lease->hwaddr_type == ARPHRD_ETHER) {
-				fprintf(f, "%lu %02X:%02X:%02X:%02X:%02X:%02X %s %s\n",
-					lease->expires - now,
-					lease->hwaddr[0], lease->hwaddr[1], lease->hwaddr[2], lease->hwaddr[3], lease->hwaddr[4], lease->hwaddr[5],
-					inet_ntoa(lease->addr),
-					((lease->hostname) && (strlen(lease->hostname) > 0)) ? lease->hostname : "*");
-			}
-		}
+		dump_leases(f, now);
 		fclose(f);
 		rename("/var/tmp/dhcp/leases.!", "/var/tmp/dhcp/leases");
 	}
 }
 
+// lease queries from httpd: connect, send "list" or "delete <ip>", read until EOF
+// One client at a time, and its request is only read once select() says it's there,
+// so a slow or stuck client never holds up DNS or DHCP.
+#define LEASE_QUERY_SOCK	"/var/tmp/dhcp/leases.sock"
+#define LEASE_QUERY_WAIT	2
+
+static time_t lease_query_start;
+
+void lease_query_init(void)
+{
+	struct sockaddr_un sa;
+	int fd;
+
+	daemon->leasequeryfd = -1;
+	daemon->leasequeryconn = -1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, LEASE_QUERY_SOCK);
+	unlink(sa.sun_path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) return;
+	if ((bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1) || (listen(fd, 5) == -1) || (!fix_fd(fd))) {
+		my_syslog(MS_DHCP | LOG_WARNING, _("cannot create lease query socket %s: %s"), sa.sun_path, strerror(errno));
+		close(fd);
+		return;
+	}
+	chmod(sa.sun_path, 0600);	// httpd runs as root
+	daemon->leasequeryfd = fd;
+}
+
+// the listening socket is readable
+void lease_query(time_t now)
+{
+	int fd;
+
+	if ((fd = accept(daemon->leasequeryfd, NULL, NULL)) == -1) return;
+
+	if (daemon->leasequeryconn != -1) {
+		if (difftime(now, lease_query_start) < LEASE_QUERY_WAIT) {
+			close(fd);
+			return;
+		}
+		// never sent its request
+		close(daemon->leasequeryconn);
+	}
+	if (!fix_fd(fd)) {
+		close(fd);
+		daemon->leasequeryconn = -1;
+		return;
+	}
+	daemon->leasequeryconn = fd;
+	lease_query_start = now;
+
+	// the request is usually there already
+	lease_query_read(now);
+}
+
+// the client's socket is readable, or was just accepted
+void lease_query_read(time_t now)
+{
+	FILE *f;
+	int fd, n;
+	char buf[64];
+
+	fd = daemon->leasequeryconn;
+	if (((n = read(fd, buf, sizeof(buf) - 1)) == -1) && (errno == EAGAIN)) return;
+	daemon->leasequeryconn = -1;
+
+	// the reply is written non-blocking too; the lease list fits in the socket buffer
+	if ((n <= 0) || ((f = fdopen(fd, "w")) == NULL)) {
+		close(fd);
+		return;
+	}
+	buf[n] = 0;
+
+	if (strncmp(buf, "list", 4) == 0) dump_leases(f, now);
+		else if (strncmp(buf, "delete ", 7) == 0) delete_lease(buf + 7, now);
+	fclose(f);
+}
+
 void flush_lease_file(time_t now)
 {
-	file_dirty = 1;
+	file_dirty = journal_compact = 1;
 	lease_update_file(now);
 }
 
@@ -108,6 +108,11 @@ struct myoption {
 #define LOPT_MAXTTL    297
 #define LOPT_NO_REBIND 298
 #define LOPT_LOC_REBND 299
+#define LOPT_BLOCKLIST 300
+#define LOPT_BL_RULE   301
+#define LOPT_BL_REPLY  302
+#define LOPT_PREFETCH  303
+#define LOPT_STALE     304
 
 #ifdef HAVE_GETOPT_LONG
 static const struct option opts[] =  
@@ -221,6 +226,11 @@ static const struct myoption opts[] =
     { "dhcp-proxy", 2, 0, LOPT_PROXY },
     { "dhcp-generate-names", 2, 0, LOPT_GEN_NAMES },
     { "rebind-localhost-ok", 0, 0,  LOPT_LOC_REBND },
+    { "blocklist", 1, 0, LOPT_BLOCKLIST },
+    { "blocklist-rule", 1, 0, LOPT_BL_RULE },
+    { "blocklist-reply", 1, 0, LOPT_BL_REPLY },
+    { "cache-prefetch", 2, 0, LOPT_PREFETCH },
+    { "cache-stale", 2, 0, LOPT_STALE },
     { NULL, 0, 0, 0 }
   };
 
@@ -341,6 +351,11 @@ static struct {
   { LOPT_PXE_PROMT, ARG_DUP, "<prompt>,[<timeout>]", gettext_noop("Prompt to send to PXE clients."), NULL },
   { LOPT_PXE_SERV, ARG_DUP, "<service>", gettext_noop("Boot service for PXE menu."), NULL },
   { LOPT_TEST, 0, NULL, gettext_noop("Check configuration syntax."), NULL },
+  { LOPT_BLOCKLIST, ARG_DUP, "<file>[,<tag>]", gettext_noop("Block domains listed in file, for all clients or for those of a blocklist-rule."), NULL },
+  { LOPT_BL_RULE, ARG_DUP, "<tag>,<begin>,<end>,<days>[,[!],<client>...]", gettext_noop("Apply tagged blocklists to clients during a schedule."), NULL },
+  { LOPT_BL_REPLY, ARG_ONE, "nxdomain|null", gettext_noop("Answer blocked queries with NXDOMAIN (default) or a null address."), NULL },
+  { LOPT_PREFETCH, ARG_ONE, "[=<hits>[,<secs>]]", gettext_noop("Refresh cached names queried <hits> times when <secs> from expiry (defaults %s)."), "3,10" },
+  { LOPT_STALE, ARG_ONE, "[=<secs>]", gettext_noop("Answer from expired cache entries for up to <secs> while refreshing them (default %s)."), "3600" },
   { 0, 0, NULL, NULL, NULL }
 }; 
 
@@ -2478,6 +2493,126 @@ static char *one_opt(int option, char *arg, char *gen_prob, int nest)
 	break;
       }
       
+    case LOPT_BLOCKLIST: /* --blocklist */
+      {
+	struct blocklist *new, **up;
+
+	comma = split(arg);
+	new = opt_malloc(sizeof(struct blocklist));
+	memset(new, 0, sizeof(struct blocklist));
+	new->file = opt_string_alloc(arg);
+	new->tag = opt_string_alloc(comma);
+	/* keep command-line order */
+	for (up = &daemon->blocklists; *up; up = &((*up)->next));
+	*up = new;
+	break;
+      }
+
+    case LOPT_BL_RULE: /* --blocklist-rule */
+      {
+	struct blocklist_rule *new;
+	struct blocklist_client *client;
+	char *a[4];
+	int k;
+
+	for (k = 0; k < 4; k++)
+	  {
+	    a[k] = arg;
+	    arg = comma = split(arg);
+	  }
+
+	if (!a[0] || !a[3])
+	  {
+	    problem = _("bad blocklist rule");
+	    break;
+	  }
+
+	new = opt_malloc(sizeof(struct blocklist_rule));
+	memset(new, 0, sizeof(struct blocklist_rule));
+	new->tag = opt_string_alloc(a[0]);
+	new->begin = (int)strtol(a[1], NULL, 10);
+	new->end = (int)strtol(a[2], NULL, 10);
+	new->dow = (int)strtol(a[3], NULL, 10) & 0x7f;
+
+	/* clients are MAC addresses, IP addresses or ranges, as in the
+	   restrictions rules. A lone "!" means everyone except these. */
+	for (; arg; arg = comma)
+	  {
+	    char *dash;
+
+	    comma = split(arg);
+	    if (strcmp(arg, "!") == 0)
+	      {
+		new->except = 1;
+		continue;
+	      }
+
+	    client = opt_malloc(sizeof(struct blocklist_client));
+	    memset(client, 0, sizeof(struct blocklist_client));
+	    if (strchr(arg, ':'))
+	      {
+		client->flags = BLC_MAC;
+		if (parse_hex(arg, client->hwaddr, ETHER_ADDR_LEN, NULL, NULL) != ETHER_ADDR_LEN)
+		  problem = _("bad MAC address");
+	      }
+	    else
+	      {
+		if ((dash = split_chr(arg, '-')))
+		  client->end.s_addr = inet_addr(dash);
+		if ((client->start.s_addr = inet_addr(arg)) == (in_addr_t)-1 ||
+		    (dash && client->end.s_addr == (in_addr_t)-1))
+		  problem = _("bad address");
+		if (!dash)
+		  client->end = client->start;
+	      }
+	    client->next = new->clients;
+	    new->clients = client;
+	  }
+
+	new->next = daemon->blocklist_rules;
+	daemon->blocklist_rules = new;
+	break;
+      }
+
+    case LOPT_PREFETCH: /* --cache-prefetch */
+      {
+	int hits = PREFETCH_HITS, secs = PREFETCH_SECS;
+	
+	if (arg)
+	  {
+	    comma = split(arg);
+	    if (!atoi_check(arg, &hits) || hits < 1 || hits > 0xffff ||
+		(comma && (!atoi_check(comma, &secs) || secs < 1)))
+	      {
+		option = '?';
+		break;
+	      }
+	  }
+	daemon->prefetch_hits = hits;
+	daemon->prefetch_secs = (unsigned long)secs;
+	break;
+      }
+
+    case LOPT_STALE: /* --cache-stale */
+      {
+	int secs = STALE_SECS;
+	
+	if (arg && (!atoi_check(arg, &secs) || secs < 0))
+	  option = '?';
+	else
+	  daemon->cache_stale = (unsigned long)secs;
+	break;
+      }
+
+    case LOPT_BL_REPLY: /* --blocklist-reply */
+      if (strcmp(arg, "null") == 0)
+	daemon->blocklist_null = 1;
+      else if (strcmp(arg, "nxdomain") == 0)
+	daemon->blocklist_null = 0;
+      else
+	option = '?';
+      break;
+
     case LOPT_INTNAME:  /* --interface-name */
       {
 	struct interface_name *new, **up;
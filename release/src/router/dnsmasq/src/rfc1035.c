@@ -1159,6 +1159,10 @@ static unsigned long crec_ttl(struct crec *crecp, time_t now)
   if  (crecp->flags & (F_IMMORTAL | F_DHCP))
     return daemon->local_ttl;
   
+  /* stale record, see cache-stale */
+  if (difftime(now, crecp->ttd) > 0)
+    return STALE_TTL;
+
   /* Return the Max TTL value if it is lower then the actual TTL */
   if (daemon->max_ttl == 0 || ((unsigned)(crecp->ttd - now) < daemon->max_ttl))
     return crecp->ttd - now;
@@ -1440,6 +1444,9 @@ size_t answer_request(HEADER *header, char *limit, size_t qlen,
 		{
 		  int localise = 0;
 		  
+		  if (!dryrun)
+		    cache_hit(crecp, name, type, now);
+
 		  /* See if a putative address is on the network from which we recieved
 		     the query, is so we'll filter other answers. */
 		  if (local_addr.s_addr != 0 && (daemon->options & OPT_LOCALISE) && flag == F_IPV4)
@@ -29,7 +29,7 @@ void wi_blackhole(char *url, int len, char *boundary)
 			"<form method='post' action='blackhole.cgi?_http_id=%s' encType='multipart/form-data'>"
 			"<input type='file' name='file'><input type='submit'>"
 			"</form>",
-			nvram_safe_get("http_id"));
+			session_id() ? : nvram_safe_get("http_id"));
 		return;
 	}
 
@@ -14,67 +14,32 @@
 #include <sys/types.h>
 
 #include <wlutils.h>
+#include <arpa/inet.h>
+#include <linux/rtnetlink.h>
 
 
 void asp_arplist(int argc, char **argv)
 {
-	FILE *f;
-	char s[512];
-	char ip[16];
+	rtnl_neigh_t *list;
 	char mac[18];
-	char dev[17];
 	char comma;
-	unsigned int flags;
-
-	/*
-		cat /proc/net/arp
-		IP address       HW type     Flags       HW address            Mask     Device
-		192.168.0.1      0x1         0x2         00:01:02:03:04:05     *        vlan1
-	*/
+	int i, n;
 
 	web_puts("\narplist = [");
 	comma = ' ';
-	if ((f = fopen("/proc/net/arp", "r")) != NULL) {
-		while (fgets(s, sizeof(s), f)) {
-			if (sscanf(s, "%15s %*s 0x%X %17s %*s %16s", ip, &flags, mac, dev) != 4) continue;
-			if ((strlen(mac) != 17) || (strcmp(mac, "00:00:00:00:00:00") == 0)) continue;
-			if (flags == 0) continue;
-//			if ((nvram_match("wan_ifname", dev)) && (!nvram_match("wan_ipaddr", ip))) continue; // half
-			web_printf("%c['%s','%s','%s']", comma, ip, mac, dev);
-			comma = ',';
-		}
-		fclose(f);
+	n = rtnl_neigh(&list);
+	for (i = 0; i < n; ++i) {
+		// the complete entries in /proc/net/arp
+		if ((list[i].state & (NUD_PERMANENT | NUD_REACHABLE | NUD_STALE | NUD_DELAY | NUD_PROBE)) == 0) continue;
+		if (memcmp(list[i].mac, "\0\0\0\0\0\0", 6) == 0) continue;
+//		if ((nvram_match("wan_ifname", list[i].ifname)) && (!nvram_match("wan_ipaddr", inet_ntoa(list[i].addr)))) continue; // half
+		web_printf("%c['%s','%s','%s']", comma, inet_ntoa(list[i].addr), ether_etoa(list[i].mac, mac), list[i].ifname);
+		comma = ',';
 	}
+	free(list);
 	web_puts("];\n");
 }
 
-// checkme: any easier way to do this?	zzz
-static int get_wds_ifname(const struct ether_addr *ea, char *ifname)
-{
-	struct ifreq ifr;
-	int sd;
-	int i;
-	struct ether_addr e;
-
-	if ((sd = socket(PF_INET, SOCK_DGRAM, 0)) >= 0) {
-		// wds doesn't show up under SIOCGIFCONF; seems to start at 17 (?)
-		for (i = 1; i < 32; ++i) {
-			ifr.ifr_ifindex = i;
-			if ((ioctl(sd, SIOCGIFNAME, &ifr) == 0) &&
-				(strncmp(ifr.ifr_name, "wds", 3) == 0) &&
-				(wl_ioctl(ifr.ifr_name, WLC_WDS_GET_REMOTE_HWADDR, &e.octet, sizeof(e.octet)) == 0)) {
-				if (memcmp(ea->octet, e.octet, sizeof(e.octet)) == 0) {
-					close(sd);
-					strlcpy(ifname, ifr.ifr_name, 16);
-					return 1;
-				}
-			}
-		}
-		close(sd);
-	}
-	return 0;
-}
-
 void asp_devlist(int argc, char **argv)
 {
 	char *p;
@@ -95,101 +60,24 @@ void asp_devlist(int argc, char **argv)
 
 	//
 
-#if 1
-	char *wlif;
-	scb_val_t rssi;
-	sta_info_t sti;
-	int cmd;
-	struct maclist *mlist;
-	int mlsize;
-	char ifname[16];
+	wlsta_t *sta;
+	int n;
 
+	// ifname, mac, rssi, max rate (kbps), idle, connected (seconds)
 	web_puts("wldev = [");
 	comma = ' ';
-	mlsize = sizeof(struct maclist) + (255 * sizeof(struct ether_addr));
-	if ((mlist = malloc(mlsize)) != NULL) {
-		wlif = nvram_safe_get("wl0_ifname");
-		cmd = WLC_GET_ASSOCLIST;
-		while (1) {
-			mlist->count = 255;
-			if (wl_ioctl(wlif, cmd, mlist, mlsize) == 0) {
-				for (i = 0; i < mlist->count; ++i) {
-					rssi.ea = mlist->ea[i];
-					rssi.val = 0;
-					if (wl_ioctl(wlif, WLC_GET_RSSI, &rssi, sizeof(rssi)) != 0) continue;
-
-					// sta_info0<mac>
-					memset(&sti, 0, sizeof(sti));
-					strcpy((char *)&sti, "sta_info");
-					memcpy((char *)&sti + 9, rssi.ea.octet, 6);
-					if (wl_ioctl(wlif, WLC_GET_VAR, &sti, sizeof(sti)) != 0) continue;
-
-					p = wlif;
-					if (sti.flags & WL_STA_WDS) {
-						if (cmd != WLC_GET_WDSLIST) continue;
-						if ((sti.flags & WL_WDS_LINKUP) == 0) continue;
-						if (get_wds_ifname(&rssi.ea, ifname)) p = ifname;
-					}
-
-					web_printf("%c['%s','%s',%d]",
-						comma,
-						p,
-						ether_etoa(rssi.ea.octet, buf),
-						rssi.val);
-					comma = ',';
-				}
-			}
-			if (cmd == WLC_GET_WDSLIST) break;
-			cmd = WLC_GET_WDSLIST;
-		}
-		free(mlist);
-	}
-#else
-	char *wlif;
-	scb_val_t rssi;
-	sta_info_t sti;
-	int j;
-	struct maclist *mlist;
-	int mlsize;
-	char ifname[16];
-
-	web_puts("wldev = [");
-	comma = ' ';
-	mlsize = sizeof(struct maclist) + (127 * sizeof(struct ether_addr));
-	if ((mlist = malloc(mlsize)) != NULL) {
-		for (j = 0; j < 2; ++j) {
-			wlif = nvram_safe_get("wl0_ifname");
-			strcpy((char *)mlist, j ? "autho_sta_list" : "authe_sta_list");
-			if (wl_ioctl(wlif, WLC_GET_VAR, mlist, mlsize) == 0) {
-				for (i = 0; i < mlist->count; ++i) {
-					rssi.ea = mlist->ea[i];
-					rssi.val = 0;
-					if (wl_ioctl(wlif, WLC_GET_RSSI, &rssi, sizeof(rssi)) != 0) continue;
-
-					// sta_info0<mac>
-					memset(&sti, 0, sizeof(sti));
-					strcpy((char *)&sti, "sta_info");
-					memcpy((char *)&sti + 9, rssi.ea.octet, 6);
-					if (wl_ioctl(wlif, WLC_GET_VAR, &sti, sizeof(sti)) != 0) continue;
-
-					p = wlif;
-					if (sti.flags & WL_STA_WDS) {
-						if ((sti.flags & WL_WDS_LINKUP) == 0) continue;
-						if (get_wds_ifname(&rssi.ea, ifname)) p = ifname;
-					}
-
-					web_printf("%c['%s','%s',%d]",
-						comma,
-						p,
-						ether_etoa(rssi.ea.octet, buf),
-						rssi.val);
-					comma = ',';
-				}
-			}
+	if ((sta = malloc(WLSTA_MAX * sizeof(*sta))) != NULL) {
+		n = wlsta_get(nvram_safe_get("wl0_ifname"), sta, WLSTA_MAX);
+		for (i = 0; i < n; ++i) {
+			web_printf("%c['%s','%s',%d,%u,%u,%u]",
+				comma,
+				sta[i].ifname,
+				ether_etoa(sta[i].mac, buf),
+				sta[i].rssi, sta[i].max_rate, sta[i].idle, sta[i].in);
+			comma = ',';
 		}
-		free(mlist);
+		free(sta);
 	}
-#endif
 
 	web_puts("];\n");
 
@@ -203,15 +91,7 @@ void asp_devlist(int argc, char **argv)
 
 	web_puts("dhcpd_lease = [");
 	if (nvram_match("lan_proto", "dhcp")) {
-		f_write("/var/tmp/dhcp/leases.!", NULL, 0, 0, 0666);
-
-		// dump the leases to a file
-		if (killall("dnsmasq", SIGUSR2) == 0) {
-			// helper in dnsmasq will remove this when it's done
-			f_wait_notexists("/var/tmp/dhcp/leases.!", 5);
-		}
-
-		if ((f = fopen("/var/tmp/dhcp/leases", "r")) != NULL) {
+		if ((f = dhcpd_query("list\n")) != NULL) {
 			comma = ' ';
 			while (fgets(buf, sizeof(buf), f)) {
 				if (sscanf(buf, "%lu %17s %15s %255s", &expires, mac, ip, hostname) != 4) continue;
@@ -223,7 +103,6 @@ void asp_devlist(int argc, char **argv)
 			}
 			fclose(f);
 		}
-		unlink("/var/tmp/dhcp/leases");
 	}
 	web_puts("];");
 }
@@ -10,6 +10,8 @@
 #include <sys/sysinfo.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 
 void asp_dhcpc_time(int argc, char **argv)
@@ -49,14 +51,42 @@ void wo_dhcpc(char *url)
 // -----------------------------------------------------------------------------
 
 
+// ask dnsmasq directly, the reply is read until it closes the connection
+FILE *dhcpd_query(const char *cmd)
+{
+	struct sockaddr_un sa;
+	struct timeval tv;
+	int fd;
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return NULL;
+
+	tv.tv_sec = 5;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, "/var/tmp/dhcp/leases.sock");
+	if ((connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0) && (write(fd, cmd, strlen(cmd)) == strlen(cmd))) {
+		return fdopen(fd, "r");
+	}
+	close(fd);
+	return NULL;
+}
+
 void wo_dhcpd(char *url)
 {
 	char *p;
+	char buf[64];
+	FILE *f;
 
 	if ((p = webcgi_get("remove")) != NULL) {
-		f_write_string("/var/tmp/dhcp/delete", p, FW_CREATE|FW_NEWLINE, 0666);
-		killall("dnsmasq", SIGUSR2);
-		f_wait_notexists("/var/tmp/dhcp/delete", 5);
+		snprintf(buf, sizeof(buf), "delete %s\n", p);
+		if ((f = dhcpd_query(buf)) != NULL) {
+			// wait for it to finish
+			while (fgetc(f) != EOF) ;
+			fclose(f);
+		}
 	}
 	web_puts("{}");
 }
@@ -139,6 +139,7 @@ void send_header(int status, const char* header, const char* mime, int cache)
 				 "Pragma: no-cache\r\n");
 	}
 	if (header) web_printf("%s\r\n", header);
+	if ((header = session_setcookie()) != NULL) web_printf("Set-Cookie: %s\r\n", header);
 	web_puts("Connection: close\r\n\r\n");
 
 	header_sent = 1;
@@ -221,25 +222,35 @@ static void send_authenticate(void)
 
 typedef enum { AUTH_NONE, AUTH_OK, AUTH_BAD } auth_t;
 
-static auth_t auth_check(const char *authorization)
+static int auth_user(const char *user, const char *pass)
 {
-	char buf[512];
 	const char *p;
+
+	if ((strcmp(user, "admin") == 0) || (strcmp(user, "root") == 0)) {
+		p = nvram_get("http_passwd");
+		if (strcmp(pass, ((p == NULL) || (*p == 0)) ? "admin" : p) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static auth_t auth_check(const char *authorization, const char *cookie)
+{
+	char buf[512];
 	char* pass;
 	int len;
 
+	// a session needs no nvram and no decoding
+	if ((cookie != NULL) && (session_check(cookie))) return AUTH_OK;
+
 	if ((authorization != NULL) && (strncasecmp(authorization, "Basic ", 6) == 0)) {
 		if (base64_decoded_len(strlen(authorization + 6)) <= sizeof(buf)) {
 			len = base64_decode(authorization + 6, buf, strlen(authorization) - 6);
 			buf[len] = 0;
 			if ((pass = strchr(buf, ':')) != NULL) {
 				*pass++ = 0;
-				if ((strcmp(buf, "admin") == 0) || (strcmp(buf, "root") == 0)) {
-					p = nvram_get("http_passwd");
-					if (strcmp(pass, ((p == NULL) || (*p == 0)) ? "admin" : p) == 0) {
-						return AUTH_OK;
-					}
-				}
+				if (auth_user(buf, pass)) return AUTH_OK;
 			}
 		}
 		return AUTH_BAD;
@@ -248,6 +259,17 @@ static auth_t auth_check(const char *authorization)
 	return AUTH_NONE;
 }
 
+// login.cgi
+int login(const char *user, const char *pass)
+{
+	if (!auth_user(user, pass)) {
+		syslog(LOG_WARNING, "Bad login from %s", inet_ntoa(clientsai.sin_addr));
+		return 0;
+	}
+	session_issue();
+	return 1;
+}
+
 static void auth_fail(int clen)
 {
 	if (post) web_eat(clen);
@@ -328,7 +350,7 @@ static int match(const char* pattern, const char* string)
 void do_file(char *path)
 {
 	FILE *f;
-	char buf[1024];
+	char buf[16 * 1024];
 	int nr;
 	if ((f = fopen(path, "r")) != NULL) {
 		while ((nr = fread(buf, 1, sizeof(buf), f)) > 0)
@@ -340,7 +362,7 @@ void do_file(char *path)
 static void handle_request(void)
 {
 	char line[10000], *cur;
-	char *method, *path, *protocol, *authorization, *boundary;
+	char *method, *path, *protocol, *authorization, *cookie, *boundary;
 	char *cp;
 	char *file;
 	const struct mime_handler *handler;
@@ -349,7 +371,7 @@ static void handle_request(void)
 
 	user_agent = "";
 	header_sent = 0;
-	authorization = boundary = NULL;
+	authorization = cookie = boundary = NULL;
 	bzero(line, sizeof(line));
 
 	// Parse the first line of the request.
@@ -436,6 +458,12 @@ static void handle_request(void)
 			authorization = cp;
 			cur = cp + strlen(cp) + 1;
 		}
+		else if (strncasecmp(cur, "Cookie:", 7) == 0) {
+			cp = &cur[7];
+			cp += strspn(cp, " \t");
+			cookie = cp;
+			cur = cp + strlen(cp) + 1;
+		}
 		else if (strncasecmp(cur, "Content-Length:", 15) == 0) {
 			cp = &cur[15];
 			cp += strspn(cp, " \t");
@@ -461,7 +489,8 @@ static void handle_request(void)
 
 	post = (strcasecmp(method, "post") == 0);
 
-	auth = auth_check(authorization);
+	auth = auth_check(authorization, cookie);
+	if (auth == AUTH_OK) session_issue();
 
 #if 0
 	cprintf("UserAgent: %s\n", user_agent);
@@ -490,12 +519,15 @@ static void handle_request(void)
 	- It does not clear the authentication even if AUTH_NONE request succeeds.
 	- If user doesn't enter anything (blank) for credential, it sends the
 	  previous credential.
+	- The session cookie goes with the AUTH_NONE request too, so this only
+	  happens once per session.
 
 	*/
 
 	if (strcmp(file, "logout") == 0) {	// special case
 		wi_generic(file, cl, boundary);
 		eat_garbage();
+		session_revoke();
 
 		if (strstr(user_agent, "Chrome/") != NULL) {
 			if (auth != AUTH_BAD) {
@@ -652,6 +684,8 @@ static void init_id(void)
 
 void check_id(const char *url)
 {
+	if (session_check_id(webcgi_safeget("_http_id", ""))) return;
+
 	if (!nvram_match("http_id", webcgi_safeget("_http_id", ""))) {
 #if 0
 		const char *hid = nvram_safe_get("http_id");
@@ -799,6 +833,7 @@ int main(int argc, char **argv)
 	}
 
 	init_id();
+	session_init(server_port);
 
 	for (;;) {
 		webcgi_init(NULL);
@@ -823,6 +858,8 @@ int main(int argc, char **argv)
 			continue;
 		}
 
+		session_init(server_port);	// new key after a logout
+
 		if (fork() == 0) {
 			close(listenfd);
 
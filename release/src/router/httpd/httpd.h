@@ -35,6 +35,8 @@ extern void web_puts(const char *buffer);
 extern void web_putj(const char *buffer);
 extern void web_puth(const char *buffer);
 extern int web_write(const char *buffer, int len);
+extern int web_writev(const struct iovec *iov, int iovcnt);
+#define WEB_WRITEV_MIN	4096
 extern int web_read(void *buffer, int len);
 extern int web_read_x(void *b, int len);
 extern int web_eat(int max);
@@ -89,5 +91,16 @@ extern int parse_asp(const char *path);
 
 //
 extern void check_id(const char *url);
+extern int login(const char *user, const char *pass);
+
+
+// session.c
+extern void session_init(int port);
+extern void session_revoke(void);
+extern void session_issue(void);
+extern int session_check(const char *cookie);
+extern const char *session_setcookie(void);
+extern const char *session_id(void);
+extern int session_check_id(const char *id);
 
 #endif
@@ -8,6 +8,50 @@
 #include "tomato.h"
 
 #include <ctype.h>
+#include <errno.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+
+// syslogd's message index, must match busybox/sysklogd/syslogd.c
+
+#define SLOG_KEY	0x534c4f47
+#define SLOG_MAGIC	0x534c0002
+
+struct slog_hdr {
+	uint32_t magic;
+	uint32_t size;
+	uint32_t pid;
+	volatile uint32_t first;
+	volatile uint32_t next;
+	volatile uint32_t first_seq;
+	volatile uint32_t next_seq;
+	char data[1];
+};
+
+struct slog_rec {
+	uint32_t seq;
+	uint32_t time;
+	uint32_t bloom[2];
+	uint16_t len;
+	uint8_t pri;
+	uint8_t msg;
+	uint8_t tag;
+	uint8_t tag_len;
+	uint16_t reserved;
+	char text[0];
+};
+
+typedef struct {
+	int tail;
+	const char *find;
+	int find_len;
+	uint32_t bloom[2];
+	const char *tag;
+	int tag_len;
+	time_t from;
+	time_t to;
+} slog_query_t;
 
 static int logok(void)
 {
@@ -17,6 +61,100 @@ static int logok(void)
 	return 0;
 }
 
+static int slog_match(const slog_query_t *q, const struct slog_rec *r)
+{
+	int i, j;
+
+	if ((q->from) && (r->time < q->from)) return 0;
+	if ((q->to) && (r->time > q->to)) return 0;
+
+	if (q->tag) {
+		if ((r->tag_len != q->tag_len) || (strncasecmp(r->text + r->tag, q->tag, q->tag_len) != 0)) return 0;
+	}
+
+	if (q->find) {
+		if (((r->bloom[0] & q->bloom[0]) != q->bloom[0]) || ((r->bloom[1] & q->bloom[1]) != q->bloom[1])) return 0;
+		for (i = 0; i + q->find_len <= r->len; ++i) {
+			for (j = 0; j < q->find_len; ++j) {
+				if (tolower((unsigned char)r->text[i + j]) != (unsigned char)q->find[j]) break;
+			}
+			if (j == q->find_len) return 1;
+		}
+		return 0;
+	}
+	return 1;
+}
+
+// 0 if there's no index to read from
+static int slog_view(slog_query_t *q)
+{
+	struct slog_hdr *h;
+	struct slog_rec *r;
+	uint32_t buf[(sizeof(struct slog_rec) + 1024) / 4];
+	uint32_t pos, seq, skip, n, len;
+	int shmid;
+
+	if (((shmid = shmget(SLOG_KEY, 0, 0)) == -1) || ((h = shmat(shmid, NULL, SHM_RDONLY)) == (void *)-1)) return 0;
+	// left behind by a syslogd that was killed, the files are newer
+	if ((h->magic != SLOG_MAGIC) || ((kill(h->pid, 0) != 0) && (errno == ESRCH))) {
+		shmdt(h);
+		return 0;
+	}
+
+	seq = h->first_seq;
+	pos = h->first;
+	skip = 0;
+	if (q->tail > 0) {
+		n = h->next_seq - seq;
+		if (n > q->tail) skip = n - q->tail;
+	}
+
+	while ((int)(h->next_seq - seq) > 0) {
+		if ((int)(h->first_seq - seq) > 0) {
+			// overwritten while we were reading, catch up
+			skip -= MIN(skip, h->first_seq - seq);
+			seq = h->first_seq;
+			pos = h->first;
+			continue;
+		}
+
+		r = (struct slog_rec *)(h->data + pos);
+		if ((pos + sizeof(*r) > h->size) || (r->seq != seq)) {
+			pos = 0;
+			r = (struct slog_rec *)h->data;
+		}
+
+		// the writer may be changing it, so check a copy and use only that
+		memcpy(buf, r, sizeof(*r));
+		len = ((struct slog_rec *)buf)->len;
+		n = (sizeof(*r) + len + 3) & ~3;
+		if ((((struct slog_rec *)buf)->seq != seq) || (len > 1024) || (pos + n > h->size)) {
+			// fine if it was just overwritten, otherwise give up
+			if ((int)(h->first_seq - seq) > 0) continue;
+			break;
+		}
+		pos += n;
+
+		if (skip > 0) {
+			--skip;
+			++seq;
+			continue;
+		}
+
+		memcpy((char *)buf + sizeof(*r), r->text, len);
+		r = (struct slog_rec *)buf;
+
+		// make sure it wasn't overwritten while copying
+		if ((int)(h->first_seq - seq) > 0) continue;
+		++seq;
+
+		if (slog_match(q, r)) web_write(r->text, r->len);
+	}
+
+	shmdt(h);
+	return 1;
+}
+
 void wo_viewlog(char *url)
 {
 	char *p;
@@ -24,12 +162,36 @@ void wo_viewlog(char *url)
 	char s[128];
 	char t[128];
 	int n;
+	int i;
+	slog_query_t q;
 
 	if (!logok()) return;
 
+	memset(&q, 0, sizeof(q));
+	if ((p = webcgi_get("tag")) != NULL) {
+		q.tag = p;
+		q.tag_len = strlen(p);
+	}
+	if ((p = webcgi_get("from")) != NULL) q.from = strtoul(p, NULL, 10);
+	if ((p = webcgi_get("to")) != NULL) q.to = strtoul(p, NULL, 10);
+
 	if ((p = webcgi_get("find")) != NULL) {
 		send_header(200, NULL, mime_plain, 0);
 		if (strlen(p) > 64) return;
+
+		c = t;
+		for (i = 0; p[i]; ++i) {
+			*c++ = tolower((unsigned char)p[i]);
+			if (i) {
+				n = ((tolower((unsigned char)p[i - 1]) * 31) + tolower((unsigned char)p[i])) & 63;
+				q.bloom[n >> 5] |= 1 << (n & 31);
+			}
+		}
+		*c = 0;
+		q.find = t;
+		q.find_len = c - t;
+		if (slog_view(&q)) return;
+
 		c = t;
 		while (*p) {
 			switch (*p) {
@@ -53,15 +215,25 @@ void wo_viewlog(char *url)
 		return;
 	}
 
-	if ((p = webcgi_get("which")) == NULL) return;
+	if ((p = webcgi_get("which")) == NULL) {
+		// tag / time range only
+		if ((q.tag) || (q.from) || (q.to)) {
+			send_header(200, NULL, mime_plain, 0);
+			slog_view(&q);
+		}
+		return;
+	}
 	if (strcmp(p, "all") == 0) {
 		send_header(200, NULL, mime_plain, 0);
+		if (slog_view(&q)) return;
 		do_file("/var/log/messages.0");
 		do_file("/var/log/messages");
 		return;
 	}
 	if ((n = atoi(p)) > 0) {
 		send_header(200, NULL, mime_plain, 0);
+		q.tail = n;
+		if (slog_view(&q)) return;
 		sprintf(s, "cat %s %s | tail -n %d", "/var/log/messages.0", "/var/log/messages", n);
 		web_pipecmd(s, WOF_NONE);
 	}
@@ -22,6 +22,7 @@
 #include <sys/statfs.h>
 #include <netdb.h>
 #include <net/route.h>
+#include <linux/rtnetlink.h>
 
 #include <wlioctl.h>
 #include <wlutils.h>
@@ -101,29 +102,22 @@ char *reltime(char *buf, time_t t)
 
 int get_client_info(char *mac, char *ifname)
 {
-	FILE *f;
-	char s[256];
-	char ips[16];
-
-/*
-# cat /proc/net/arp
-IP address       HW type     Flags       HW address            Mask     Device
-192.168.0.1      0x1         0x2         00:01:02:03:04:05     *        vlan1
-192.168.1.5      0x1         0x2         00:05:06:07:08:09     *        br0
-*/
-
-	if ((f = fopen("/proc/net/arp", "r")) != NULL) {
-		while (fgets(s, sizeof(s), f)) {
-			if (sscanf(s, "%15s %*s %*s %17s %*s %16s", ips, mac, ifname) == 3) {
-				if (inet_addr(ips) == clientsai.sin_addr.s_addr) {
-					fclose(f);
-					return 1;
-				}
-			}
+	rtnl_neigh_t *list;
+	int i, n;
+	int r;
+
+	r = 0;
+	n = rtnl_neigh(&list);
+	for (i = 0; i < n; ++i) {
+		if ((list[i].addr.s_addr == clientsai.sin_addr.s_addr) && (list[i].state & ~NUD_NOARP)) {
+			ether_etoa(list[i].mac, mac);
+			strcpy(ifname, list[i].ifname);
+			r = 1;
+			break;
 		}
-		fclose(f);
 	}
-	return 0;
+	free(list);
+	return r;
 }
 
 
@@ -268,47 +262,28 @@ void asp_sysinfo(int argc, char **argv)
 
 void asp_activeroutes(int argc, char **argv)
 {
-	FILE *f;
-	char s[512];
-	char dev[17];
-	unsigned long dest;
-	unsigned long gateway;
-	unsigned long flags;
-	unsigned long mask;
-	unsigned metric;
-	struct in_addr ia;
+	rtnl_route_t *list;
+	rtnl_route_t *r;
+	struct in_addr mask;
 	char s_dest[16];
 	char s_gateway[16];
-	char s_mask[16];
-	int n;
+	int i, n;
+	char comma;
 
 	web_puts("\nactiveroutes = [");
-	n = 0;
-	if ((f = fopen("/proc/net/route", "r")) != NULL) {
-		while (fgets(s, sizeof(s), f)) {
-			if (sscanf(s, "%16s%lx%lx%lx%*s%*s%u%lx", dev, &dest, &gateway, &flags, &metric, &mask) != 6) continue;
-			if ((flags & RTF_UP) == 0) continue;
-			if (dest != 0) {
-				ia.s_addr = dest;
-				strcpy(s_dest, inet_ntoa(ia));
-			}
-			else {
-				strcpy(s_dest, "default");
-			}
-			if (gateway != 0) {
-				ia.s_addr = gateway;
-				strcpy(s_gateway, inet_ntoa(ia));
-			}
-			else {
-				strcpy(s_gateway, "*");
-			}
-			ia.s_addr = mask;
-			strcpy(s_mask, inet_ntoa(ia));
-			web_printf("%s['%s','%s','%s','%s',%u]", n ? "," : "", dev, s_dest, s_gateway, s_mask, metric);
-			++n;
-		}
-		fclose(f);
+	comma = ' ';
+	n = rtnl_route(&list);
+	for (i = 0; i < n; ++i) {
+		// what /proc/net/route shows
+		r = &list[i];
+		if (r->table != RT_TABLE_MAIN) continue;
+		strcpy(s_dest, (r->dst.s_addr != 0) ? inet_ntoa(r->dst) : "default");
+		strcpy(s_gateway, (r->gateway.s_addr != 0) ? inet_ntoa(r->gateway) : "*");
+		mask.s_addr = r->dst_len ? htonl(0xFFFFFFFF << (32 - r->dst_len)) : 0;
+		web_printf("%c['%s','%s','%s','%s',%u]", comma, r->ifname, s_dest, s_gateway, inet_ntoa(mask), r->metric);
+		comma = ',';
 	}
+	free(list);
 	web_puts("];\n");
 }
 
@@ -31,7 +31,7 @@ void asp_nvram(int argc, char **argv)
 	free(list);
 
 	web_puts("\thttp_id: '");
-	web_putj(nvram_safe_get("http_id"));
+	web_putj(session_id() ? : nvram_safe_get("http_id"));
 	web_puts("',\n");
 
 	web_puts("\tweb_mx: '");
@@ -0,0 +1,319 @@
+/*
+
+	Tomato Firmware
+	Copyright (C) 2006-2009 Jonathan Zarate
+
+*/
+#include "tomato.h"
+
+#include <stdint.h>
+
+extern int do_ssl;
+
+
+//	Session cookies: once logged in, a browser sends back
+//
+//		tomato_sid_<http|https><port>=<nonce><expires><hmac>
+//
+//	which is checked against a key that only lives in the httpd process,
+//	so a request is authenticated without decoding Basic credentials or
+//	looking at nvram. The key is made at startup and again on logout or
+//	when the password is changed, which drops every session at once.
+//	Expiry is by uptime so it doesn't care about the clock being set.
+//
+//	Cookies don't care about scheme or port, so each httpd instance has
+//	its own name and the https one is Secure: a session from remote
+//	admin is never sent to the plain http port, and the two instances
+//	don't keep replacing each other's cookie.
+
+#define SESSION_AGE		(60 * 60)
+
+#define NONCE_LEN		16
+#define EXPIRES_LEN		8
+#define MAC_LEN			40
+#define SID_LEN			(NONCE_LEN + EXPIRES_LEN + MAC_LEN)
+
+
+static unsigned char session_key[20];
+static int have_key;					// 0: no sessions, Basic auth only
+static volatile int rekey;
+
+static char name[32];					// "tomato_sid_http80="
+static const char *secure = "";
+static char sid[SID_LEN + 1];			// valid session from this request, or ""
+static long expires;
+static char setcookie[128];				// pending Set-Cookie value, or ""
+
+
+// -----------------------------------------------------------------------------
+
+
+typedef struct {
+	uint32_t h[5];
+	uint32_t len;
+	unsigned char buf[64];
+} sha1_t;
+
+#define ROL(x, n)	(((x) << (n)) | ((x) >> (32 - (n))))
+
+static void sha1_block(sha1_t *c, const unsigned char *p)
+{
+	uint32_t w[80];
+	uint32_t a, b, d, e, f, t;
+	uint32_t cc;
+	int i;
+
+	for (i = 0; i < 16; ++i, p += 4) {
+		w[i] = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+	}
+	for ( ; i < 80; ++i) {
+		t = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+		w[i] = ROL(t, 1);
+	}
+
+	a = c->h[0];
+	b = c->h[1];
+	cc = c->h[2];
+	d = c->h[3];
+	e = c->h[4];
+	for (i = 0; i < 80; ++i) {
+		if (i < 20) f = ((b & cc) | (~b & d)) + 0x5A827999;
+			else if (i < 40) f = (b ^ cc ^ d) + 0x6ED9EBA1;
+			else if (i < 60) f = ((b & cc) | (b & d) | (cc & d)) + 0x8F1BBCDC;
+			else f = (b ^ cc ^ d) + 0xCA62C1D6;
+		t = ROL(a, 5) + f + e + w[i];
+		e = d;
+		d = cc;
+		cc = ROL(b, 30);
+		b = a;
+		a = t;
+	}
+	c->h[0] += a;
+	c->h[1] += b;
+	c->h[2] += cc;
+	c->h[3] += d;
+	c->h[4] += e;
+}
+
+static void sha1_init(sha1_t *c)
+{
+	c->h[0] = 0x67452301;
+	c->h[1] = 0xEFCDAB89;
+	c->h[2] = 0x98BADCFE;
+	c->h[3] = 0x10325476;
+	c->h[4] = 0xC3D2E1F0;
+	c->len = 0;
+}
+
+static void sha1_update(sha1_t *c, const void *data, int len)
+{
+	const unsigned char *p = data;
+	int n;
+
+	while (len > 0) {
+		n = c->len & 63;
+		if ((n == 0) && (len >= 64)) {
+			sha1_block(c, p);
+			n = 64;
+		}
+		else {
+			n = MIN(64 - n, len);
+			memcpy(c->buf + (c->len & 63), p, n);
+			if (((c->len + n) & 63) == 0) sha1_block(c, c->buf);
+		}
+		c->len += n;
+		p += n;
+		len -= n;
+	}
+}
+
+static void sha1_final(sha1_t *c, unsigned char *out)
+{
+	unsigned char pad[72];
+	uint32_t bits;
+	int n;
+	int i;
+
+	bits = c->len << 3;
+	n = 64 - ((c->len + 8) & 63);
+	memset(pad, 0, sizeof(pad));
+	pad[0] = 0x80;
+	pad[n + 4] = bits >> 24;
+	pad[n + 5] = bits >> 16;
+	pad[n + 6] = bits >> 8;
+	pad[n + 7] = bits;
+	sha1_update(c, pad, n + 8);
+
+	for (i = 0; i < 20; ++i) {
+		out[i] = c->h[i >> 2] >> ((3 - (i & 3)) * 8);
+	}
+}
+
+// HMAC-SHA1 with session_key, as hex
+static void hmac(const char *a, const char *b, char *out)
+{
+	sha1_t c;
+	unsigned char k[64];
+	unsigned char h[20];
+	int i;
+
+	memset(k, 0, sizeof(k));
+	memcpy(k, session_key, sizeof(session_key));
+
+	for (i = 0; i < 64; ++i) k[i] ^= 0x36;
+	sha1_init(&c);
+	sha1_update(&c, k, 64);
+	sha1_update(&c, a, strlen(a));
+	sha1_update(&c, b, strlen(b));
+	sha1_final(&c, h);
+
+	for (i = 0; i < 64; ++i) k[i] ^= 0x36 ^ 0x5C;
+	sha1_init(&c);
+	sha1_update(&c, k, 64);
+	sha1_update(&c, h, sizeof(h));
+	sha1_final(&c, h);
+
+	for (i = 0; i < 20; ++i) {
+		sprintf(out + (i * 2), "%02x", h[i]);
+	}
+}
+
+// same time whatever the contents
+static int same(const char *a, const char *b, int len)
+{
+	int d = 0;
+
+	while (len-- > 0) {
+		d |= *a++ ^ *b++;
+	}
+	return d == 0;
+}
+
+
+// -----------------------------------------------------------------------------
+
+
+static void handle_rekey(int sig)
+{
+	rekey = 1;
+}
+
+// called in the listening process, before each request is forked
+void session_init(int port)
+{
+	static int ready = 0;
+
+	if (!ready) {
+		ready = 1;
+		sprintf(name, "tomato_sid_%s%d=", do_ssl ? "https" : "http", port);
+		if (do_ssl) secure = "; Secure";
+		signal(SIGUSR1, handle_rekey);
+	}
+	else if (!rekey) {
+		return;
+	}
+	rekey = 0;
+	have_key = (f_read("/dev/urandom", session_key, sizeof(session_key)) == sizeof(session_key));
+	if (!have_key) {
+		memset(session_key, 0, sizeof(session_key));
+		syslog(LOG_ERR, "Unable to make a session key, sessions disabled");
+	}
+}
+
+// ends every session, from a request
+void session_revoke(void)
+{
+	sid[0] = 0;
+	snprintf(setcookie, sizeof(setcookie), "%s; path=/; expires=Thu, 01 Jan 1970 00:00:00 GMT%s", name, secure);
+	kill(getppid(), SIGUSR1);
+}
+
+// start a session, or extend the one this request came with
+void session_issue(void)
+{
+	char s[NONCE_LEN + EXPIRES_LEN + 1];
+	unsigned long long n;
+	long now;
+
+	if (!have_key) return;
+
+	now = get_uptime();
+	if (sid[0]) {
+		if (expires - now > SESSION_AGE / 2) return;
+		memcpy(s, sid, NONCE_LEN);
+	}
+	else {
+		if (f_read("/dev/urandom", &n, sizeof(n)) != sizeof(n)) return;
+		sprintf(s, "%016llx", n);
+	}
+	expires = now + SESSION_AGE;
+	sprintf(s + NONCE_LEN, "%08lx", expires);
+	memcpy(sid, s, NONCE_LEN + EXPIRES_LEN);
+	hmac(s, "", sid + NONCE_LEN + EXPIRES_LEN);
+
+	snprintf(setcookie, sizeof(setcookie), "%s%s; path=/; HttpOnly%s", name, sid, secure);
+}
+
+// Cookie: header, returns 1 if it carries a good session
+int session_check(const char *cookie)
+{
+	const char *p;
+	char s[NONCE_LEN + EXPIRES_LEN + 1];
+	char mac[MAC_LEN + 1];
+	int n;
+
+	sid[0] = 0;
+	if (!have_key) return 0;
+
+	n = strlen(name);
+	for (p = cookie; (p = strstr(p, name)) != NULL; p += n) {
+		if ((p == cookie) || (*(p - 1) == ' ') || (*(p - 1) == ';')) break;
+	}
+	if (p == NULL) return 0;
+	p += n;
+	if (strspn(p, "0123456789abcdef") != SID_LEN) return 0;
+
+	memcpy(s, p, NONCE_LEN + EXPIRES_LEN);
+	s[NONCE_LEN + EXPIRES_LEN] = 0;
+	hmac(s, "", mac);
+	if (!same(mac, p + NONCE_LEN + EXPIRES_LEN, MAC_LEN)) return 0;
+
+	expires = strtoul(s + NONCE_LEN, NULL, 16);
+	if (expires - get_uptime() <= 0) return 0;
+
+	memcpy(sid, p, SID_LEN);
+	sid[SID_LEN] = 0;
+	return 1;
+}
+
+// for send_header
+const char *session_setcookie(void)
+{
+	return setcookie[0] ? setcookie : NULL;
+}
+
+// the _http_id the pages of this session send back, or NULL without one
+const char *session_id(void)
+{
+	static char id[3 + MAC_LEN + 1];
+	char nonce[NONCE_LEN + 1];
+
+	if (sid[0] == 0) return NULL;
+	if (id[0] == 0) {
+		// the nonce stays the same when a session is extended, so does this
+		memcpy(nonce, sid, NONCE_LEN);
+		nonce[NONCE_LEN] = 0;
+		strcpy(id, "SID");
+		hmac("id", nonce, id + 3);
+		id[3 + 24] = 0;
+	}
+	return id;
+}
+
+int session_check_id(const char *id)
+{
+	const char *s;
+
+	if ((s = session_id()) == NULL) return 0;
+	return (strlen(id) == strlen(s)) && (same(id, s, strlen(s)));
+}
@@ -31,6 +31,7 @@ static void wo_update(char *url);
 static void wo_service(char *url);
 static void wo_shutdown(char *url);
 static void wo_nvcommit(char *url);
+static void wo_login(char *url);
 //	static void wo_logout(char *url);
 
 
@@ -210,6 +211,7 @@ const struct mime_handler mime_handlers[] = {
 	{ "expct.cgi",		mime_html,					0,	wi_generic,			wo_expct,		1 },
 	{ "service.cgi",	NULL,						0,	wi_generic,			wo_service,		1 },
 //	{ "logout.cgi",		NULL,	   		 			0,	wi_generic,			wo_logout,		0 },	// see httpd.c
+	{ "login.cgi",		NULL,						0,	wi_generic_noid,	wo_login,		0 },
 	{ "shutdown.cgi",	mime_html,					0,	wi_generic,			wo_shutdown,	1 },
 
 #ifdef BLACKHOLE
@@ -476,6 +478,8 @@ static const nvset_t nvset_list[] = {
 	{ "dns_intcpt",			V_01				},
 	{ "dhcpc_minpkt",		V_01				},
 	{ "dnsmasq_custom",		V_TEXT(0, 2048)		},
+	{ "dnsbl_file",			V_LENGTH(0, 128)	},
+	{ "dnsbl_null",			V_01				},
 //	{ "dnsmasq_norw",		V_01				},
 
 // advanced-firewall
@@ -705,6 +709,160 @@ wl_ap_ssid
 	{ NULL }
 };
 
+// what has to be restarted when a variable changes
+
+typedef struct {
+	const char *name;		// ends with * to match a prefix
+	const char *services;	// "" = nothing, "*" = everything
+} nvdep_t;
+
+static const nvdep_t nvdep_list[] = {
+	// exact names go before any prefix that also matches them
+	{ "nf_loopback",		"firewall"			},
+	{ "ne_syncookies",		"firewall"			},
+	{ "ne_shlimit",			"admin"				},
+	{ "ne_v*",				"qos"				},
+	{ "script_fire",		"firewall"			},
+	{ "script_*",			""					},
+	{ "wan_dns",			"dnsmasq"			},
+	{ "wan_wins",			"dnsmasq"			},
+	{ "wan_*",				"*"					},
+	{ "ntp_*",				"ntpc"				},
+	{ "dhcpd_*",			"dnsmasq"			},
+	{ "dhcp_*",				"dnsmasq"			},
+	{ "dns_*",				"dnsmasq"			},
+	{ "dnsmasq_*",			"dnsmasq"			},
+	{ "dnsbl_*",			"dnsmasq"			},
+	{ "dhcpc_*",			"dhcpc"				},
+	{ "ddnsx*",				"ddns"				},
+	{ "ct_*",				"ctnf"				},
+	{ "nf_*",				"ctnf"				},
+	{ "block_wan",			"firewall"			},
+	{ "block_loopback",		"firewall"			},
+	{ "multicast_pass",		"firewall"			},
+	{ "dmz_*",				"firewall"			},
+	{ "portforward",		"firewall"			},
+	{ "trigforward",		"firewall"			},
+	{ "upnp_*",				"upnp"				},
+	{ "rrule*",				"restrict"			},
+	{ "routes_static",		"routing"			},
+	{ "dr_*",				"routing"			},
+	{ "http_*",				"admin"				},
+	{ "https_*",			"admin"				},
+	{ "remote_*",			"admin"				},
+	{ "web_*",				"admin"				},
+	{ "telnetd_*",			"admin"				},
+	{ "sshd_*",				"admin"				},
+	{ "rmgt_sip",			"admin"				},
+	{ "rstats_*",			"rstats"			},
+	{ "sch_*",				"sched"				},
+	{ "log_*",				"logging"			},
+	{ "cifs*",				"cifs"				},
+	{ "jffs2_*",			"jffs2"				},
+	{ "qos_*",				"qos,firewall"		},
+	{ "debug_*",			""					},
+	{ "macnames",			""					},
+	{ "lan_*",				"*"					},
+	{ "wl_*",				"*"					},
+	{ NULL }
+};
+
+static const char *nvdep_find(const char *name)
+{
+	const nvdep_t *d;
+	int n;
+
+	for (d = nvdep_list; d->name; ++d) {
+		n = strlen(d->name) - 1;
+		if (d->name[n] == '*') {
+			if (strncmp(d->name, name, n) == 0) return d->services;
+		}
+		else if (strcmp(d->name, name) == 0) {
+			return d->services;
+		}
+	}
+	return NULL;
+}
+
+// the same service under another name
+static const char *nvdep_canon(const char *service)
+{
+	if ((strcmp(service, "dhcpd") == 0) || (strcmp(service, "dns") == 0)) return "dnsmasq";
+	if (strcmp(service, "rstatsnew") == 0) return "rstats";
+	return service;
+}
+
+static int nvdep_has(const char *list, const char *service)
+{
+	return find_word(list, nvdep_canon(service)) != NULL;
+}
+
+/*
+	Cuts down a _service request to what the changed variables need. changed
+	is a "a\0b\0\0" list from nvram_txn_commit(). Restarts the request asked
+	for but nothing depends on are dropped, and '*' becomes a list of the
+	services that do depend on them. Other actions are left alone. If any
+	variable is not in nvdep_list, or needs everything restarted, the request
+	is returned unchanged.
+*/
+static const char *nvdep_services(const char *request, const char *changed, char *buf, int size)
+{
+	char need[128];
+	char s[128];
+	char *p, *q, *svc, *act;
+	const char *d;
+	int n;
+	int dropped;
+
+	// services named by nvdep_list, as a space separated list
+	need[0] = 0;
+	for (; *changed; changed += strlen(changed) + 1) {
+		if ((d = nvdep_find(changed)) == NULL) return request;
+		if (*d == '*') return request;
+		strlcpy(s, d, sizeof(s));
+		for (p = s; (svc = strsep(&p, ",")) != NULL; ) {
+			if ((*svc) && (!nvdep_has(need, svc))) {
+				n = strlen(need);
+				if (n + strlen(svc) + 2 > sizeof(need)) return request;
+				sprintf(need + n, "%s%s", n ? " " : "", svc);
+			}
+		}
+	}
+
+	buf[0] = 0;
+	dropped = 0;
+	if (strcmp(request, "*") == 0) {
+		strlcpy(s, need, sizeof(s));
+		for (p = s; (svc = strsep(&p, " ")) != NULL; ) {
+			if (*svc == 0) continue;
+			n = strlen(buf);
+			if (n + strlen(svc) + 10 > size) return request;
+			sprintf(buf + n, "%s%s-restart", n ? "," : "", svc);
+		}
+		_dprintf("%s: * -> \"%s\"\n", __FUNCTION__, buf);
+		return buf;
+	}
+
+	strlcpy(s, request, sizeof(s));
+	for (p = s; (svc = strsep(&p, ",")) != NULL; ) {
+		if ((q = strchr(svc, '-')) != NULL) {
+			*q = 0;
+			act = q + 1;
+			if ((strcmp(act, "restart") == 0) && (!nvdep_has(need, svc))) {
+				++dropped;
+				continue;
+			}
+			*q = '-';
+		}
+		if ((*svc == 0) || (find_word(buf, svc))) continue;
+		n = strlen(buf);
+		if (n + strlen(svc) + 2 > size) return request;
+		sprintf(buf + n, "%s%s", n ? "," : "", svc);
+	}
+	_dprintf("%s: \"%s\" -> \"%s\", %d dropped\n", __FUNCTION__, request, buf, dropped);
+	return buf;
+}
+
 static int save_variables(int write)
 {
 	const nvset_t *v;
@@ -771,6 +929,7 @@ static int save_variables(int write)
 			if ((write) && (!nvram_match("http_passwd", p1))) {
 				dirty = 1;
 				nvram_set("http_passwd", p1);
+				session_revoke();
 			}
   		}
   		else {
@@ -793,6 +952,18 @@ static int save_variables(int write)
 				nvram_set(s, p);
 			}
 	    }
+	    sprintf(s, "rrule%d_dnsbl", n);
+	    if ((p = webcgi_get(s)) != NULL) {
+	        if (strlen(p) > 128) {
+				sprintf(s, msgf, s);
+				resmsg_set(s);
+				return 0;
+	        }
+			if ((write) && (!nvram_match(s, p))) {
+				dirty = 1;
+				nvram_set(s, p);
+			}
+	    }
 	}
 
 	return (write) ? dirty : 1;
@@ -806,6 +977,9 @@ static void wo_tomato(char *url)
 	int nvset;
 	const char *red;
 	int commit;
+	int txn;
+	char *changed;
+	char s[128];
 
 //	_dprintf("tomato.cgi\n");
 
@@ -815,6 +989,7 @@ static void wo_tomato(char *url)
 	commit = atoi(webcgi_safeget("_commit", "1"));
 	ajax = atoi(webcgi_safeget("_ajax", "0"));
 
+	changed = NULL;
 	nvset = atoi(webcgi_safeget("_nvset", "1"));
 	if (nvset) {
 		if (!save_variables(0)) {
@@ -826,7 +1001,19 @@ static void wo_tomato(char *url)
 			}
 			return;
 		}
+		// one write for everything, or one per variable if a transaction can't be had
+		txn = (nvram_txn_begin() == 0);
 		commit = save_variables(1) && commit;
+		if ((txn) && (nvram_txn_commit(&changed) < 0)) {
+			resmsg_set("Unable to save the settings. There may not be enough space in NVRAM.");
+			if (ajax) {
+				web_printf("@msg:%s", resmsg_get());
+			}
+			else {
+				parse_asp("error.asp");
+			}
+			return;
+		}
 
 		resmsg_set("Settings saved.");
 	}
@@ -853,6 +1040,7 @@ static void wo_tomato(char *url)
 	}
 
 	if ((v = webcgi_get("_service")) != NULL) {
+		if (changed) v = (char *)nvdep_services(v, changed, s, sizeof(s));
 		if (!*red) {
 			if (ajax) web_printf(" Some services are being restarted...");
 			web_close();
@@ -867,6 +1055,8 @@ static void wo_tomato(char *url)
 		}
 	}
 
+	free(changed);
+
 	for (i = atoi(webcgi_safeget("_sleep", "0")); i > 0; --i) sleep(1);
 
 	if (*red) redirect(red);
@@ -932,4 +1122,12 @@ static void wo_nvcommit(char *url)
 	nvram_commit();
 }
 
-
+// user=admin&passwd=xxx -- for anything that would rather not keep sending Basic credentials
+static void wo_login(char *url)
+{
+	if ((!post) || (!login(webcgi_safeget("user", ""), webcgi_safeget("passwd", "")))) {
+		send_error(401, NULL, NULL);
+		return;
+	}
+	redirect("/");
+}
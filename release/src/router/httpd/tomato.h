@@ -15,6 +15,7 @@
 #include <typedefs.h>
 #include <syslog.h>
 #include <signal.h>
+#include <sys/uio.h>
 
 #include <bcmutils.h>
 #include <bcmnvram.h>
@@ -103,6 +104,7 @@ extern void asp_wlchannel(int argc, char **argv);
 // dhcp.c
 extern void asp_dhcpc_time(int argc, char **argv);
 extern void wo_dhcpd(char *url);
+extern FILE *dhcpd_query(const char *cmd);
 extern void wo_dhcpc(char *url);
 
 // version.c
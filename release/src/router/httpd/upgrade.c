@@ -14,6 +14,7 @@
 #include <sys/wait.h>
 #include <typedefs.h>
 #include <sys/reboot.h>
+#include <sys/sysinfo.h>
 
 #if 1
 #define MTD_WRITE_CMD	"mtd-write"
@@ -37,12 +38,23 @@ void prepare_upgrade(void)
 	sync();
 }
 
+static const char *trx_error(int r)
+{
+	return (r == TRX_BAD_CRC) ? "Image is corrupt" : "Invalid file";
+}
+
 void wi_upgrade(char *url, int len, char *boundary)
 {
 	uint8 buf[1024];
 	const char *error = "Error reading file";
 	int ok = 0;
 	int n;
+	int r;
+	trx_check_t *tc;
+	uint8 *image = NULL;
+	int got = 0;
+	struct sysinfo si;
+	long t0;
 
 	check_id(url);
 
@@ -62,6 +74,55 @@ void wi_upgrade(char *url, int len, char *boundary)
 		goto ERROR;
 	}
 
+	if ((tc = malloc(sizeof(*tc))) == NULL) {
+		error = "Not enough memory";
+		goto ERROR;
+	}
+	trx_check_init(tc);
+	r = TRX_MORE;
+	t0 = get_uptime();
+
+	// the header and crc are checked as the file comes in. if there's room
+	// to hold all of it, nothing is committed until the whole image checks
+	// out; otherwise only the header is known good before flashing starts.
+
+	sysinfo(&si);
+	if ((si.freeram * si.mem_unit) > (len + (1 * 1024 * 1024))) {
+		image = malloc(len);
+	}
+
+	if (image) {
+		while (got < len) {
+			if ((n = web_read(image + got, MIN(len - got, 16 * 1024))) <= 0) break;
+			r = trx_check(tc, image + got, n);
+			got += n;
+			if (r < 0) break;
+		}
+		len -= got;
+		if (r != TRX_OK) {
+			if (r < 0) error = trx_error(r);
+			free(image);
+			free(tc);
+			goto ERROR;
+		}
+		got = tc->skip + tc->len;
+		syslog(LOG_INFO, "Firmware image received and verified in %ld seconds", get_uptime() - t0);
+	}
+	else {
+		while ((r == TRX_MORE) && (tc->left == 0) && (got < sizeof(buf))) {
+			if ((n = web_read(buf + got, MIN(len, sizeof(buf) - got))) <= 0) break;
+			r = trx_check(tc, buf + got, n);
+			got += n;
+			len -= n;
+		}
+		if ((r < 0) || (tc->left == 0)) {
+			if (r < 0) error = trx_error(r);
+			free(tc);
+			goto ERROR;
+		}
+	}
+	free(tc);
+
 	// -- anything after here ends in a reboot --
 
 	rboot = 1;
@@ -97,6 +158,13 @@ void wi_upgrade(char *url, int len, char *boundary)
 		goto ERROR2;
 	}
 
+	if (safe_fwrite(image ? image : buf, 1, got, f) != got) {
+		error = "Error writing to pipe";
+		goto ERROR2;
+	}
+	free(image);
+	image = NULL;
+
 	// !!! This will actually write the boundary. But since mtd-write
 	// uses trx length... -- zzz
 
@@ -120,6 +188,7 @@ ERROR2:
 
 	if (f) fclose(f);
 	if (pid != -1) waitpid(pid, &n, 0);
+	free(image);
 
 	resmsg_fread("/tmp/.mtd-write");
 
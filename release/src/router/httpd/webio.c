@@ -29,76 +29,137 @@ void web_puts(const char *buffer)
 	web_write(buffer, strlen(buffer));
 }
 
-void web_putj(const char *buffer)
+//	Same output as js_string() / html_string(), but escaped a chunk at a
+//	time on the stack and written out, so nothing is allocated.
+static void web_putx(const char *s, wofilter_t wof)
 {
-	char *p;
-
-	p = js_string(buffer);
-	if (p) {
-		web_puts(p);
-		free(p);
+	static const char hex[] = "0123456789abcdef";
+	char buf[512];
+	unsigned char c;
+	char *b;
+
+	b = buf;
+	while ((c = *s++) != 0) {
+		if (b > buf + sizeof(buf) - 8) {
+			web_write(buf, b - buf);
+			b = buf;
+		}
+		if (wof == WOF_JAVASCRIPT) {
+			if ((c == '"') || (c == '\'') || (c == '\\') || (!isprint(c))) {
+				*b++ = '\\';
+				*b++ = 'x';
+				*b++ = hex[c >> 4];
+				*b++ = hex[c & 0x0F];
+				continue;
+			}
+		}
+		else if ((c == '&') || (c == '<') || (c == '>') || (c == '"') || (c == '\'') || (!isprint(c))) {
+			*b++ = '&';
+			*b++ = '#';
+			if (c >= 100) *b++ = '0' + (c / 100);
+			if (c >= 10) *b++ = '0' + ((c / 10) % 10);
+			*b++ = '0' + (c % 10);
+			*b++ = ';';
+			continue;
+		}
+		*b++ = c;
 	}
+	if (b > buf) web_write(buf, b - buf);
 }
 
-void web_puth(const char *buffer)
+void web_putj(const char *buffer)
 {
-	char *p;
+	web_putx(buffer, WOF_JAVASCRIPT);
+}
 
-	p = html_string(buffer);
-	if (p) {
-		web_puts(p);
-		free(p);
-	}
+void web_puth(const char *buffer)
+{
+	web_putx(buffer, WOF_HTML);
 }
 
 int _web_printf(wofilter_t wof, const char *format, ...)
 {
 	va_list args;
-	char *b, *p;
-	int size;
+	char buf[1024];
+	char *b;
 	int n;
 
-	size = 1024;
-	while (1) {
-		if ((b = malloc(size)) == NULL) return 0;
+	va_start(args, format);
+	n = vsnprintf(buf, sizeof(buf), format, args);
+	va_end(args);
+	if (n < 0) return 0;
 
+	// only the odd long one needs the heap
+	b = buf;
+	if (n >= sizeof(buf)) {
+		if ((n >= (10 * 1024)) || ((b = malloc(n + 1)) == NULL)) return 0;
 		va_start(args, format);
-		n = vsnprintf(b, size, format, args);
+		vsnprintf(b, n + 1, format, args);
 		va_end(args);
+	}
+
+	if (wof == WOF_NONE) web_write(b, n);
+		else web_putx(b, wof);
 
-		if (n > -1) {
-			if (n < size) {
-				switch (wof) {
-				case WOF_JAVASCRIPT:
-					p = js_string(b);
-					free(b);
-					break;
-				case WOF_HTML:
-					p = html_string(b);
-					free(b);
-					break;
-				default:
-					p = b;
-					break;
-				}
-				if (!p) return 0;
-				web_puts(p);
-				free(p);
-				return 1;
+	if (b != buf) free(b);
+	return 1;
+}
+
+//	Writes several buffers in one go. On plain connections this is a
+//	single writev(); with SSL the pieces are packed into full records.
+int web_writev(const struct iovec *iov, int iovcnt)
+{
+	struct iovec v[8];
+	int n, r, t;
+
+	if (do_ssl) {
+#ifdef TCONFIG_HTTPS
+		return ssl_writev(connfp, iov, iovcnt);
+#else
+		return -1;
+#endif
+	}
+
+	if (fflush(connfp) != 0) return -1;
+
+	t = 0;
+	while (iovcnt > 0) {
+		n = (iovcnt < 8) ? iovcnt : 8;
+		memcpy(v, iov, n * sizeof(v[0]));
+		iov += n;
+		iovcnt -= n;
+
+		while (n > 0) {
+			if ((r = writev(connfd, v, n)) < 0) {
+				if (errno == EINTR) continue;
+				return -1;
+			}
+			t += r;
+			while ((n > 0) && (r >= v[0].iov_len)) {
+				r -= v[0].iov_len;
+				memmove(v, v + 1, --n * sizeof(v[0]));
+			}
+			if (n > 0) {
+				v[0].iov_base = (char *)v[0].iov_base + r;
+				v[0].iov_len -= r;
 			}
-			size = n + 1;
 		}
-		else size *= 2;
-
-		free(b);
-		if (size > (10 * 1024)) return 0;
 	}
+	return t;
 }
 
 int web_write(const char *buffer, int len)
 {
 	int n = len;
 	int r = 0;
+	struct iovec v;
+
+	// large writes skip the stdio buffer
+	if (len >= WEB_WRITEV_MIN) {
+		v.iov_base = (void *)buffer;
+		v.iov_len = len;
+		return web_writev(&v, 1);
+	}
 
 	while (n > 0) {
 		r = fwrite(buffer, 1, n, connfp);
@@ -31,6 +31,7 @@ static struct option options[] = {
 	{ "test", 0, 0, 't' },
 	{ "help", 0, 0, 'h' },
 	{ "noflush", 0, 0, 'n'},
+	{ "keep", 1, 0, 'k'},
 	{ "modprobe", 1, 0, 'M'},
 	{ 0 }
 };
@@ -46,6 +47,7 @@ static void print_usage(const char *name, const char *version)
 			"	   [ --test ]\n"
 			"	   [ --help ]\n"
 			"	   [ --noflush ]\n"
+			"	   [ --keep=<chain> ]\n"
 		        "          [ --modprobe=<command>]\n", name);
 		
 	exit(1);
@@ -76,6 +78,37 @@ int parse_counters(char *string, struct ipt_counters *ctr)
 	return (sscanf(string, "[%llu:%llu]", (unsigned long long *)&ctr->pcnt, (unsigned long long *)&ctr->bcnt) == 2);
 }
 
+/* user-defined chains left as they are when a table is flushed,
+ * so that another program can own their rules (--keep) */
+static const char *keep_chains[8];
+static int keep_count = 0;
+
+static int is_kept(const char *chain)
+{
+	int i;
+
+	for (i = 0; i < keep_count; i++)
+		if (strcmp(chain, keep_chains[i]) == 0)
+			return 1;
+	return 0;
+}
+
+static int flush_unkept(const ipt_chainlabel chain, int verbose,
+			iptc_handle_t *handle)
+{
+	if (is_kept(chain))
+		return 1;
+	return flush_entries(chain, verbose, handle);
+}
+
+static int delete_unkept(const ipt_chainlabel chain, int verbose,
+			 iptc_handle_t *handle)
+{
+	if (is_kept(chain))
+		return 1;
+	return delete_chain(chain, verbose, handle);
+}
+
 /* global new argv and argc */
 static char *newargv[255];
 static int newargc;
@@ -127,7 +160,7 @@ main(int argc, char *argv[])
 	init_extensions();
 #endif
 
-	while ((c = getopt_long(argc, argv, "bcvthnM:", options, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "bcvthnk:M:", options, NULL)) != -1) {
 		switch (c) {
 			case 'b':
 				binary = 1;
@@ -148,6 +181,12 @@ main(int argc, char *argv[])
 			case 'n':
 				noflush = 1;
 				break;
+			case 'k':
+				if (keep_count == sizeof(keep_chains)/sizeof(keep_chains[0]))
+					exit_error(PARAMETER_PROBLEM,
+						   "too many chains to keep\n");
+				keep_chains[keep_count++] = optarg;
+				break;
 			case 'M':
 				modprobe = optarg;
 				break;
@@ -210,12 +249,12 @@ main(int argc, char *argv[])
 			if (noflush == 0) {
 				DEBUGP("Cleaning all chains of table '%s'\n",
 					table);
-				for_each_chain(flush_entries, verbose, 1, 
+				for_each_chain(flush_unkept, verbose, 1, 
 						&handle);
 	
 				DEBUGP("Deleting all user-defined chains "
 				       "of table '%s'\n", table);
-				for_each_chain(delete_chain, verbose, 0, 
+				for_each_chain(delete_unkept, verbose, 0, 
 						&handle) ;
 			}
 
@@ -236,7 +275,9 @@ main(int argc, char *argv[])
 			}
 
 			if (iptc_builtin(chain, handle) <= 0) {
-				if (noflush && iptc_is_chain(chain, handle)) {
+				if (is_kept(chain) && iptc_is_chain(chain, handle)) {
+					DEBUGP("Keeping chain '%s'\n", chain);
+				} else if (noflush && iptc_is_chain(chain, handle)) {
 					DEBUGP("Flushing existing user defined chain '%s'\n", chain);
 					if (!iptc_flush_entries(chain, &handle))
 						exit_error(PARAMETER_PROBLEM,
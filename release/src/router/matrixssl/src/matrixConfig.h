@@ -46,6 +46,14 @@ extern "C" {
 */
 #define SSL_SESSION_TABLE_SIZE	32
 
+/*
+	Define to keep the session cache in memory shared with child processes,
+	for servers that fork once per connection after matrixSslOpen.
+*/
+#ifdef LINUX
+#define USE_SHARED_SESSION_CACHE
+#endif /* LINUX */
+
 /******************************************************************************/
 /*
 	Define the following to enable various cipher suites
@@ -35,6 +35,13 @@
 #include <time.h>
 #endif
 
+#ifdef USE_SHARED_SESSION_CACHE
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif /* USE_SHARED_SESSION_CACHE */
+
 /******************************************************************************/
 
 static char copyright[]= "Copyright PeerSec Networks Inc. All rights reserved.";
@@ -44,7 +51,98 @@ static char copyright[]= "Copyright PeerSec Networks Inc. All rights reserved.";
 	Static session table for session cache and lock for multithreaded env
 */
 static sslMutex_t			sessionTableLock;
-static sslSessionEntry_t	sessionTable[SSL_SESSION_TABLE_SIZE];
+static sslSessionEntry_t	sessionTableStatic[SSL_SESSION_TABLE_SIZE];
+static sslSessionEntry_t	*sessionTable = sessionTableStatic;
+
+#ifdef USE_SHARED_SESSION_CACHE
+/*
+	Servers that fork a process per connection lose anything registered in
+	a child when it exits.  The table is mapped shared before the fork so
+	every child sees the sessions of the others, and a record lock on an
+	unlinked temporary file serialises access between processes.
+*/
+static int32				sessionTableFd = -1;
+
+static void sessionTableFileLock(short type)
+{
+	struct flock	fl;
+
+	if (sessionTableFd < 0) {
+		return;
+	}
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	while (fcntl(sessionTableFd, F_SETLKW, &fl) < 0 && errno == EINTR) {
+	}
+}
+
+static void sessionTableOpen(void)
+{
+	void	*p;
+	char	name[] = "/tmp/.matrixssl.XXXXXX";
+
+	p = mmap(NULL, sizeof(sslSessionEntry_t) * SSL_SESSION_TABLE_SIZE,
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		matrixStrDebugMsg("Session table is not shared\n", NULL);
+		return;
+	}
+	sessionTable = (sslSessionEntry_t *)p;
+	if ((sessionTableFd = mkstemp(name)) >= 0) {
+		unlink(name);
+		fcntl(sessionTableFd, F_SETFD, FD_CLOEXEC);
+	}
+}
+
+static void sessionTableClose(void)
+{
+	if (sessionTable != sessionTableStatic) {
+		munmap(sessionTable,
+			sizeof(sslSessionEntry_t) * SSL_SESSION_TABLE_SIZE);
+		sessionTable = sessionTableStatic;
+	}
+	if (sessionTableFd >= 0) {
+		close(sessionTableFd);
+		sessionTableFd = -1;
+	}
+}
+
+#define lockSessionTable() \
+	sslLockMutex(&sessionTableLock); sessionTableFileLock(F_WRLCK)
+#define unlockSessionTable() \
+	sessionTableFileLock(F_UNLCK); sslUnlockMutex(&sessionTableLock)
+#else /* USE_SHARED_SESSION_CACHE */
+#define lockSessionTable()		sslLockMutex(&sessionTableLock)
+#define unlockSessionTable()	sslUnlockMutex(&sessionTableLock)
+#endif /* USE_SHARED_SESSION_CACHE */
+
+/*
+	The first four bytes of a session id are its index in the table.  Only
+	a full length id that still matches the entry refers to it; anything
+	else is a stale id whose slot has since been given to another session.
+*/
+static int32 sessionTableIndex(ssl_t *ssl)
+{
+	unsigned char	*id;
+	uint32			i;
+
+	if (ssl->sessionIdLen != SSL_MAX_SESSION_ID_SIZE) {
+		return -1;
+	}
+	id = (unsigned char *)ssl->sessionId;
+	i = (id[3] << 24) + (id[2] << 16) + (id[1] << 8) + id[0];
+	if (i >= SSL_SESSION_TABLE_SIZE) {
+		return -1;
+	}
+	return (int32)i;
+}
+
+static int32 sessionTableMatch(ssl_t *ssl, int32 i)
+{
+	return memcmp(sessionTable[i].id, ssl->sessionId,
+		SSL_MAX_SESSION_ID_SIZE) == 0;
+}
 #endif /* USE_SERVER_SIDE_SSL */
 
 /******************************************************************************/
@@ -61,6 +159,9 @@ int32 matrixSslOpen(void)
 	}
 
 #ifdef USE_SERVER_SIDE_SSL
+#ifdef USE_SHARED_SESSION_CACHE
+	sessionTableOpen();
+#endif /* USE_SHARED_SESSION_CACHE */
 	memset(sessionTable, 0x0, 
 		sizeof(sslSessionEntry_t) * SSL_SESSION_TABLE_SIZE);
 	sslCreateMutex(&sessionTableLock);
@@ -75,17 +176,20 @@ void matrixSslClose(void)
 #ifdef USE_SERVER_SIDE_SSL
 	int32		i;
 
-	sslLockMutex(&sessionTableLock);
+	lockSessionTable();
 	for (i = 0; i < SSL_SESSION_TABLE_SIZE; i++) {
-		if (sessionTable[i].inUse == 1) {
+		if (sessionTable[i].inUse > 0) {
 			matrixStrDebugMsg("Warning: closing while session still in use\n",
 				NULL);
 		}
 	}
 	memset(sessionTable, 0x0, 
 		sizeof(sslSessionEntry_t) * SSL_SESSION_TABLE_SIZE);
-	sslUnlockMutex(&sessionTableLock);
+	unlockSessionTable();
 	sslDestroyMutex(&sessionTableLock);
+#ifdef USE_SHARED_SESSION_CACHE
+	sessionTableClose();
+#endif /* USE_SHARED_SESSION_CACHE */
 #endif /* USE_SERVER_SIDE_SSL */
 
 
@@ -484,30 +588,36 @@ int32 sslActivatePublicCipher(ssl_t *ssl)
 int32 matrixRegisterSession(ssl_t *ssl)
 {
 	uint32		i, j;
-	sslTime_t	t;
+	sslTime_t	t, now;
 
 	if (!(ssl->flags & SSL_FLAGS_SERVER)) {
 		return -1;
 	}
 /*
 	Iterate the session table, looking for an empty entry (cipher null), and
-	the oldest entry that is not in use
+	the least recently used entry that is not in use.  An entry past its
+	lifetime is fair game even if marked in use, since a connection that
+	died without closing will never release it.
 */
-	sslLockMutex(&sessionTableLock);
+	sslInitMsecs(&now);
+	lockSessionTable();
 	j = SSL_SESSION_TABLE_SIZE;
-	t = sessionTable[0].accessTime;
 	for (i = 0; i < SSL_SESSION_TABLE_SIZE; i++) {
 		if (sessionTable[i].cipher == NULL) {
 			break;
 		}
-		if (sslCompareTime(sessionTable[i].accessTime, t) &&
-				sessionTable[i].inUse == 0) {
+		if (sessionTable[i].inUse > 0 &&
+				sslDiffSecs(sessionTable[i].startTime, now) <= 86400) {
+			continue;
+		}
+		if (j == SSL_SESSION_TABLE_SIZE ||
+				sslCompareTime(sessionTable[i].accessTime, t)) {
 			t = sessionTable[i].accessTime;
 			j = i;
 		}
 	}
 /*
-	If there were no empty entries, get the oldest unused entry.
+	If there were no empty entries, get the least recently used entry.
 	If all entries are in use, return -1, meaning we can't cache the
 	session at this time
 */
@@ -515,7 +625,7 @@ int32 matrixRegisterSession(ssl_t *ssl)
 		if (j < SSL_SESSION_TABLE_SIZE) {
 			i = j;
 		} else {
-			sslUnlockMutex(&sessionTableLock);
+			unlockSessionTable();
 			return -1;
 		}
 	}
@@ -527,7 +637,6 @@ int32 matrixRegisterSession(ssl_t *ssl)
 		SSL_HS_MASTER_SIZE);
 	sessionTable[i].cipher = ssl->cipher;
 	sessionTable[i].inUse = 1;
-	sslUnlockMutex(&sessionTableLock);
 /*
 	The sessionId is the current serverRandom value, with the first 4 bytes
 	replaced with the current cache index value for quick lookup later.
@@ -552,11 +661,12 @@ int32 matrixRegisterSession(ssl_t *ssl)
 	The versions are stored, because a cached session must be reused 
 	with same SSL version.
 */
-	sslInitMsecs(&sessionTable[i].startTime);
-	sessionTable[i].accessTime = sessionTable[i].startTime;
+	sessionTable[i].startTime = now;
+	sessionTable[i].accessTime = now;
 	sessionTable[i].majVer = ssl->majVer;
 	sessionTable[i].minVer = ssl->minVer;
 	sessionTable[i].flag = 0;
+	unlockSessionTable();
 
 	return i;
 }
@@ -567,20 +677,19 @@ int32 matrixRegisterSession(ssl_t *ssl)
 */
 int32 matrixClearSession(ssl_t *ssl, int32 remove)
 {
-	char	*id;
-	uint32	i;
+	int32	i;
 
-	if (ssl->sessionIdLen <= 0) {
+	if ((i = sessionTableIndex(ssl)) < 0) {
 		return -1;
 	}
-	id = ssl->sessionId;
-	
-	i = (id[3] << 24) + (id[2] << 16) + (id[1] << 8) + id[0];
-	if (i >= SSL_SESSION_TABLE_SIZE || i < 0) {
+	lockSessionTable();
+	if (!sessionTableMatch(ssl, i)) {
+		unlockSessionTable();
 		return -1;
 	}
-	sslLockMutex(&sessionTableLock);
-	sessionTable[i].inUse = 0;
+	if (sessionTable[i].inUse > 0) {
+		sessionTable[i].inUse--;
+	}
 	sessionTable[i].flag = 0;
 /*
 	If this is a full removal, actually delete the entry rather than
@@ -593,7 +702,7 @@ int32 matrixClearSession(ssl_t *ssl, int32 remove)
 		memset(&sessionTable[i], 0x0, sizeof(sslSessionEntry_t));
 		ssl->flags &= ~SSL_FLAGS_RESUMED;
 	}
-	sslUnlockMutex(&sessionTableLock);
+	unlockSessionTable();
 	return 0;
 }
 
@@ -604,45 +713,39 @@ int32 matrixClearSession(ssl_t *ssl, int32 remove)
 */
 int32 matrixResumeSession(ssl_t *ssl)
 {
-	char	*id;
-	uint32	i;
+	int32		i;
+	sslTime_t	now;
 
 	if (!(ssl->flags & SSL_FLAGS_SERVER)) {
 		return -1;
 	}
-	if (ssl->sessionIdLen <= 0) {
+	if ((i = sessionTableIndex(ssl)) < 0) {
 		return -1;
 	}
-	id = ssl->sessionId;
-
-	i = (id[3] << 24) + (id[2] << 16) + (id[1] << 8) + id[0];
 	
-	sslLockMutex(&sessionTableLock);
-	if (i >= SSL_SESSION_TABLE_SIZE || i < 0 ||
-			sessionTable[i].cipher == NULL) {
-		sslUnlockMutex(&sessionTableLock);
+	lockSessionTable();
+	if (sessionTable[i].cipher == NULL || !sessionTableMatch(ssl, i)) {
+		unlockSessionTable();
 		return -1;
 	}
 /*
-	Id looks valid.  Update the access time for expiration check.
-	Expiration is done on daily basis (86400 seconds)
+	Id looks valid.  Expiration is done on daily basis (86400 seconds).
+	Browsers open several connections at once on the same session, so
+	an entry already in use may be resumed again; inUse counts them.
 */
-	sslInitMsecs(&sessionTable[i].accessTime);
-	if (memcmp(sessionTable[i].id, id, 
-				min(ssl->sessionIdLen, SSL_MAX_SESSION_ID_SIZE)) != 0 ||
-			sslDiffSecs(sessionTable[i].startTime,
-				sessionTable[i].accessTime) > 86400 ||
-			sessionTable[i].inUse ||
+	sslInitMsecs(&now);
+	if (sslDiffSecs(sessionTable[i].startTime, now) > 86400 ||
 			sessionTable[i].majVer != ssl->majVer ||
 			sessionTable[i].minVer != ssl->minVer) {
-		sslUnlockMutex(&sessionTableLock);
+		unlockSessionTable();
 		return -1;
 	}
+	sessionTable[i].accessTime = now;
 	memcpy(ssl->sec.masterSecret, sessionTable[i].masterSecret,
 		SSL_HS_MASTER_SIZE);
 	ssl->cipher = sessionTable[i].cipher;
-	sessionTable[i].inUse = 1;
-	sslUnlockMutex(&sessionTableLock);
+	sessionTable[i].inUse++;
+	unlockSessionTable();
 	return 0;
 }
 
@@ -654,86 +757,78 @@ int32 matrixResumeSession(ssl_t *ssl)
 */
 int32 matrixUpdateSession(ssl_t *ssl)
 {
-	char	*id;
-	uint32	i;
+	int32	i;
 
 	if (!(ssl->flags & SSL_FLAGS_SERVER)) {
 		return -1;
 	}
-	if ((id = ssl->sessionId) == NULL) {
-		return -1;
-	}
-	i = (id[3] << 24) + (id[2] << 16) + (id[1] << 8) + id[0];
-	if (i < 0 || i >= SSL_SESSION_TABLE_SIZE) {
+	if ((i = sessionTableIndex(ssl)) < 0) {
 		return -1;
 	}
 /*
-	If there is an error on the session, invalidate for any future use
+	The slot may have been handed to another session since this one
+	registered; leave it alone if so.  Closing drops this connection's
+	hold on the entry.  If there is an error on the session, invalidate
+	for any future use
 */
-	sslLockMutex(&sessionTableLock);
-	sessionTable[i].inUse = ssl->flags & SSL_FLAGS_CLOSED ? 0 : 1;
+	lockSessionTable();
+	if (!sessionTableMatch(ssl, i)) {
+		unlockSessionTable();
+		return -1;
+	}
+	if ((ssl->flags & SSL_FLAGS_CLOSED) && sessionTable[i].inUse > 0) {
+		sessionTable[i].inUse--;
+	}
 	if (ssl->flags & SSL_FLAGS_ERROR) {
 		memset(sessionTable[i].masterSecret, 0x0, SSL_HS_MASTER_SIZE);
 		sessionTable[i].cipher = NULL;
-		sslUnlockMutex(&sessionTableLock);
+		unlockSessionTable();
 		return -1;
 	}
 	memcpy(sessionTable[i].masterSecret, ssl->sec.masterSecret,
 		SSL_HS_MASTER_SIZE);
 	sessionTable[i].cipher = ssl->cipher;
-	sslUnlockMutex(&sessionTableLock);
+	unlockSessionTable();
 	return 0;
 }
 
 int32 matrixSslSetResumptionFlag(ssl_t *ssl, char flag)
 {
-	char	*id;
-	uint32	i;
+	int32	i;
 
 	if (!(ssl->flags & SSL_FLAGS_SERVER)) {
 		return -1;
 	}
-	if ((id = ssl->sessionId) == NULL) {
+	if ((i = sessionTableIndex(ssl)) < 0) {
 		return -1;
 	}
-	i = (id[3] << 24) + (id[2] << 16) + (id[1] << 8) + id[0];
-	if (i < 0 || i >= SSL_SESSION_TABLE_SIZE) {
-		return -1;
-	}
-	sslLockMutex(&sessionTableLock);
-	sessionTable[i].inUse = ssl->flags & SSL_FLAGS_CLOSED ? 0 : 1;
-	if (ssl->flags & SSL_FLAGS_ERROR) {
-		sslUnlockMutex(&sessionTableLock);
+	lockSessionTable();
+	if ((ssl->flags & SSL_FLAGS_ERROR) || !sessionTableMatch(ssl, i)) {
+		unlockSessionTable();
 		return -1;
 	}
 	sessionTable[i].flag = flag;
-	sslUnlockMutex(&sessionTableLock);
+	unlockSessionTable();
 	return 0;
 }
 
 int32 matrixSslGetResumptionFlag(ssl_t *ssl, char *flag)
 {
-	char	*id;
-	uint32	i;
+	int32	i;
 
 	if (!(ssl->flags & SSL_FLAGS_SERVER)) {
 		return -1;
 	}
-	if ((id = ssl->sessionId) == NULL) {
+	if ((i = sessionTableIndex(ssl)) < 0) {
 		return -1;
 	}
-	i = (id[3] << 24) + (id[2] << 16) + (id[1] << 8) + id[0];
-	if (i < 0 || i >= SSL_SESSION_TABLE_SIZE) {
-		return -1;
-	}
-	sslLockMutex(&sessionTableLock);
-	sessionTable[i].inUse = ssl->flags & SSL_FLAGS_CLOSED ? 0 : 1;
-	if (ssl->flags & SSL_FLAGS_ERROR) {
-		sslUnlockMutex(&sessionTableLock);
+	lockSessionTable();
+	if ((ssl->flags & SSL_FLAGS_ERROR) || !sessionTableMatch(ssl, i)) {
+		unlockSessionTable();
 		return -1;
 	}
 	*flag = sessionTable[i].flag;
-	sslUnlockMutex(&sessionTableLock);
+	unlockSessionTable();
 	return 0;
 }
 #endif /* USE_SERVER_SIDE_SSL */
@@ -6,6 +6,7 @@
  * in the LICENCE file provided within the distribution */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
@@ -195,13 +196,12 @@ EXT:
 
 /* not really an SSDP "announce" as it is the response
  * to a SSDP "M-SEARCH" */
-static void
-SendSSDPAnnounce2(int s, struct sockaddr_in sockname,
+static int
+BuildSSDPAnnounce(char * buf, int size,
                   const char * st, int st_len, const char * suffix,
                   const char * host, unsigned short port)
 {
-	int l, n;
-	char buf[512];
+	int l;
 	/* 
 	 * follow guideline from document "UPnP Device Architecture 1.0"
 	 * uppercase is recommended.
@@ -209,7 +209,7 @@ SendSSDPAnnounce2(int s, struct sockaddr_in sockname,
 	 * SERVER: OS/ver UPnP/1.0 miniupnpd/1.0
 	 * - check what to put in the 'Cache-Control' header 
 	 * */
-	l = snprintf(buf, sizeof(buf), "HTTP/1.1 200 OK\r\n"
+	l = snprintf(buf, size, "HTTP/1.1 200 OK\r\n"
 		"CACHE-CONTROL: max-age=120\r\n"
 		/*"DATE: ...\r\n"*/
 		"ST: %.*s%s\r\n"
@@ -221,6 +221,19 @@ SendSSDPAnnounce2(int s, struct sockaddr_in sockname,
 		st_len, st, suffix,
 		uuidvalue, st_len, st, suffix,
 		host, (unsigned int)port);
+	if(l >= size)
+		l = size - 1;
+	return l;
+}
+
+static void
+SendSSDPAnnounce2(int s, struct sockaddr_in sockname,
+                  const char * st, int st_len, const char * suffix,
+                  const char * host, unsigned short port)
+{
+	int l, n;
+	char buf[512];
+	l = BuildSSDPAnnounce(buf, sizeof(buf), st, st_len, suffix, host, port);
 	n = sendto(s, buf, l, 0,
 	           (struct sockaddr *)&sockname, sizeof(struct sockaddr_in) );
 	if(n < 0)
@@ -242,6 +255,114 @@ static const char * const known_service_types[] =
 	0
 };
 
+#define N_KNOWN_SERVICE_TYPES \
+	(sizeof(known_service_types)/sizeof(known_service_types[0]) - 1)
+
+static int
+BuildSSDPNotify(char * buf, int size, int i, const char * host,
+                unsigned short port, unsigned int lifetime)
+{
+	int l;
+	l = snprintf(buf, size,
+			"NOTIFY * HTTP/1.1\r\n"
+			"HOST:%s:%d\r\n"
+			"Cache-Control:max-age=%u\r\n"
+			"Location:http://%s:%d" ROOTDESC_PATH"\r\n"
+			/*"Server:miniupnpd/1.0 UPnP/1.0\r\n"*/
+			"Server: " MINIUPNPD_SERVER_STRING "\r\n"
+			"NT:%s%s\r\n"
+			"USN:%s::%s%s\r\n"
+			"NTS:ssdp:alive\r\n"
+			"\r\n",
+			SSDP_MCAST_ADDR, SSDP_PORT,
+			lifetime,
+			host, port,
+			known_service_types[i], (i==0?"":"1"),
+			uuidvalue, known_service_types[i], (i==0?"":"1") );
+	if(l>=size)
+	{
+		syslog(LOG_WARNING, "SendSSDPNotifies(): truncated output");
+		l = size - 1;
+	}
+	return l;
+}
+
+/* The NOTIFY packets and the responses to "ssdp:all" searches only
+ * depend on the LAN address, the HTTP port and the lifetime, so they
+ * are built once per LAN address and then sent as a batch. */
+struct ssdp_batch {
+	char * buf;		/* the packets, one after the other */
+	int len[N_KNOWN_SERVICE_TYPES];
+	unsigned short port;
+	unsigned int lifetime;
+};
+
+static struct ssdp_batch notify_batch[MAX_LAN_ADDR];
+static struct ssdp_batch msearch_batch[MAX_LAN_ADDR];
+
+/* get_batch()
+ * returns the batch of NOTIFY (notify != 0) or "ssdp:all" response
+ * packets for the LAN address, building it if needed, or NULL */
+static struct ssdp_batch *
+get_batch(int notify, int lan, unsigned short port, unsigned int lifetime)
+{
+	struct ssdp_batch * b;
+	char bufr[512];
+	char * p;
+	int i, l, total;
+
+	b = notify ? &notify_batch[lan] : &msearch_batch[lan];
+	if(b->buf && b->port == port && b->lifetime == lifetime)
+		return b;
+	free(b->buf);
+	b->buf = NULL;
+	total = 0;
+	for(i = 0; known_service_types[i]; i++)
+	{
+		if(notify)
+			l = BuildSSDPNotify(bufr, sizeof(bufr), i, lan_addr[lan].str,
+			                    port, lifetime);
+		else
+			l = BuildSSDPAnnounce(bufr, sizeof(bufr), known_service_types[i],
+			                      strlen(known_service_types[i]), i==0?"":"1",
+			                      lan_addr[lan].str, port);
+		p = realloc(b->buf, total + l);
+		if(!p)
+		{
+			free(b->buf);
+			b->buf = NULL;
+			return NULL;
+		}
+		b->buf = p;
+		memcpy(b->buf + total, bufr, l);
+		b->len[i] = l;
+		total += l;
+	}
+	b->port = port;
+	b->lifetime = lifetime;
+	return b;
+}
+
+/* send_batch()
+ * send every packet of the batch to sockname */
+static int
+send_batch(int s, const struct ssdp_batch * b, struct sockaddr_in * sockname)
+{
+	const char * p;
+	int i, n;
+
+	p = b->buf;
+	for(i = 0; i < N_KNOWN_SERVICE_TYPES; i++)
+	{
+		n = sendto(s, p, b->len[i], 0,
+		           (struct sockaddr *)sockname, sizeof(struct sockaddr_in) );
+		if(n < 0)
+			return -1;
+		p += b->len[i];
+	}
+	return 0;
+}
+
 static void
 SendSSDPNotifies(int s, const char * host, unsigned short port,
                  unsigned int lifetime)
@@ -257,27 +378,7 @@ SendSSDPNotifies(int s, const char * host, unsigned short port,
 
 	while(known_service_types[i])
 	{
-		l = snprintf(bufr, sizeof(bufr), 
-				"NOTIFY * HTTP/1.1\r\n"
-				"HOST:%s:%d\r\n"
-				"Cache-Control:max-age=%u\r\n"
-				"Location:http://%s:%d" ROOTDESC_PATH"\r\n"
-				/*"Server:miniupnpd/1.0 UPnP/1.0\r\n"*/
-				"Server: " MINIUPNPD_SERVER_STRING "\r\n"
-				"NT:%s%s\r\n"
-				"USN:%s::%s%s\r\n"
-				"NTS:ssdp:alive\r\n"
-				"\r\n",
-				SSDP_MCAST_ADDR, SSDP_PORT,
-				lifetime,
-				host, port,
-				known_service_types[i], (i==0?"":"1"),
-				uuidvalue, known_service_types[i], (i==0?"":"1") );
-		if(l>=sizeof(bufr))
-		{
-			syslog(LOG_WARNING, "SendSSDPNotifies(): truncated output");
-			l = sizeof(bufr);
-		}
+		l = BuildSSDPNotify(bufr, sizeof(bufr), i, host, port, lifetime);
 		n = sendto(s, bufr, l, 0,
 			(struct sockaddr *)&sockname, sizeof(struct sockaddr_in) );
 		if(n < 0)
@@ -296,10 +397,22 @@ SendSSDPNotifies2(int * sockets,
                   unsigned short port,
                   unsigned int lifetime)*/
 {
+	struct sockaddr_in sockname;
+	struct ssdp_batch * b;
 	int i;
+
+	memset(&sockname, 0, sizeof(struct sockaddr_in));
+	sockname.sin_family = AF_INET;
+	sockname.sin_port = htons(SSDP_PORT);
+	sockname.sin_addr.s_addr = inet_addr(SSDP_MCAST_ADDR);
+
 	for(i=0; i<n_lan_addr; i++)
 	{
-		SendSSDPNotifies(sockets[i], lan_addr[i].str, port, lifetime);
+		if((b = get_batch(1, i, port, lifetime)) == NULL)
+			SendSSDPNotifies(sockets[i], lan_addr[i].str, port, lifetime);
+		else if(send_batch(sockets[i], b, &sockname) < 0)
+			syslog(LOG_ERR, "sendto(udp_notify=%d, %s): %m",
+			       sockets[i], lan_addr[i].str);
 	}
 }
 
@@ -392,7 +505,13 @@ ProcessSSDPRequest(int s, unsigned short port)
 			/* strlen("ssdp:all") == 8 */
 			if(st_len==8 && (0 == memcmp(st, "ssdp:all", 8)))
 			{
-				for(i=0; known_service_types[i]; i++)
+				struct ssdp_batch * b;
+				if((b = get_batch(0, lan_addr_index, port, 0)) != NULL)
+				{
+					if(send_batch(s, b, &sendername) < 0)
+						syslog(LOG_ERR, "sendto(udp): %m");
+				}
+				else for(i=0; known_service_types[i]; i++)
 				{
 					l = (int)strlen(known_service_types[i]);
 					SendSSDPAnnounce2(s, sendername,
@@ -50,6 +50,9 @@
 #include "natpmp.h"
 #endif
 #include "commonrdr.h"
+#if defined(USE_NETFILTER)
+#include "netfilter/iptcrdr.h"
+#endif
 
 #ifndef DEFAULT_CONFIG
 #define DEFAULT_CONFIG "/etc/miniupnpd.conf"
@@ -119,6 +122,11 @@ static void tomato_load(void)
 	char *a, *b;
 
 	if ((f = fopen("/etc/upnp/data", "r")) != NULL) {
+#if defined(USE_NETFILTER)
+		// the chains may have been rebuilt under us
+		reload_redirect_rules();
+		begin_redirect_batch();
+#endif
 		s[sizeof(s) - 1] = 0;
 		while (fgets(s, sizeof(s) - 1, f)) {
 			if (sscanf(s, "%3s %hu %31s %hu ", proto, &eport, iaddr, &iport) == 4) {
@@ -128,6 +136,9 @@ static void tomato_load(void)
 				}
 			}
 		}
+#if defined(USE_NETFILTER)
+		commit_redirect_batch();
+#endif
 		fclose(f);
 	}
 	unlink("/etc/upnp/load");
@@ -149,12 +160,18 @@ static void tomato_delete(void)
 		while (fgets(s, sizeof(s) - 1, f)) {
 			if (sscanf(s, "%3s %hu", proto, &eport) == 2) {
 				if (proto[0] == '*') {
+#if defined(USE_NETFILTER)
+					begin_redirect_batch();
+#endif
 					n = upnp_get_portmapping_number_of_entries();
 					while (--n >= 0) {
 						if (upnp_get_redirection_infos_by_index(n, &eport, proto, &iport, iaddr, sizeof(iaddr), desc, sizeof(desc)) == 0) {
 							upnp_delete_redirection(eport, proto);
 						}
 					}
+#if defined(USE_NETFILTER)
+					commit_redirect_batch();
+#endif
 					break;
 				}
 				else {
@@ -1108,6 +1125,13 @@ main(int argc, char * * argv)
 		i = 0;	/* active HTTP connections count */
 		for(e = upnphttphead.lh_first; e != NULL; e = e->entries.le_next)
 		{
+			/* persistent connections are closed once idle for too long */
+			if((e->socket >= 0) && (e->state <= 2)
+			   && (timeofday.tv_sec >= e->lastactivity + HTTP_IDLE_TIMEOUT))
+			{
+				syslog(LOG_DEBUG, "closing idle HTTP connection");
+				CloseSocket_upnphttp(e);
+			}
 			if((e->socket >= 0) && (e->state <= 2))
 			{
 				FD_SET(e->socket, &readset);
@@ -1115,6 +1139,11 @@ main(int argc, char * * argv)
 				i++;
 			}
 		}
+		if(i > 0 && timeout.tv_sec >= HTTP_IDLE_TIMEOUT)
+		{
+			timeout.tv_sec = HTTP_IDLE_TIMEOUT;
+			timeout.tv_usec = 0;
+		}
 		/* for debug */
 #ifdef DEBUG
 		if(i > 1)
@@ -8,6 +8,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 #include <sys/errno.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -37,96 +38,404 @@
 #include "iptcrdr.h"
 #include "../upnpglobalvars.h"
 
-/* dummy init and shutdown functions */
-int init_redirect(void)
+/* netfilter cannot store redirection descriptions, and reading the
+ * chain back means copying the whole nat table out of the kernel,
+ * so we keep our own copy of the redirections : a list in chain
+ * order (rule n of the chain is the n-th element) and a hash on
+ * (eport, proto). It is loaded from the chain when first needed and
+ * reloaded whenever it no longer matches it, for example after the
+ * firewall was restarted under us. Counters are read from the kernel
+ * only when asked for, and at most once per second, so that a sweep
+ * over all the rules costs a single snapshot. */
+struct rdr {
+	struct rdr * next;		/* chain order */
+	struct rdr * hash_next;
+	unsigned short eport;
+	unsigned short iport;
+	short proto;
+	uint32_t iaddr;			/* host byte order */
+	u_int64_t packets;
+	u_int64_t bytes;
+	char * desc;
+};
+
+#define RDR_HASH_SIZE	64
+
+static struct rdr * rdr_list = 0;
+static struct rdr ** rdr_tail = &rdr_list;
+static struct rdr * rdr_hash[RDR_HASH_SIZE];
+static int rdr_count = 0;
+static int rdr_loaded = 0;
+static time_t rdr_counters_time = 0;
+/* last rule returned by get_redirect_rule_by_index(), so that
+ * walking the rules in order does not walk the list each time */
+static struct rdr * rdr_cursor = 0;
+static int rdr_cursor_index = 0;
+
+/* handles kept open between begin_redirect_batch() and
+ * commit_redirect_batch() */
+#define TABLE_NAT		0
+#define TABLE_FILTER	1
+static const char * const table_names[2] = { "nat", "filter" };
+static int batching = 0;
+static IPTC_HANDLE batch_h[2];
+static int batch_changed[2];
+
+static const char *
+table_chain(int t)
 {
-	return 0;
+	return (t == TABLE_NAT) ? miniupnpd_nat_chain : miniupnpd_forward_chain;
 }
 
-void shutdown_redirect(void)
+static void
+free_handle(IPTC_HANDLE h)
 {
-	return;
+	if(h)
+#ifdef IPTABLES_143
+		iptc_free(h);
+#else
+		iptc_free(&h);
+#endif
 }
 
-/* convert an ip address to string */
-static int snprintip(char * dst, size_t size, uint32_t ip)
+/* open_table()
+ * returns a handle on the table, checking our chain is there.
+ * While batching, the same handle is returned until the commit. */
+static IPTC_HANDLE
+open_table(int t, const char * logcaller)
 {
-	return snprintf(dst, size,
-	       "%u.%u.%u.%u", ip >> 24, (ip >> 16) & 0xff,
-	       (ip >> 8) & 0xff, ip & 0xff);
+	IPTC_HANDLE h;
+	if(batching && batch_h[t])
+		return batch_h[t];
+	h = iptc_init(table_names[t]);
+	if(!h)
+	{
+		syslog(LOG_ERR, "%s : iptc_init() error : %s\n",
+		       logcaller, iptc_strerror(errno));
+		return 0;
+	}
+	if(!iptc_is_chain(table_chain(t), h))
+	{
+		syslog(LOG_ERR, "%s : chain %s not found\n",
+		       logcaller, table_chain(t));
+		free_handle(h);
+		return 0;
+	}
+	if(batching)
+	{
+		batch_h[t] = h;
+		batch_changed[t] = 0;
+	}
+	return h;
 }
 
-/* netfilter cannot store redirection descriptions, so we use our
- * own structure to store them */
-struct rdr_desc {
-	struct rdr_desc * next;
-	unsigned short eport;
-	short proto;
-	char str[];
-};
+/* close_table()
+ * commits the changes made to the table if any, unless batching.
+ * return 0 on success, -1 on failure */
+static int
+close_table(int t, IPTC_HANDLE h, int changed, const char * logcaller)
+{
+	int r = 0;
+	if(batching && batch_h[t] == h)
+	{
+		batch_changed[t] |= changed;
+		return 0;
+	}
+#ifdef IPTABLES_143
+	if(changed && !iptc_commit(h))
+#else
+	if(changed && !iptc_commit(&h))
+#endif
+	{
+		syslog(LOG_ERR, "%s : iptc_commit() error : %s\n",
+		       logcaller, iptc_strerror(errno));
+		r = -1;
+	}
+	free_handle(h);
+	return r;
+}
 
-/* pointer to the chained list where descriptions are stored */
-static struct rdr_desc * rdr_desc_list = 0;
+/* begin_redirect_batch()
+ * rules added or deleted until commit_redirect_batch() are
+ * committed to the kernel once per table instead of once each */
+void
+begin_redirect_batch(void)
+{
+	batching = 1;
+}
+
+int
+commit_redirect_batch(void)
+{
+	int t, r = 0;
+	if(!batching)
+		return 0;
+	batching = 0;
+	for(t = TABLE_NAT; t <= TABLE_FILTER; t++)
+	{
+		if(batch_h[t] && close_table(t, batch_h[t], batch_changed[t],
+		                             "commit_redirect_batch()") < 0)
+			r = -1;
+		batch_h[t] = 0;
+	}
+	if(r < 0)
+		rdr_loaded = 0;		/* the kernel did not take it all */
+	return r;
+}
 
+/* nat_rule_info()
+ * extract the redirection from a rule of the nat chain */
 static void
-add_redirect_desc(unsigned short eport, int proto, const char * desc)
+nat_rule_info(const struct ipt_entry * e, unsigned short * eport, int * proto,
+              uint32_t * iaddr, unsigned short * iport)
 {
-	struct rdr_desc * p;
-	size_t l;
-	if(desc)
+	const struct ipt_entry_target * target;
+	const struct ip_nat_multi_range * mr;
+	const struct ipt_entry_match *match;
+
+	*proto = e->ip.proto;
+	match = (const struct ipt_entry_match *)&e->elems;
+	if(0 == strncmp(match->u.user.name, "tcp", IPT_FUNCTION_MAXNAMELEN))
 	{
-		l = strlen(desc) + 1;
-		p = malloc(sizeof(struct rdr_desc) + l);
-		if(p)
-		{
-			p->next = rdr_desc_list;
-			p->eport = eport;
-			p->proto = (short)proto;
-			memcpy(p->str, desc, l);
-			rdr_desc_list = p;
-		}
+		const struct ipt_tcp * info;
+		info = (const struct ipt_tcp *)match->data;
+		*eport = info->dpts[0];
 	}
+	else
+	{
+		const struct ipt_udp * info;
+		info = (const struct ipt_udp *)match->data;
+		*eport = info->dpts[0];
+	}
+	target = (void *)e + e->target_offset;
+	mr = (const struct ip_nat_multi_range *)&target->data[0];
+	*iaddr = ntohl(mr->range[0].min_ip);
+	*iport = ntohs(mr->range[0].min.all);
+}
+
+static unsigned int
+rdr_hashval(unsigned short eport, int proto)
+{
+	return (eport ^ (eport >> 6) ^ proto) & (RDR_HASH_SIZE - 1);
+}
+
+static struct rdr *
+rdr_find(struct rdr ** hash, unsigned short eport, int proto)
+{
+	struct rdr * p;
+	for(p = hash[rdr_hashval(eport, proto)]; p; p = p->hash_next)
+	{
+		if(p->eport == eport && p->proto == (short)proto)
+			return p;
+	}
+	return 0;
+}
+
+/* rdr_append()
+ * add a rule at the end of our copy of the chain, taking desc */
+static struct rdr *
+rdr_append(unsigned short eport, int proto, uint32_t iaddr,
+           unsigned short iport, char * desc)
+{
+	struct rdr * p, ** pp;
+	p = calloc(1, sizeof(struct rdr));
+	if(!p)
+	{
+		free(desc);
+		rdr_loaded = 0;
+		return 0;
+	}
+	p->eport = eport;
+	p->proto = (short)proto;
+	p->iaddr = iaddr;
+	p->iport = iport;
+	p->desc = desc;
+	/* the first rule of the chain has to be the one found on lookups,
+	 * so duplicates go at the end of the hash chain too */
+	for(pp = &rdr_hash[rdr_hashval(eport, proto)]; *pp; pp = &(*pp)->hash_next);
+	*pp = p;
+	*rdr_tail = p;
+	rdr_tail = &p->next;
+	rdr_count++;
+	rdr_cursor = 0;
+	return p;
 }
 
 static void
-del_redirect_desc(unsigned short eport, int proto)
+rdr_remove(unsigned short eport, int proto)
 {
-	struct rdr_desc * p, * last;
-	p = rdr_desc_list;
-	last = 0;
-	while(p)
+	struct rdr * p, ** pp;
+	if(!(p = rdr_find(rdr_hash, eport, proto)))
+		return;
+	for(pp = &rdr_hash[rdr_hashval(eport, proto)]; *pp != p; pp = &(*pp)->hash_next);
+	*pp = p->hash_next;
+	for(pp = &rdr_list; *pp != p; pp = &(*pp)->next);
+	*pp = p->next;
+	if(rdr_tail == &p->next)
+		rdr_tail = pp;
+	rdr_count--;
+	rdr_cursor = 0;
+	free(p->desc);
+	free(p);
+}
+
+/* rdr_load()
+ * rebuild our copy from the nat chain, keeping known descriptions */
+static void
+rdr_load(IPTC_HANDLE h)
+{
+	struct rdr * old_hash[RDR_HASH_SIZE];
+	struct rdr * old_list, * p, * q;
+	const struct ipt_entry * e;
+	unsigned short eport, iport;
+	uint32_t iaddr;
+	int proto;
+	char * desc;
+
+	memcpy(old_hash, rdr_hash, sizeof(old_hash));
+	memset(rdr_hash, 0, sizeof(rdr_hash));
+	old_list = rdr_list;
+	rdr_list = 0;
+	rdr_tail = &rdr_list;
+	rdr_count = 0;
+	rdr_cursor = 0;
+	rdr_loaded = 1;
+#ifdef IPTABLES_143
+	for(e = iptc_first_rule(miniupnpd_nat_chain, h);
+	    e;
+		e = iptc_next_rule(e, h))
+#else
+	for(e = iptc_first_rule(miniupnpd_nat_chain, &h);
+	    e;
+		e = iptc_next_rule(e, &h))
+#endif
 	{
-		if(p->eport == eport && p->proto == proto)
+		nat_rule_info(e, &eport, &proto, &iaddr, &iport);
+		desc = 0;
+		if((q = rdr_find(old_hash, eport, proto)))
+		{
+			desc = q->desc;
+			q->desc = 0;
+		}
+		if((p = rdr_append(eport, proto, iaddr, iport, desc)))
 		{
-			if(!last)
-				rdr_desc_list = p->next;
-			else
-				last->next = p->next;
-			free(p);
-			return;
+			p->packets = e->counters.pcnt;
+			p->bytes = e->counters.bcnt;
 		}
-		last = p;
-		p = p->next;
+	}
+	while(old_list)
+	{
+		p = old_list;
+		old_list = p->next;
+		free(p->desc);
+		free(p);
 	}
 }
 
-static void
-get_redirect_desc(unsigned short eport, int proto,
-                  char * desc, int desclen)
+/* rdr_sync()
+ * make sure our copy of the chain is loaded, and if counters are
+ * wanted, refresh them all from a single snapshot of the chain.
+ * The copy is reloaded if the snapshot shows it is out of date. */
+static int
+rdr_sync(int counters, const char * logcaller)
 {
-	struct rdr_desc * p;
-	if(!desc || (desclen == 0))
-		return;
-	for(p = rdr_desc_list; p; p = p->next)
+	IPTC_HANDLE h;
+	const struct ipt_entry * e;
+	struct rdr * p;
+	unsigned short eport, iport;
+	uint32_t iaddr;
+	int proto;
+	time_t now;
+
+	now = time(0);
+	if(rdr_loaded && (!counters || now == rdr_counters_time))
+		return 0;
+	h = open_table(TABLE_NAT, logcaller);
+	if(!h)
+		return -1;
+	p = rdr_list;
+	if(rdr_loaded)
 	{
-		if(p->eport == eport && p->proto == (short)proto)
+#ifdef IPTABLES_143
+		for(e = iptc_first_rule(miniupnpd_nat_chain, h);
+		    e;
+			e = iptc_next_rule(e, h))
+#else
+		for(e = iptc_first_rule(miniupnpd_nat_chain, &h);
+		    e;
+			e = iptc_next_rule(e, &h))
+#endif
+		{
+			nat_rule_info(e, &eport, &proto, &iaddr, &iport);
+			if(!p || p->eport != eport || p->proto != (short)proto
+			   || p->iaddr != iaddr || p->iport != iport)
+				break;
+			p->packets = e->counters.pcnt;
+			p->bytes = e->counters.bcnt;
+			p = p->next;
+		}
+		if(e || p)
 		{
-			strncpy(desc, p->str, desclen);
-			return;
+			syslog(LOG_NOTICE, "chain %s changed, reloading rules",
+			       miniupnpd_nat_chain);
+			rdr_loaded = 0;
 		}
 	}
+	if(!rdr_loaded)
+		rdr_load(h);
+	rdr_counters_time = now;
+	close_table(TABLE_NAT, h, 0, logcaller);
+	return 0;
+}
+
+/* init_redirect() loads the rules already in the chain */
+int init_redirect(void)
+{
+	rdr_sync(0, "init_redirect()");
+	return 0;
+}
+
+void shutdown_redirect(void)
+{
+	commit_redirect_batch();
+	return;
+}
+
+/* reload_redirect_rules()
+ * to be called when the chains may have been rebuilt by someone else */
+void
+reload_redirect_rules(void)
+{
+	rdr_loaded = 0;
+	rdr_sync(0, "reload_redirect_rules()");
+}
+
+/* convert an ip address to string */
+static int snprintip(char * dst, size_t size, uint32_t ip)
+{
+	return snprintf(dst, size,
+	       "%u.%u.%u.%u", ip >> 24, (ip >> 16) & 0xff,
+	       (ip >> 8) & 0xff, ip & 0xff);
+}
+
+/* copy the information about rule p out */
+static void
+get_rdr_infos(const struct rdr * p,
+              char * iaddr, int iaddrlen, unsigned short * iport,
+              char * desc, int desclen,
+              u_int64_t * packets, u_int64_t * bytes)
+{
+	if(iaddr && iaddrlen > 0)
+		snprintip(iaddr, iaddrlen, p->iaddr);
+	if(iport)
+		*iport = p->iport;
 	/* if no description was found, return miniupnpd as default */
-	strncpy(desc, "miniupnpd", desclen);
+	if(desc && desclen > 0)
+		strncpy(desc, p->desc ? p->desc : "miniupnpd", desclen);
+	if(packets)
+		*packets = p->packets;
+	if(bytes)
+		*bytes = p->bytes;
 }
 
 /* add_redirect_rule2() */
@@ -135,9 +444,12 @@ add_redirect_rule2(const char * ifname, unsigned short eport,
                    const char * iaddr, unsigned short iport, int proto,
 				   const char * desc)
 {
-	int r = addnatrule(proto, eport, iaddr, iport);
-	if(r >= 0)
-		add_redirect_desc(eport, proto, desc);
+	int r;
+	rdr_sync(0, "add_redirect_rule2()");
+	r = addnatrule(proto, eport, iaddr, iport);
+	if(r >= 0 && rdr_loaded)
+		rdr_append(eport, proto, ntohl(inet_addr(iaddr)), iport,
+		           desc ? strdup(desc) : 0);
 	return r;
 }
 
@@ -157,78 +469,14 @@ get_redirect_rule(const char * ifname, unsigned short eport, int proto,
                   char * desc, int desclen,
                   u_int64_t * packets, u_int64_t * bytes)
 {
-	int r = -1;
-	IPTC_HANDLE h;
-	const struct ipt_entry * e;
-	const struct ipt_entry_target * target;
-	const struct ip_nat_multi_range * mr;
-	const struct ipt_entry_match *match;
+	struct rdr * p;
 
-	h = iptc_init("nat");
-	if(!h)
-	{
-		syslog(LOG_ERR, "get_redirect_rule() : "
-		                "iptc_init() failed : %s",
-		       iptc_strerror(errno));
+	if(rdr_sync(packets || bytes, "get_redirect_rule()") < 0)
 		return -1;
-	}
-	if(!iptc_is_chain(miniupnpd_nat_chain, h))
-	{
-		syslog(LOG_ERR, "chain %s not found", miniupnpd_nat_chain);
-	}
-	else
-	{
-#ifdef IPTABLES_143
-		for(e = iptc_first_rule(miniupnpd_nat_chain, h);
-		    e;
-			e = iptc_next_rule(e, h))
-#else
-		for(e = iptc_first_rule(miniupnpd_nat_chain, &h);
-		    e;
-			e = iptc_next_rule(e, &h))
-#endif
-		{
-			if(proto==e->ip.proto)
-			{
-				match = (const struct ipt_entry_match *)&e->elems;
-				if(0 == strncmp(match->u.user.name, "tcp", IPT_FUNCTION_MAXNAMELEN))
-				{
-					const struct ipt_tcp * info;
-					info = (const struct ipt_tcp *)match->data;
-					if(eport != info->dpts[0])
-						continue;
-				}
-				else
-				{
-					const struct ipt_udp * info;
-					info = (const struct ipt_udp *)match->data;
-					if(eport != info->dpts[0])
-						continue;
-				}
-				target = (void *)e + e->target_offset;
-				//target = ipt_get_target(e);
-				mr = (const struct ip_nat_multi_range *)&target->data[0];
-				snprintip(iaddr, iaddrlen, ntohl(mr->range[0].min_ip));
-				*iport = ntohs(mr->range[0].min.all);
-				/*if(desc)
-					strncpy(desc, "miniupnpd", desclen);*/
-				get_redirect_desc(eport, proto, desc, desclen);
-				if(packets)
-					*packets = e->counters.pcnt;
-				if(bytes)
-					*bytes = e->counters.bcnt;
-				r = 0;
-				break;
-			}
-		}
-	}
-	if(h)
-#ifdef IPTABLES_143
-		iptc_free(h);
-#else
-		iptc_free(&h);
-#endif
-	return r;
+	if(!(p = rdr_find(rdr_hash, eport, proto)))
+		return -1;
+	get_rdr_infos(p, iaddr, iaddrlen, iport, desc, desclen, packets, bytes);
+	return 0;
 }
 
 /* get_redirect_rule_by_index() 
@@ -240,119 +488,67 @@ get_redirect_rule_by_index(int index,
                            int * proto, char * desc, int desclen,
                            u_int64_t * packets, u_int64_t * bytes)
 {
-	int r = -1;
-	int i = 0;
-	IPTC_HANDLE h;
-	const struct ipt_entry * e;
-	const struct ipt_entry_target * target;
-	const struct ip_nat_multi_range * mr;
-	const struct ipt_entry_match *match;
+	struct rdr * p;
+	int i;
 
-	h = iptc_init("nat");
-	if(!h)
-	{
-		syslog(LOG_ERR, "get_redirect_rule_by_index() : "
-		                "iptc_init() failed : %s",
-		       iptc_strerror(errno));
+	if(rdr_sync(packets || bytes, "get_redirect_rule_by_index()") < 0)
 		return -1;
-	}
-	if(!iptc_is_chain(miniupnpd_nat_chain, h))
+	if(index < 0 || index >= rdr_count)
+		return -1;
+	if(rdr_cursor && rdr_cursor_index <= index)
 	{
-		syslog(LOG_ERR, "chain %s not found", miniupnpd_nat_chain);
+		p = rdr_cursor;
+		i = rdr_cursor_index;
 	}
 	else
 	{
-#ifdef IPTABLES_143
-		for(e = iptc_first_rule(miniupnpd_nat_chain, h);
-		    e;
-			e = iptc_next_rule(e, h))
-#else
-		for(e = iptc_first_rule(miniupnpd_nat_chain, &h);
-		    e;
-			e = iptc_next_rule(e, &h))
-#endif
-		{
-			if(i==index)
-			{
-				*proto = e->ip.proto;
-				match = (const struct ipt_entry_match *)&e->elems;
-				if(0 == strncmp(match->u.user.name, "tcp", IPT_FUNCTION_MAXNAMELEN))
-				{
-					const struct ipt_tcp * info;
-					info = (const struct ipt_tcp *)match->data;
-					*eport = info->dpts[0];
-				}
-				else
-				{
-					const struct ipt_udp * info;
-					info = (const struct ipt_udp *)match->data;
-					*eport = info->dpts[0];
-				}
-				target = (void *)e + e->target_offset;
-				mr = (const struct ip_nat_multi_range *)&target->data[0];
-				snprintip(iaddr, iaddrlen, ntohl(mr->range[0].min_ip));
-				*iport = ntohs(mr->range[0].min.all);
-                /*if(desc)
-				    strncpy(desc, "miniupnpd", desclen);*/
-				get_redirect_desc(*eport, *proto, desc, desclen);
-				if(packets)
-					*packets = e->counters.pcnt;
-				if(bytes)
-					*bytes = e->counters.bcnt;
-				r = 0;
-				break;
-			}
-			i++;
-		}
+		p = rdr_list;
+		i = 0;
 	}
-	if(h)
-#ifdef IPTABLES_143
-		iptc_free(h);
-#else
-		iptc_free(&h);
-#endif
-	return r;
+	for(; p && i < index; p = p->next, i++);
+	if(!p)
+		return -1;
+	rdr_cursor = p;
+	rdr_cursor_index = index;
+	*eport = p->eport;
+	*proto = p->proto;
+	get_rdr_infos(p, iaddr, iaddrlen, iport, desc, desclen, packets, bytes);
+	return 0;
+}
+
+/* get_redirect_rule_count()
+ * number of rules in the chain */
+int
+get_redirect_rule_count(void)
+{
+	if(rdr_sync(0, "get_redirect_rule_count()") < 0)
+		return 0;
+	return rdr_count;
 }
 
-/* delete_rule_and_commit() :
- * subfunction used in delete_redirect_and_filter_rules() */
+/* delete_rule()
+ * subfunction used in delete_redirect_and_filter_rules(),
+ * h is closed in all cases */
 static int
-delete_rule_and_commit(unsigned int index, IPTC_HANDLE h,
-                       const char * miniupnpd_chain,
-                       const char * logcaller)
+delete_rule(int t, IPTC_HANDLE h, unsigned int index, const char * logcaller)
 {
-	int r = 0;
 #ifdef IPTABLES_143
-	if(!iptc_delete_num_entry(miniupnpd_chain, index, h))
+	if(!iptc_delete_num_entry(table_chain(t), index, h))
 #else
-	if(!iptc_delete_num_entry(miniupnpd_chain, index, &h))
+	if(!iptc_delete_num_entry(table_chain(t), index, &h))
 #endif
 	{
 		syslog(LOG_ERR, "%s() : iptc_delete_num_entry(): %s\n",
 	    	   logcaller, iptc_strerror(errno));
-		r = -1;
-	}
-#ifdef IPTABLES_143
-	else if(!iptc_commit(h))
-#else
-	else if(!iptc_commit(&h))
-#endif
-	{
-		syslog(LOG_ERR, "%s() : iptc_commit(): %s\n",
-	    	   logcaller, iptc_strerror(errno));
-		r = -1;
+		close_table(t, h, 0, logcaller);
+		return -1;
 	}
-	if(h)
-#ifdef IPTABLES_143
-		iptc_free(h);
-#else
-		iptc_free(&h);
-#endif
-	return r;
+	return close_table(t, h, 1, logcaller);
 }
 
 /* delete_redirect_and_filter_rules()
- */
+ * the index is taken from the chain itself rather than from our copy,
+ * the filter rule is at the same index as the nat rule */
 int
 delete_redirect_and_filter_rules(unsigned short eport, int proto)
 {
@@ -361,76 +557,48 @@ delete_redirect_and_filter_rules(unsigned short eport, int proto)
 	unsigned i = 0;
 	IPTC_HANDLE h;
 	const struct ipt_entry * e;
-	const struct ipt_entry_match *match;
+	unsigned short e_eport, e_iport;
+	uint32_t e_iaddr;
+	int e_proto;
 
-	h = iptc_init("nat");
+	h = open_table(TABLE_NAT, "delete_redirect_and_filter_rules()");
 	if(!h)
-	{
-		syslog(LOG_ERR, "delete_redirect_and_filter_rules() : "
-		                "iptc_init() failed : %s",
-		       iptc_strerror(errno));
 		return -1;
-	}
-	if(!iptc_is_chain(miniupnpd_nat_chain, h))
-	{
-		syslog(LOG_ERR, "chain %s not found", miniupnpd_nat_chain);
-	}
-	else
-	{
 #ifdef IPTABLES_143
-		for(e = iptc_first_rule(miniupnpd_nat_chain, h);
-		    e;
-			e = iptc_next_rule(e, h), i++)
+	for(e = iptc_first_rule(miniupnpd_nat_chain, h);
+	    e;
+		e = iptc_next_rule(e, h), i++)
 #else
-		for(e = iptc_first_rule(miniupnpd_nat_chain, &h);
-		    e;
-			e = iptc_next_rule(e, &h), i++)
+	for(e = iptc_first_rule(miniupnpd_nat_chain, &h);
+	    e;
+		e = iptc_next_rule(e, &h), i++)
 #endif
+	{
+		nat_rule_info(e, &e_eport, &e_proto, &e_iaddr, &e_iport);
+		if(e_proto == proto && e_eport == eport)
 		{
-			if(proto==e->ip.proto)
-			{
-				match = (const struct ipt_entry_match *)&e->elems;
-				if(0 == strncmp(match->u.user.name, "tcp", IPT_FUNCTION_MAXNAMELEN))
-				{
-					const struct ipt_tcp * info;
-					info = (const struct ipt_tcp *)match->data;
-					if(eport != info->dpts[0])
-						continue;
-				}
-				else
-				{
-					const struct ipt_udp * info;
-					info = (const struct ipt_udp *)match->data;
-					if(eport != info->dpts[0])
-						continue;
-				}
-				index = i;
-				r = 0;
-				break;
-			}
+			index = i;
+			r = 0;
+			break;
 		}
 	}
-	if(h)
-#ifdef IPTABLES_143
-		iptc_free(h);
-#else
-		iptc_free(&h);
-#endif
 	if(r == 0)
 	{
 		syslog(LOG_INFO, "Trying to delete rules at index %u", index);
 		/* Now delete both rules */
-		h = iptc_init("nat");
-		if(h)
-		{
-			r = delete_rule_and_commit(index, h, miniupnpd_nat_chain, "delete_redirect_rule");
-		}
-		if((r == 0) && (h = iptc_init("filter")))
-		{
-			r = delete_rule_and_commit(index, h, miniupnpd_forward_chain, "delete_filter_rule");
-		}
+		r = delete_rule(TABLE_NAT, h, index, "delete_redirect_rule");
+		if((r == 0) && (h = open_table(TABLE_FILTER, "delete_filter_rule")))
+			r = delete_rule(TABLE_FILTER, h, index, "delete_filter_rule");
+		else
+			r = -1;
+	}
+	else
+	{
+		close_table(TABLE_NAT, h, 0, "delete_redirect_and_filter_rules()");
 	}
-	del_redirect_desc(eport, proto);
+	rdr_remove(eport, proto);
+	if(r < 0)
+		rdr_loaded = 0;
 	return r;
 }
 
@@ -502,68 +670,25 @@ get_dnat_target(const char * daddr, unsigned short dport)
 /* iptc_init_verify_and_append()
  * return 0 on success, -1 on failure */
 static int
-iptc_init_verify_and_append(const char * table, const char * miniupnpd_chain, struct ipt_entry * e,
+iptc_init_verify_and_append(int t, struct ipt_entry * e,
                             const char * logcaller)
 {
 	IPTC_HANDLE h;
-	h = iptc_init(table);
+	h = open_table(t, logcaller);
 	if(!h)
-	{
-		syslog(LOG_ERR, "%s : iptc_init() error : %s\n",
-		       logcaller, iptc_strerror(errno));
 		return -1;
-	}
-	if(!iptc_is_chain(miniupnpd_chain, h))
-	{
-		syslog(LOG_ERR, "%s : iptc_is_chain() error : %s\n",
-		       logcaller, iptc_strerror(errno));
-		if(h)
 #ifdef IPTABLES_143
-			iptc_free(h);
+	if(!iptc_append_entry(table_chain(t), e, h))
 #else
-			iptc_free(&h);
-#endif
-		return -1;
-	}
-#ifdef IPTABLES_143
-	if(!iptc_append_entry(miniupnpd_chain, e, h))
-#else
-	if(!iptc_append_entry(miniupnpd_chain, e, &h))
+	if(!iptc_append_entry(table_chain(t), e, &h))
 #endif
 	{
 		syslog(LOG_ERR, "%s : iptc_append_entry() error : %s\n",
 		       logcaller, iptc_strerror(errno));
-		if(h)
-#ifdef IPTABLES_143
-			iptc_free(h);
-#else
-			iptc_free(&h);
-#endif
+		close_table(t, h, 0, logcaller);
 		return -1;
 	}
-#ifdef IPTABLES_143
-	if(!iptc_commit(h))
-#else
-	if(!iptc_commit(&h))
-#endif
-	{
-		syslog(LOG_ERR, "%s : iptc_commit() error : %s\n",
-		       logcaller, iptc_strerror(errno));
-		if(h)
-#ifdef IPTABLES_143
-			iptc_free(h);
-#else
-			iptc_free(&h);
-#endif
-		return -1;
-	}
-	if(h)
-#ifdef IPTABLES_143
-		iptc_free(h);
-#else
-		iptc_free(&h);
-#endif
-	return 0;
+	return close_table(t, h, 1, logcaller);
 }
 
 /* add nat rule 
@@ -602,7 +727,7 @@ addnatrule(int proto, unsigned short eport,
 	                 + match->u.match_size
 					 + target->u.target_size;
 	
-	r = iptc_init_verify_and_append("nat", miniupnpd_nat_chain, e, "addnatrule()");
+	r = iptc_init_verify_and_append(TABLE_NAT, e, "addnatrule()");
 	free(target);
 	free(match);
 	free(e);
@@ -658,7 +783,7 @@ add_filter_rule(int proto, const char * iaddr, unsigned short iport)
 	                 + match->u.match_size
 					 + target->u.target_size;
 	
-	r = iptc_init_verify_and_append("filter", miniupnpd_forward_chain, e, "add_filter_rule()");
+	r = iptc_init_verify_and_append(TABLE_FILTER, e, "add_filter_rule()");
 	free(target);
 	free(match);
 	free(e);
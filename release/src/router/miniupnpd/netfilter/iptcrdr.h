@@ -23,6 +23,20 @@ add_filter_rule2(const char * ifname, const char * iaddr,
 int
 delete_redirect_and_filter_rules(unsigned short eport, int proto);
 
+int
+get_redirect_rule_count(void);
+
+/* changes between these two are committed to the kernel at once */
+void
+begin_redirect_batch(void);
+
+int
+commit_redirect_batch(void);
+
+/* forget what we know of the chains and read them again */
+void
+reload_redirect_rules(void);
+
 /* for debug */
 int
 list_redirect_rule(const char * ifname);
@@ -34,6 +34,7 @@
 /* stuctures definitions */
 struct subscriber {
 	LIST_ENTRY(subscriber) entries;
+	LIST_ENTRY(subscriber) wheel;	/* timer wheel slot, if timeout */
 	struct upnp_event_notify * notify;
 	time_t timeout;
 	uint32_t seq;
@@ -72,6 +73,38 @@ LIST_HEAD(listhead, subscriber) subscriberlist = { NULL };
 /* notify list */
 LIST_HEAD(listheadnotif, upnp_event_notify) notifylist = { NULL };
 
+/* Subscribers with a timeout are also on a timer wheel with one slot
+ * per second, so expiring them only looks at the slots of the seconds
+ * gone by instead of at every subscriber on each select() round.
+ * Timeouts further away than the wheel size come back around and are
+ * skipped until their time. */
+#define SUBSCRIBER_WHEEL_SIZE	(64)
+LIST_HEAD(listheadwheel, subscriber) subscriberwheel[SUBSCRIBER_WHEEL_SIZE];
+/* every timeout before this has been looked at */
+static time_t subscriberwheel_time = 0;
+
+static void
+wheel_insert(struct subscriber * sub, time_t t)
+{
+	LIST_INSERT_HEAD(&subscriberwheel[t % SUBSCRIBER_WHEEL_SIZE], sub, wheel);
+}
+
+static void
+wheel_remove(struct subscriber * sub)
+{
+	if(sub->timeout)
+		LIST_REMOVE(sub, wheel);
+}
+
+/* remove a subscriber from the lists and free it */
+static void
+freeSubscriber(struct subscriber * sub)
+{
+	wheel_remove(sub);
+	LIST_REMOVE(sub, entries);
+	free(sub);
+}
+
 /* create a new subscriber */
 static struct subscriber *
 newSubscriber(const char * eventurl, const char * callback, int callbacklen)
@@ -119,8 +152,10 @@ upnpevents_addSubscriber(const char * eventurl,
 	tmp = newSubscriber(eventurl, callback, callbacklen);
 	if(!tmp)
 		return NULL;
-	if(timeout)
+	if(timeout) {
 		tmp->timeout = time(NULL) + timeout;
+		wheel_insert(tmp, tmp->timeout);
+	}
 	LIST_INSERT_HEAD(&subscriberlist, tmp, entries);
 	upnp_event_create_notify(tmp);
 	return tmp->uuid;
@@ -133,7 +168,10 @@ renewSubscription(const char * sid, int sidlen, int timeout)
 	struct subscriber * sub;
 	for(sub = subscriberlist.lh_first; sub != NULL; sub = sub->entries.le_next) {
 		if(memcmp(sid, sub->uuid, 41) == 0) {
+			wheel_remove(sub);
 			sub->timeout = (timeout ? time(NULL) + timeout : 0);
+			if(sub->timeout)
+				wheel_insert(sub, sub->timeout);
 			return 0;
 		}
 	}
@@ -151,8 +189,7 @@ upnpevents_removeSubscriber(const char * sid, int sidlen)
 			if(sub->notify) {
 				sub->notify->sub = NULL;
 			}
-			LIST_REMOVE(sub, entries);
-			free(sub);
+			freeSubscriber(sub);
 			return 0;
 		}
 	}
@@ -402,6 +439,7 @@ void upnpevents_processfds(fd_set *readset, fd_set *writeset)
 	struct subscriber * sub;
 	struct subscriber * subnext;
 	time_t curtime;
+	time_t t;
 	for(obj = notifylist.lh_first; obj != NULL; obj = obj->entries.le_next) {
 		syslog(LOG_DEBUG, "%s: %p %d %d %d %d",
 		       "upnpevents_processfds", obj, obj->state, obj->s,
@@ -422,8 +460,7 @@ void upnpevents_processfds(fd_set *readset, fd_set *writeset)
 				obj->sub->notify = NULL;
 			/* remove also the subscriber from the list if there was an error */
 			if(obj->state == EError && obj->sub) {
-				LIST_REMOVE(obj->sub, entries);
-				free(obj->sub);
+				freeSubscriber(obj->sub);
 			}
 			if(obj->buffer) {
 				free(obj->buffer);
@@ -435,14 +472,25 @@ void upnpevents_processfds(fd_set *readset, fd_set *writeset)
 	}
 	/* remove timeouted subscribers */
 	curtime = time(NULL);
-	for(sub = subscriberlist.lh_first; sub != NULL; ) {
-		subnext = sub->entries.le_next;
-		if(sub->timeout && curtime > sub->timeout && sub->notify == NULL) {
-			LIST_REMOVE(sub, entries);
-			free(sub);
+	if(subscriberwheel_time == 0
+	   || curtime - subscriberwheel_time >= SUBSCRIBER_WHEEL_SIZE)
+		subscriberwheel_time = curtime - SUBSCRIBER_WHEEL_SIZE + 1;
+	for(t = subscriberwheel_time; t < curtime; t++) {
+		for(sub = subscriberwheel[t % SUBSCRIBER_WHEEL_SIZE].lh_first; sub != NULL; ) {
+			subnext = sub->wheel.le_next;
+			if(sub->timeout <= t) {
+				if(sub->notify == NULL) {
+					freeSubscriber(sub);
+				} else {
+					/* wait for the notify to finish */
+					LIST_REMOVE(sub, wheel);
+					wheel_insert(sub, curtime);
+				}
+			}
+			sub = subnext;
 		}
-		sub = subnext;
 	}
+	subscriberwheel_time = curtime;
 }
 
 #ifdef USE_MINIUPNPDCTL
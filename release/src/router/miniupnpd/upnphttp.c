@@ -33,6 +33,7 @@ New_upnphttp(int s)
 		return NULL;
 	memset(ret, 0, sizeof(struct upnphttp));
 	ret->socket = s;
+	ret->lastactivity = time(NULL);
 	return ret;
 }
 
@@ -47,6 +48,51 @@ CloseSocket_upnphttp(struct upnphttp * h)
 	h->state = 100;
 }
 
+void
+Done_upnphttp(struct upnphttp * h)
+{
+	int used;
+	if(!h->keepalive || h->socket < 0)
+	{
+		CloseSocket_upnphttp(h);
+		return;
+	}
+	/* keep what the client already sent of its next request */
+	used = h->req_contentoff + h->req_contentlen;
+	if(used < h->req_buflen)
+	{
+		memmove(h->req_buf, h->req_buf + used, h->req_buflen - used);
+		h->req_buflen -= used;
+		h->req_buf[h->req_buflen] = '\0';
+	}
+	else
+	{
+		free(h->req_buf);
+		h->req_buf = NULL;
+		h->req_buflen = 0;
+	}
+	if(h->res_buf)
+		free(h->res_buf);
+	h->res_buf = NULL;
+	h->res_buflen = 0;
+	h->res_buf_alloclen = 0;
+	h->req_contentlen = 0;
+	h->req_contentoff = 0;
+	h->req_command = EUnknown;
+	h->req_soapAction = NULL;
+	h->req_soapActionLen = 0;
+#ifdef ENABLE_EVENTS
+	h->req_Callback = NULL;
+	h->req_CallbackLen = 0;
+	h->req_Timeout = 0;
+	h->req_SID = NULL;
+	h->req_SIDLen = 0;
+#endif
+	h->respflags = 0;
+	h->keepalive = 0;
+	h->state = 0;
+}
+
 void
 Delete_upnphttp(struct upnphttp * h)
 {
@@ -87,6 +133,16 @@ ParseHttpHeaders(struct upnphttp * h)
 				printf("    readbufflen=%d contentoff = %d\n",
 					h->req_buflen, h->req_contentoff);*/
 			}
+			else if(strncasecmp(line, "Connection", 10)==0)
+			{
+				p = colon + 1;
+				while(isspace(*p))
+					p++;
+				if(strncasecmp(p, "close", 5)==0)
+					h->keepalive = 0;
+				else if(strncasecmp(p, "keep-alive", 10)==0)
+					h->keepalive = 1;
+			}
 			else if(strncasecmp(line, "SOAPAction", 10)==0)
 			{
 				p = colon;
@@ -175,6 +231,7 @@ Send404(struct upnphttp * h)
 		"<BODY><H1>Not Found</H1>The requested URL was not found"
 		" on this server.</BODY></HTML>\r\n";
 	h->respflags = FLAG_HTML;
+	h->keepalive = 0;
 	BuildResp2_upnphttp(h, 404, "Not Found",
 	                    body404, sizeof(body404) - 1);
 	SendResp_upnphttp(h);
@@ -205,6 +262,7 @@ Send501(struct upnphttp * h)
 		"<BODY><H1>Not Implemented</H1>The HTTP Method "
 		"is not implemented by this server.</BODY></HTML>\r\n";
 	h->respflags = FLAG_HTML;
+	h->keepalive = 0;
 	BuildResp2_upnphttp(h, 501, "Not Implemented",
 	                    body501, sizeof(body501) - 1);
 	SendResp_upnphttp(h);
@@ -238,7 +296,7 @@ sendDummyDesc(struct upnphttp * h)
 		"</scpd>\r\n";
 	BuildResp_upnphttp(h, xml_desc, sizeof(xml_desc)-1);
 	SendResp_upnphttp(h);
-	CloseSocket_upnphttp(h);
+	Done_upnphttp(h);
 }
 #endif
 
@@ -263,7 +321,7 @@ sendXMLdesc(struct upnphttp * h, char * (f)(int *))
 		BuildResp_upnphttp(h, desc, len);
 	}
 	SendResp_upnphttp(h);
-	CloseSocket_upnphttp(h);
+	Done_upnphttp(h);
 	free(desc);
 }
 
@@ -289,6 +347,7 @@ ProcessHTTPPOST_upnphttp(struct upnphttp * h)
 				"<html><body>Bad request</body></html>";
 			syslog(LOG_INFO, "No SOAPAction in HTTP headers");
 			h->respflags = FLAG_HTML;
+			h->keepalive = 0;
 			BuildResp2_upnphttp(h, 400, "Bad Request",
 			                    err400str, sizeof(err400str) - 1);
 			SendResp_upnphttp(h);
@@ -347,7 +406,7 @@ with HTTP error 412 Precondition Failed. */
 			}
 		}
 		SendResp_upnphttp(h);
-		CloseSocket_upnphttp(h);
+		Done_upnphttp(h);
 	}
 }
 
@@ -363,7 +422,7 @@ ProcessHTTPUnSubscribe_upnphttp(struct upnphttp * h, const char * path)
 		BuildResp_upnphttp(h, 0, 0);
 	}
 	SendResp_upnphttp(h);
-	CloseSocket_upnphttp(h);
+	Done_upnphttp(h);
 }
 #endif
 
@@ -396,6 +455,8 @@ ProcessHttpQuery_upnphttp(struct upnphttp * h)
 	HttpVer[i] = '\0';
 	syslog(LOG_INFO, "HTTP REQUEST : %s %s (%s)",
 	       HttpCommand, HttpUrl, HttpVer);
+	/* HTTP/1.1 connections are persistent unless told otherwise */
+	h->keepalive = (strcmp(HttpVer, "HTTP/1.1") == 0);
 	ParseHttpHeaders(h);
 	if(strcmp("POST", HttpCommand) == 0)
 	{
@@ -466,8 +527,10 @@ Process_upnphttp(struct upnphttp * h)
 {
 	char buf[2048];
 	int n;
+	const char * endheaders;
 	if(!h)
 		return;
+	h->lastactivity = time(NULL);
 	switch(h->state)
 	{
 	case 0:
@@ -484,20 +547,12 @@ Process_upnphttp(struct upnphttp * h)
 		}
 		else
 		{
-			const char * endheaders;
 			/* if 1st arg of realloc() is null,
 			 * realloc behaves the same as malloc() */
 			h->req_buf = (char *)realloc(h->req_buf, n + h->req_buflen + 1);
 			memcpy(h->req_buf + h->req_buflen, buf, n);
 			h->req_buflen += n;
 			h->req_buf[h->req_buflen] = '\0';
-			/* search for the string "\r\n\r\n" */
-			endheaders = findendheaders(h->req_buf, h->req_buflen);
-			if(endheaders)
-			{
-				h->req_contentoff = endheaders - h->req_buf + 4;
-				ProcessHttpQuery_upnphttp(h);
-			}
 		}
 		break;
 	case 1:
@@ -515,9 +570,10 @@ Process_upnphttp(struct upnphttp * h)
 		else
 		{
 			/*fwrite(buf, 1, n, stdout);*/	/* debug */
-			h->req_buf = (char *)realloc(h->req_buf, n + h->req_buflen);
+			h->req_buf = (char *)realloc(h->req_buf, n + h->req_buflen + 1);
 			memcpy(h->req_buf + h->req_buflen, buf, n);
 			h->req_buflen += n;
+			h->req_buf[h->req_buflen] = '\0';
 			if((h->req_buflen - h->req_contentoff) >= h->req_contentlen)
 			{
 				ProcessHTTPPOST_upnphttp(h);
@@ -527,13 +583,21 @@ Process_upnphttp(struct upnphttp * h)
 	default:
 		syslog(LOG_WARNING, "Unexpected state: %d", h->state);
 	}
+	/* search for the string "\r\n\r\n", again after each request
+	 * on a persistent connection in case the next one is there */
+	while(h->state == 0 && h->req_buf
+	      && (endheaders = findendheaders(h->req_buf, h->req_buflen)))
+	{
+		h->req_contentoff = endheaders - h->req_buf + 4;
+		ProcessHttpQuery_upnphttp(h);
+	}
 }
 
 static const char httpresphead[] =
 	"%s %d %s\r\n"
 	/*"Content-Type: text/xml; charset=\"utf-8\"\r\n"*/
 	"Content-Type: %s\r\n"
-	"Connection: close\r\n"
+	"Connection: %s\r\n"
 	"Content-Length: %d\r\n"
 	/*"Server: miniupnpd/1.0 UPnP/1.0\r\n"*/
 	"Server: " MINIUPNPD_SERVER_STRING "\r\n"
@@ -566,6 +630,7 @@ BuildHeader_upnphttp(struct upnphttp * h, int respcode,
 	                         httpresphead, h->HttpVer,
 	                         respcode, respmsg,
 	                         (h->respflags&FLAG_HTML)?"text/html":"text/xml",
+	                         h->keepalive ? "keep-alive" : "close",
 							 bodylen);
 	/* Additional headers */
 #ifdef ENABLE_EVENTS
@@ -625,12 +690,14 @@ SendResp_upnphttp(struct upnphttp * h)
 	if(n<0)
 	{
 		syslog(LOG_ERR, "send(res_buf): %m");
+		h->keepalive = 0;
 	}
 	else if(n < h->res_buflen)
 	{
 		/* TODO : handle correctly this case */
 		syslog(LOG_ERR, "send(res_buf): %d bytes sent (out of %d)",
 						n, h->res_buflen);
+		h->keepalive = 0;
 	}
 }
 
@@ -10,9 +10,13 @@
 
 #include <netinet/in.h>
 #include <sys/queue.h>
+#include <time.h>
 
 #include "config.h"
 
+/* seconds an idle HTTP connection is kept open */
+#define HTTP_IDLE_TIMEOUT	(30)
+
 /* server: HTTP header returned in all HTTP responses : */
 #define MINIUPNPD_SERVER_STRING	OS_VERSION " UPnP/1.0 MiniUPnPd/1.4"
 
@@ -35,6 +39,8 @@ struct upnphttp {
 	int socket;
 	struct in_addr clientaddr;	/* client address */
 	int state;
+	int keepalive;		/* connection is kept for the next request */
+	time_t lastactivity;
 	char HttpVer[16];
 	/* request */
 	char * req_buf;
@@ -74,6 +80,12 @@ New_upnphttp(int);
 void
 CloseSocket_upnphttp(struct upnphttp *);
 
+/* Done_upnphttp()
+ * to be called once the response is sent : either close the
+ * connection or get ready for the next request on it */
+void
+Done_upnphttp(struct upnphttp *);
+
 /* Delete_upnphttp() */
 void
 Delete_upnphttp(struct upnphttp *);
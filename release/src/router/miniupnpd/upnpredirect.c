@@ -40,6 +40,7 @@
 #endif
 #ifdef ENABLE_LEASEFILE
 #include <sys/stat.h>
+#include <stdarg.h>
 #endif
 
 /* proto_atoi() 
@@ -54,36 +55,31 @@ proto_atoi(const char * protocol)
 }
 
 #ifdef ENABLE_LEASEFILE
-static int lease_file_add( unsigned short eport, const char * iaddr, unsigned short iport, int proto, const char * desc)
-{
-	FILE * fd;
-
-	if (lease_file == NULL) return 0;
-
-	fd = fopen( lease_file, "a");
-	if (fd==NULL) {
-		syslog(LOG_ERR, "could not open lease file: %s", lease_file);
-		return -1;
-	}
-
-	fprintf( fd, "%s:%hu:%s:%hu:%s\n",
-	         ((proto==IPPROTO_TCP)?"TCP":"UDP"), eport, iaddr, iport, desc);
-	fclose(fd);
-	
-	return 0;
-}
-
-static int lease_file_remove( unsigned short eport, int proto)
+/* The lease file is a journal. Adding a mapping appends
+ * "PROTO:eport:iaddr:iport:desc", removing one appends "-PROTO:eport",
+ * and the last record for a port wins. Once the file holds twice as
+ * many records as there are mappings, it is rewritten with one line
+ * per mapping. */
+#define LEASE_JOURNAL_SLACK	64
+
+static FILE * lease_fd = NULL;
+static int lease_records = 0;
+static int lease_replaying = 0;
+
+/* lease_file_compact()
+ * replace the journal by the list of the current mappings */
+static int lease_file_compact(void)
 {
-	FILE* fd, *fdt;
-	int tmp;
-	char buf[512];
-	char str[32];
+	FILE * fdt;
+	int tmp, n;
+	unsigned short eport, iport;
+	char protocol[4], iaddr[32], desc[64];
 	char tmpfilename[128];
-	int str_size, buf_size;
 
-
-	if (lease_file == NULL) return 0;
+	if (lease_fd != NULL) {
+		fclose(lease_fd);
+		lease_fd = NULL;
+	}
 
 	if (strlen( lease_file) + 7 > sizeof(tmpfilename)) {
 		syslog(LOG_ERR, "Lease filename is too long");
@@ -93,46 +89,91 @@ static int lease_file_remove( unsigned short eport, int proto)
 	strncpy( tmpfilename, lease_file, sizeof(tmpfilename) );
 	strncat( tmpfilename, "XXXXXX", sizeof(tmpfilename) - strlen(tmpfilename));
 
-	fd = fopen( lease_file, "r");
-	if (fd==NULL) {
-		return 0;
-	}
-
-	snprintf( str, sizeof(str), "%s:%u", ((proto==IPPROTO_TCP)?"TCP":"UDP"), eport);
-	str_size = strlen(str);
-
 	tmp = mkstemp(tmpfilename);
 	if (tmp==-1) {
-		fclose(fd);
 		syslog(LOG_ERR, "could not open temporary lease file");
 		return -1;
 	}
 	fchmod(tmp, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-	fdt = fdopen(tmp, "a");
-
-	buf[sizeof(buf)-1] = 0;
-	while( fgets( buf, sizeof(buf)-1, fd) != NULL) {
-		buf_size = strlen(buf);
+	fdt = fdopen(tmp, "w");
+	if (fdt==NULL) {
+		close(tmp);
+		remove( tmpfilename);
+		return -1;
+	}
 
-		if (buf_size < str_size || strncmp( str, buf, str_size)!=0) {
-			fwrite(buf, buf_size, 1, fdt);
-		}
+	for (n = 0; upnp_get_redirection_infos_by_index(n, &eport, protocol, &iport,
+	                                                 iaddr, sizeof(iaddr),
+	                                                 desc, sizeof(desc)) == 0; n++) {
+		fprintf( fdt, "%s:%hu:%s:%hu:%s\n", protocol, eport, iaddr, iport, desc);
 	}
-	fclose(fdt);
-	fclose(fd);
-	
-	if (rename( tmpfilename, lease_file) < 0) {
+
+	if (fclose(fdt) != 0 || rename( tmpfilename, lease_file) < 0) {
 		syslog(LOG_ERR, "could not rename temporary lease file to %s", lease_file);
 		remove( tmpfilename);
+		return -1;
 	}
-	
+
+	lease_records = n;
 	return 0;
-	
 }
 
+/* lease_file_write()
+ * append a record to the journal, compacting it when it grew too long */
+static int lease_file_write(const char * format, ...)
+{
+	va_list args;
+
+	if (lease_file == NULL || lease_replaying) return 0;
+
+	if (lease_fd == NULL) {
+		lease_fd = fopen( lease_file, "a");
+		if (lease_fd==NULL) {
+			syslog(LOG_ERR, "could not open lease file: %s", lease_file);
+			return -1;
+		}
+	}
+
+	va_start(args, format);
+	vfprintf( lease_fd, format, args);
+	va_end(args);
+	/* a record must be in the file before the next one is made */
+	if (fflush(lease_fd) != 0) {
+		syslog(LOG_ERR, "could not write lease file: %s", lease_file);
+		fclose(lease_fd);
+		lease_fd = NULL;
+		return -1;
+	}
+
+	if (++lease_records >= 2 * upnp_get_portmapping_number_of_entries() + LEASE_JOURNAL_SLACK)
+		lease_file_compact();
+	return 0;
+}
+
+static int lease_file_add( unsigned short eport, const char * iaddr, unsigned short iport, int proto, const char * desc)
+{
+	return lease_file_write( "%s:%hu:%s:%hu:%s\n",
+	                         ((proto==IPPROTO_TCP)?"TCP":"UDP"), eport, iaddr, iport, desc);
+}
+
+static int lease_file_remove( unsigned short eport, int proto)
+{
+	return lease_file_write( "-%s:%hu\n", ((proto==IPPROTO_TCP)?"TCP":"UDP"), eport);
+}
+
+/* a mapping being replayed from the lease file */
+struct lease_entry {
+	struct lease_entry * next;
+	unsigned short eport;
+	unsigned short iport;
+	char proto[4];
+	char * iaddr;
+	char desc[];
+};
+
 /* reload_from_lease_file()
- * read lease_file and add the rules contained
- */
+ * replay the journal in lease_file, add the rules it leaves
+ * and compact it */
 int reload_from_lease_file()
 {
 	FILE * fd;
@@ -142,7 +183,12 @@ int reload_from_lease_file()
 	char * iaddr;
 	char * desc;
 	char line[128];
+	size_t len;
+	int deleted;
 	int r;
+	struct lease_entry * list = NULL;
+	struct lease_entry * e;
+	struct lease_entry ** pe;
 
 	if(!lease_file) return -1;
 	fd = fopen( lease_file, "r");
@@ -150,26 +196,47 @@ int reload_from_lease_file()
 		syslog(LOG_ERR, "could not open lease file: %s", lease_file);
 		return -1;
 	}
-	if(unlink(lease_file) < 0) {
-		syslog(LOG_WARNING, "could not unlink file %s : %m", lease_file);
-	}
 
 	while(fgets(line, sizeof(line), fd)) {
+		len = strlen(line);
+		if(len == 0 || line[len-1] != '\n') {
+			if(feof(fd)) {
+				/* we died while writing the last record */
+				syslog(LOG_WARNING, "ignoring truncated record at the end of %s", lease_file);
+				break;
+			}
+			/* too long to be one of ours, skip it */
+			while(fgets(line, sizeof(line), fd) && line[strlen(line)-1] != '\n');
+			syslog(LOG_ERR, "unrecognized data in lease file");
+			continue;
+		}
 		syslog(LOG_DEBUG, "parsing lease file line '%s'", line);
-		proto = line;
-		p = strchr(line, ':');
+		deleted = (line[0] == '-');
+		proto = line + deleted;
+		p = strchr(proto, ':');
 		if(!p) {
 			syslog(LOG_ERR, "unrecognized data in lease file");
 			continue;
 		}
 		*(p++) = '\0';
+		eport = (unsigned short)atoi(p);
+		/* the last record for a port wins */
+		for(pe = &list; *pe; pe = &(*pe)->next) {
+			if((*pe)->eport == eport && strcmp((*pe)->proto, proto) == 0) {
+				e = *pe;
+				*pe = e->next;
+				free(e);
+				break;
+			}
+		}
+		if(deleted)
+			continue;
 		iaddr = strchr(p, ':');
 		if(!iaddr) {
 			syslog(LOG_ERR, "unrecognized data in lease file");
 			continue;
 		}
 		*(iaddr++) = '\0';
-		eport = (unsigned short)atoi(p);
 		p = strchr(iaddr, ':');
 		if(!p) {
 			syslog(LOG_ERR, "unrecognized data in lease file");
@@ -187,23 +254,49 @@ int reload_from_lease_file()
 		while(isspace(*desc))
 			desc++;
 		p = desc;
-		while(*(p+1))
+		while(*p && *(p+1))
 			p++;
 		while(isspace(*p) && (p > desc))
 			*(p--) = '\0';
 
-		r = upnp_redirect(eport, iaddr, iport, proto, desc);
+		if(strlen(proto) >= sizeof(e->proto))
+			continue;
+		e = malloc(sizeof(struct lease_entry) + strlen(desc) + 1 + strlen(iaddr) + 1);
+		if(!e)
+			break;
+		e->eport = eport;
+		e->iport = iport;
+		strcpy(e->proto, proto);
+		strcpy(e->desc, desc);
+		e->iaddr = e->desc + strlen(desc) + 1;
+		strcpy(e->iaddr, iaddr);
+		for(pe = &list; *pe; pe = &(*pe)->next);
+		e->next = NULL;
+		*pe = e;
+	}
+	fclose(fd);
+
+	/* the file is rewritten once all the rules are back */
+	lease_replaying = 1;
+#if defined(USE_NETFILTER)
+	begin_redirect_batch();
+#endif
+	while(list) {
+		e = list;
+		list = e->next;
+		r = upnp_redirect(e->eport, e->iaddr, e->iport, e->proto, e->desc);
 		if(r == -1) {
 			syslog(LOG_ERR, "Failed to redirect %hu -> %s:%hu protocol %s",
-			       eport, iaddr, iport, proto);
-		} else if(r == -2) {
-			/* Add the redirection again to the lease file */
-			lease_file_add(eport, iaddr, iport, proto_atoi(proto), desc);
+			       e->eport, e->iaddr, e->iport, e->proto);
 		}
+		free(e);
 	}
-	fclose(fd);
-	
-	return 0;
+#if defined(USE_NETFILTER)
+	commit_redirect_batch();
+#endif
+	lease_replaying = 0;
+
+	return lease_file_compact();
 }
 #endif
 
@@ -359,6 +452,9 @@ upnp_delete_redirection(unsigned short eport, const char * protocol)
 int
 upnp_get_portmapping_number_of_entries()
 {
+#if defined(USE_NETFILTER)
+	return get_redirect_rule_count();
+#else
 	int n = 0, r = 0;
 	unsigned short eport, iport;
 	char protocol[4], iaddr[32], desc[64];
@@ -370,6 +466,7 @@ upnp_get_portmapping_number_of_entries()
 		n++;
 	} while(r==0);
 	return (n-1);
+#endif
 }
 
 /* functions used to remove unused rules */
@@ -421,6 +518,9 @@ remove_unused_rules(struct rule_state * list)
 	u_int64_t packets;
 	u_int64_t bytes;
 	int n = 0;
+#if defined(USE_NETFILTER)
+	begin_redirect_batch();
+#endif
 	while(list)
 	{
 		/* remove the rule if no traffic has used it */
@@ -437,6 +537,9 @@ remove_unused_rules(struct rule_state * list)
 		list = tmp->next;
 		free(tmp);
 	}
+#if defined(USE_NETFILTER)
+	commit_redirect_batch();
+#endif
 	if(n>0)
 		syslog(LOG_NOTICE, "removed %d unused rules", n);
 }
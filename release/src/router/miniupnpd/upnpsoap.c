@@ -52,7 +52,7 @@ BuildSendAndCloseSoapResp(struct upnphttp * h,
 	h->res_buflen += sizeof(afterbody) - 1;
 
 	SendResp_upnphttp(h);
-	CloseSocket_upnphttp(h);
+	Done_upnphttp(h);
 }
 
 static void
@@ -816,6 +816,6 @@ SoapError(struct upnphttp * h, int errCode, const char * errDesc)
 	bodylen = snprintf(body, sizeof(body), resp, errCode, errDesc);
 	BuildResp2_upnphttp(h, 500, "Internal Server Error", body, bodylen);
 	SendResp_upnphttp(h);
-	CloseSocket_upnphttp(h);
+	Done_upnphttp(h);
 }
 
@@ -14,6 +14,7 @@
 #include <unistd.h>
 #include <syslog.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <stdarg.h>
 #include <errno.h>
@@ -30,16 +31,25 @@
 //	#define _dprintf	cprintf
 
 
-typedef struct {
+typedef struct mssl_cookie {
 	ssl_t *ssl;
 	sslBuf_t inbuf;		// buffer for decoded data
 	sslBuf_t insock;	// buffer for recv() data
 	sslBuf_t outsock;	// buffer for send() data
+	unsigned char *pt_start;	// decoded data not yet returned
+	unsigned char *pt_end;
 	int sslend;
+	int ready;
 	int sd;
+	FILE *f;
+	struct mssl_cookie *next;
 } mssl_cookie_t;
 
+// not exported by matrixSsl.h
+#define SSL_RECORD_TYPE_APPLICATION_DATA	23
+
 static sslKeys_t *keys;
+static mssl_cookie_t *cookies;
 
 
 
@@ -108,41 +118,36 @@ static void sb_pack(sslBuf_t *b)
 	}
 }
 
-static int sb_read(sslBuf_t *b, unsigned char *buf, int len)
-{
-	int n;
-	n = min(sb_used(b), len);
-	memcpy(buf, b->start, n);
-	b->start += n;
-	if (b->start == b->end) b->start = b->end = b->buf;
-	return n;
-}
-
 
 // -----------------------------------------------------------------------------
 
 
+//	Application data records are decrypted in place in insock, and read
+//	straight from there. inbuf is only used for handshake records and
+//	for anything that needs a response written.
 static ssize_t mssl_read(void *cookie, char *buf, size_t len)
 {
 	mssl_cookie_t *kuki = cookie;
+	sslBuf_t rec, *out;
 	int r;
 	unsigned char err, alevel, adesc;
+	unsigned char *p;
 
 
 	_dprintf("%s\n", __FUNCTION__);
 
-	if (kuki->inbuf.buf) {
-		if (kuki->inbuf.start < kuki->inbuf.end) {
-			r = sb_read(&kuki->inbuf, buf, len);
-			_dprintf("sb_read r=%d\n", r);
-			return r;
-		}
-		sb_free(&kuki->inbuf);
+	if (kuki->pt_start < kuki->pt_end) {
+COPY:
+		r = min(kuki->pt_end - kuki->pt_start, len);
+		memcpy(buf, kuki->pt_start, r);
+		kuki->pt_start += r;
+		_dprintf("copy r=%d\n", r);
+		return r;
 	}
 
-	sb_pack(&kuki->insock);
-
+MORE:
 	if (kuki->insock.start == kuki->insock.end) {
+		kuki->insock.start = kuki->insock.end = kuki->insock.buf;
 READ:
 	_dprintf("READ\n");
 
@@ -159,8 +164,6 @@ READ:
 		kuki->insock.end += r;
 	}
 
-	sb_alloc(&kuki->inbuf, len);
-
 DECODE:
 	_dprintf("DECODE\n");
 
@@ -168,38 +171,49 @@ DECODE:
 	alevel = 0;
 	adesc = 0;
 
-	switch (matrixSslDecode(kuki->ssl, &kuki->insock, &kuki->inbuf, &err, &alevel, &adesc)) {
+	p = kuki->insock.start;
+	if ((kuki->ready) && (sb_used(&kuki->insock) >= 5) && (p[0] == SSL_RECORD_TYPE_APPLICATION_DATA)) {
+		rec.buf = rec.start = rec.end = p + 5;
+		rec.size = (p[3] << 8) | p[4];
+		out = &rec;
+	}
+	else {
+DECODE_INBUF:
+		kuki->inbuf.start = kuki->inbuf.end = kuki->inbuf.buf;
+		out = &kuki->inbuf;
+	}
+
+	switch (matrixSslDecode(kuki->ssl, &kuki->insock, out, &err, &alevel, &adesc)) {
 	case SSL_SUCCESS:
 		_dprintf("SSL_SUCCESS\n");
+		if (kuki->ready) goto MORE;
 		return 0;
 	case SSL_PROCESS_DATA:
 		_dprintf("SSL_PROCESS_DATA\n");
 
-		r = sb_used(&kuki->inbuf);
-		_dprintf(" r = %d len = %d\n", r, len);
-		r = min(r, len);
-		memcpy(buf, kuki->inbuf.start, r);
-		kuki->inbuf.start += r;
-		return r;
+		kuki->pt_start = out->start;
+		kuki->pt_end = out->end;
+		_dprintf(" r = %d len = %d\n", out->end - out->start, len);
+		goto COPY;
 	case SSL_SEND_RESPONSE:
 		_dprintf("SSL_SEND_RESPONSE\n");
-		_dprintf("send %d\n", sb_used(&kuki->inbuf));
+		_dprintf("send %d\n", sb_used(out));
 
-		while ((r = send(kuki->sd, kuki->inbuf.start, sb_used(&kuki->inbuf), MSG_NOSIGNAL)) == -1) {
-			if (errno != EINTR) {
+		while (out->start < out->end) {
+			if ((r = send(kuki->sd, out->start, sb_used(out), MSG_NOSIGNAL)) == -1) {
+				if (errno == EINTR) continue;
 				_dprintf("send error\n");
 				return -1;
 			}
+			out->start += r;
 		}
-		kuki->inbuf.start += r;
-		if (kuki->inbuf.start != kuki->inbuf.end) _dprintf("inbuf.start != inbuf.end\n");
-		kuki->inbuf.start = kuki->inbuf.end = kuki->inbuf.buf;
+		if (kuki->ready) goto MORE;
 		return 0;
 	case SSL_ERROR:
 		_dprintf("ssl error %d\n", err);
 
-		if (kuki->inbuf.start < kuki->inbuf.end) {
-			send(kuki->sd, kuki->inbuf.start, sb_used(&kuki->inbuf), MSG_NOSIGNAL);
+		if (out->start < out->end) {
+			send(kuki->sd, out->start, sb_used(out), MSG_NOSIGNAL);
 		}
 		errno = EIO;
 		return -1;
@@ -217,20 +231,20 @@ DECODE:
 	case SSL_PARTIAL:
 		_dprintf("SSL_PARTIAL insock.size=%d %d\n", kuki->insock.size, SSL_MAX_BUF_SIZE);
 
-		if ((kuki->insock.start == kuki->insock.buf) && (kuki->insock.end == (kuki->insock.buf + kuki->insock.size))) {
-			if (kuki->insock.size > SSL_MAX_BUF_SIZE) return -1;
-			sb_realloc(&kuki->insock, kuki->insock.size * 2);
-		}
-
-		if (kuki->inbuf.start != kuki->inbuf.end) {
-			_dprintf("!! inbuf.start != inbuf.end\n");
+		if (sb_unused(&kuki->insock) == 0) {
+			if (kuki->insock.start == kuki->insock.buf) {
+				if (kuki->insock.size > SSL_MAX_BUF_SIZE) return -1;
+				sb_realloc(&kuki->insock, kuki->insock.size * 2);
+			}
+			else {
+				sb_pack(&kuki->insock);
+			}
 		}
-
-		sb_free(&kuki->inbuf);
 		goto READ;
 	case SSL_FULL:
 		_dprintf("SSL_FULL\n");
 
+		if (out == &rec) goto DECODE_INBUF;
 		sb_alloc(&kuki->inbuf, kuki->inbuf.size * 2);
 		goto DECODE;
 	}
@@ -238,47 +252,49 @@ DECODE:
 	return 0;
 }
 
-static ssize_t mssl_write(void *cookie, const char *buf, size_t len)
+//	Sends everything queued in outsock.
+static int mssl_pump(mssl_cookie_t *kuki)
 {
-	mssl_cookie_t *kuki = cookie;
 	int r;
 	int nw;
 
-	_dprintf("%s\n", __FUNCTION__);
-
 	nw = 0;
-	sb_pack(&kuki->outsock);
-	if (buf == NULL) goto PUMP;
-
-RETRY:
-	switch (matrixSslEncode(kuki->ssl, (unsigned char *)buf, len, &kuki->outsock)) {
-	case SSL_ERROR:
-		errno = EIO;
-		_dprintf("SSL_ERROR\n");
-		return -1;
-	case SSL_FULL:
-		if (kuki->outsock.size > SSL_MAX_BUF_SIZE) {
-			errno = EFBIG;
-			_dprintf("outsock.size > max\n");
+	while (kuki->outsock.start < kuki->outsock.end) {
+		if ((r = send(kuki->sd, kuki->outsock.start, sb_used(&kuki->outsock), MSG_NOSIGNAL)) == -1) {
+			if (errno == EINTR) continue;
+			_dprintf("send error %d\n", errno);
 			return -1;
 		}
-		sb_realloc(&kuki->outsock, kuki->outsock.size * 2);
-		goto RETRY;
+		kuki->outsock.start += r;
+		nw += r;
 	}
+	kuki->outsock.start = kuki->outsock.end = kuki->outsock.buf;
+	return nw;
+}
 
-PUMP:
-	while ((r = send(kuki->sd, kuki->outsock.start, sb_used(&kuki->outsock), MSG_NOSIGNAL)) == -1) {
-		if (errno != EINTR) {
-			_dprintf("send error %d\n", errno);
+//	Encodes and sends buf as full size records.
+static ssize_t mssl_write(void *cookie, const char *buf, size_t len)
+{
+	mssl_cookie_t *kuki = cookie;
+	size_t nw;
+	int n;
+
+	_dprintf("%s\n", __FUNCTION__);
+
+	if (buf == NULL) return mssl_pump(kuki);
+
+	if (kuki->outsock.size < SSL_MAX_BUF_SIZE) sb_realloc(&kuki->outsock, SSL_MAX_BUF_SIZE);
+
+	nw = 0;
+	while (nw < len) {
+		n = min(len - nw, SSL_MAX_PLAINTEXT_LEN);
+		if (matrixSslEncode(kuki->ssl, (unsigned char *)buf + nw, n, &kuki->outsock) < 0) {
+			errno = EIO;
+			_dprintf("SSL_ERROR\n");
 			return -1;
 		}
-	}
-	kuki->outsock.start += r;
-	nw += r;
-
-	if (kuki->outsock.start < kuki->outsock.end) {
-		_dprintf("start < end\n");
-		goto PUMP;
+		if (mssl_pump(kuki) < 0) return -1;
+		nw += n;
 	}
 
 	return nw;
@@ -294,11 +310,19 @@ static int mssl_seek(void *cookie, __offmax_t *pos, int whence)
 static int mssl_close(void *cookie)
 {
 	mssl_cookie_t *kuki = cookie;
+	mssl_cookie_t **pp;
 
 	_dprintf("%s()\n", __FUNCTION__);
 
 	if (!kuki) return 0;
 
+	for (pp = &cookies; *pp; pp = &(*pp)->next) {
+		if (*pp == kuki) {
+			*pp = kuki->next;
+			break;
+		}
+	}
+
 	if (kuki->ssl) {
 		if (kuki->outsock.buf) {
 			mssl_write(kuki, NULL, 0);
@@ -352,6 +376,7 @@ static FILE *_ssl_fopen(int sd, int client)
 	}
 
 	sb_alloc(&kuki->insock, 1024);
+	sb_alloc(&kuki->inbuf, 1024);
 	sb_alloc(&kuki->outsock, 2048);
 
 	if (client) {
@@ -384,6 +409,12 @@ MORE:
 			_dprintf("%s: fopencookie failed\n", __FUNCTION__);
 			goto ERROR;
 		}
+		// let stdio collect small writes into full size records
+		setvbuf(f, NULL, _IOFBF, SSL_MAX_PLAINTEXT_LEN);
+		kuki->ready = 1;
+		kuki->f = f;
+		kuki->next = cookies;
+		cookies = kuki;
 		return f;
 	}
 
@@ -407,6 +438,36 @@ FILE *ssl_client_fopen(int sd)
 	return _ssl_fopen(sd, 1);
 }
 
+//	Writes the buffered data in f, then each of iov. Large pieces are
+//	encrypted straight from the caller's memory instead of going through
+//	the stdio buffer.
+int ssl_writev(FILE *f, const struct iovec *iov, int iovcnt)
+{
+	mssl_cookie_t *kuki;
+	int i;
+	int n;
+
+	for (kuki = cookies; kuki; kuki = kuki->next) {
+		if (kuki->f == f) break;
+	}
+	if (!kuki) {
+		errno = EBADF;
+		return -1;
+	}
+
+	n = 0;
+	for (i = 0; i < iovcnt; ++i) {
+		if (iov[i].iov_len >= SSL_MAX_PLAINTEXT_LEN / 4) {
+			if ((fflush(f) != 0) || (mssl_write(kuki, iov[i].iov_base, iov[i].iov_len) < 0)) return -1;
+		}
+		else if (fwrite(iov[i].iov_base, 1, iov[i].iov_len, f) != iov[i].iov_len) {
+			return -1;
+		}
+		n += iov[i].iov_len;
+	}
+	return n;
+}
+
 int ssl_init(char *cert, char *priv)
 {
 	if (matrixSslOpen() < 0) {
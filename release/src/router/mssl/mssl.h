@@ -9,8 +9,11 @@
 #ifndef __MSSL_H__
 #define __MSSL_H__
 
+#include <sys/uio.h>
+
 extern FILE *ssl_server_fopen(int sd);
 extern FILE *ssl_client_fopen(int sd);
+extern int ssl_writev(FILE *f, const struct iovec *iov, int iovcnt);
 extern int ssl_init(char *cert, char *priv);
 
 #endif
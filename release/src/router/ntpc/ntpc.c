@@ -16,6 +16,7 @@
 #include <time.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <sys/timex.h>
 #include <signal.h>
 #include <syslog.h>
 
@@ -29,7 +30,10 @@
 
 
 #define I_MISC		0
+#define I_ROOTDELAY	1
+#define I_ROOTDISP	2
 #define I_ORTIME	6
+#define I_RXTIME	8
 #define	I_TXTIME	10
 
 #define TIMEFIX		2208988800UL
@@ -42,122 +46,264 @@ static void add_word(char *buffer, const char *word, int max)
 	strlcat(buffer, word, max);
 }
 
-// 0 = ok, 1 = failed, 2 = permanent failure
-static int ntpc(struct in_addr addr)
+typedef struct {
+	const char *name;
+	struct in_addr addr;
+	unsigned short port;
+	uint32_t txs, txf;		// our transmit time, echoed back as the originate time
+	int state;
+	long long offset;		// all in microseconds
+	long long delay;
+	long long dist;
+} ntp_server_t;
+
+enum { NS_WAIT, NS_OK, NS_KISS, NS_BAD };
+
+// slew anything smaller, step anything bigger: as ntpd does, 128ms, which adjtime()
+// at 500ppm takes about 4 minutes to slew away
+#define STEP_LIMIT	128000LL
+#define FREQ_MAX	(500L << 16)	// 500ppm
+
+
+static long long ntp_to_us(uint32_t s, uint32_t f)
+{
+	return ((long long)(s - TIMEFIX) * 1000000LL) + (((unsigned long long)f * 1000000ULL) >> 32);
+}
+
+static long long tv_to_us(const struct timeval *tv)
+{
+	return ((long long)tv->tv_sec * 1000000LL) + tv->tv_usec;
+}
+
+static long long fixed_to_us(uint32_t u)
+{
+	return ((long long)u * 1000000LL) >> 16;
+}
+
+static void ntp_reply(ntp_server_t *sv, const uint32_t *packet, const struct timeval *rxtime)
+{
+	uint32_t u;
+	long long t1, t2, t3, t4;
+
+	u = ntohl(packet[0]);
+
+	_dprintf("u = 0x%08x\n", u);
+	_dprintf("LI = %u\n", u >> 30);
+	_dprintf("VN = %u\n", (u >> 27) & 0x07);
+	_dprintf("mode = %u\n", (u >> 24) & 0x07);
+	_dprintf("stratum = %u\n", (u >> 16) & 0xFF);
+	_dprintf("poll interval = %u\n", (u >> 8) & 0xFF);
+	_dprintf("precision = %u\n", u & 0xFF);
+
+	if (((u & 0x07000000) != 0x04000000) || ((u >> 30) == 3)) {	// mode != 4 (server) or not synchronized
+		printf("%s: Invalid response\n", sv->name);
+		sv->state = NS_BAD;
+		return;
+	}
+
+	// notes:
+	//	- Windows' ntpd returns vn=3, stratum=0
+
+	if ((u & 0x00FF0000) == 0) {			// stratum == 0
+		printf("%s: Received stratum=0\n", sv->name);
+		if (!nvram_match("ntp_kiss_ignore", "1")) {
+			sv->state = NS_KISS;
+			return;
+		}
+	}
+
+	t1 = ntp_to_us(sv->txs, sv->txf);
+	t2 = ntp_to_us(ntohl(packet[I_RXTIME]), ntohl(packet[I_RXTIME + 1]));
+	t3 = ntp_to_us(ntohl(packet[I_TXTIME]), ntohl(packet[I_TXTIME + 1]));
+	t4 = tv_to_us(rxtime);
+
+	sv->offset = ((t2 - t1) + (t3 - t4)) / 2;
+	sv->delay = (t4 - t1) - (t3 - t2);
+	if (sv->delay < 0) sv->delay = 0;
+	// how far off we could be, counting the server's own distance to its reference
+	sv->dist = (sv->delay + fixed_to_us(ntohl(packet[I_ROOTDELAY]))) / 2 + fixed_to_us(ntohl(packet[I_ROOTDISP]));
+	sv->state = NS_OK;
+
+	_dprintf("offset = %lld\n", sv->offset);
+	_dprintf("delay  = %lld\n", sv->delay);
+	_dprintf("dist   = %lld\n", sv->dist);
+}
+
+// asks all of them at once, returns the best answer or -1
+static int ntp_query(ntp_server_t *servers, int count)
 {
 	uint32_t packet[12];
 	struct timeval txtime;
 	struct timeval rxtime;
 	struct timeval tv;
-	uint32_t u;
-	uint32_t txn;
+	struct sockaddr_in sa;
+	socklen_t salen;
+	long long end;
+	long long t;
+	ntp_server_t *sv;
 	int fd;
-	fd_set fds;
+	int i;
+	int n;
 	int len;
-	struct sockaddr_in sa;
-	char s[64], q[128];
-	time_t t;
-	time_t ntpt;
-	time_t diff;
-
-	memset(&sa, 0, sizeof(sa));
-	sa.sin_addr = addr;
-	sa.sin_port = htons(123);
-	sa.sin_family = AF_INET;
+	int best;
+	fd_set fds;
 
 	if ((fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
 		printf("Unable to create a socket\n");
-		return 1;
+		return -1;
 	}
 
-	if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) == -1) {
-		printf("Unable to connect\n");
-	}
-	else {
+	n = 0;
+	for (i = 0; i < count; ++i) {
+		sv = &servers[i];
+
+		memset(&sa, 0, sizeof(sa));
+		sa.sin_addr = sv->addr;
+		sa.sin_port = htons(sv->port);
+		sa.sin_family = AF_INET;
+
 		memset(&packet, 0, sizeof(packet));
 		packet[I_MISC] = htonl((4 << 27) | (3 << 24));	// VN=v4 | mode=3 (client)
 //		packet[I_MISC] = htonl((3 << 27) | (3 << 24));	// VN=v3 | mode=3 (client)
 		gettimeofday(&txtime, NULL);
-		packet[I_TXTIME] = txn = htonl(txtime.tv_sec + TIMEFIX);
-		send(fd, packet, sizeof(packet), 0);
+		sv->txs = txtime.tv_sec + TIMEFIX;
+		sv->txf = (uint32_t)(((unsigned long long)txtime.tv_usec << 32) / 1000000ULL);
+		packet[I_TXTIME] = htonl(sv->txs);
+		packet[I_TXTIME + 1] = htonl(sv->txf);
+		if (sendto(fd, packet, sizeof(packet), 0, (struct sockaddr *)&sa, sizeof(sa)) == sizeof(packet)) {
+			sv->state = NS_WAIT;
+			++n;
+		}
+		else {
+			printf("%s: Unable to send\n", sv->name);
+			sv->state = NS_BAD;
+		}
+	}
+
+	gettimeofday(&tv, NULL);
+	end = tv_to_us(&tv) + 3000000LL;	// no more than 3 seconds
+	while (n > 0) {
+		gettimeofday(&tv, NULL);
+		if ((t = end - tv_to_us(&tv)) <= 0) break;
+		tv.tv_sec = t / 1000000;
+		tv.tv_usec = t % 1000000;
 
 		FD_ZERO(&fds);
 		FD_SET(fd, &fds);
-		tv.tv_sec = 3;	// no more than 3 seconds
-		tv.tv_usec = 0;
-		if (select(fd + 1, &fds, NULL, NULL, &tv) != 1) {
-			printf("Timeout\n");
+		if (select(fd + 1, &fds, NULL, NULL, &tv) != 1) break;
+
+		salen = sizeof(sa);
+		len = recvfrom(fd, packet, sizeof(packet), 0, (struct sockaddr *)&sa, &salen);
+		gettimeofday(&rxtime, NULL);
+		if (len != sizeof(packet)) {
+			printf("Invalid packet size\n");
+			continue;
 		}
-		else {
-			len = recv(fd, packet, sizeof(packet), 0);
-			if (len != sizeof(packet)) {
-				printf("Invalid packet size\n");
-			}
-			else {
-				gettimeofday(&rxtime, NULL);
-
-				u = ntohl(packet[0]);
 
-				_dprintf("u = 0x%08x\n", u);
-				_dprintf("LI = %u\n", u >> 30);
-				_dprintf("VN = %u\n", (u >> 27) & 0x07);
-				_dprintf("mode = %u\n", (u >> 24) & 0x07);
-				_dprintf("stratum = %u\n", (u >> 16) & 0xFF);
-				_dprintf("poll interval = %u\n", (u >> 8) & 0xFF);
-				_dprintf("precision = %u\n", u & 0xFF);
+		for (i = 0; i < count; ++i) {
+			sv = &servers[i];
+			if ((sv->state == NS_WAIT) && (sv->addr.s_addr == sa.sin_addr.s_addr) && (sv->port == ntohs(sa.sin_port)) &&
+				(ntohl(packet[I_ORTIME]) == sv->txs) && (ntohl(packet[I_ORTIME + 1]) == sv->txf)) {
+				ntp_reply(sv, packet, &rxtime);
+				--n;
+				break;
+			}
+		}
+	}
+	close(fd);
 
-				if ((u & 0x07000000) != 0x04000000) {	// mode != 4 (server)
-					printf("Invalid response\n");
-				}
-				else {
-					close(fd);
+	best = -1;
+	for (i = 0; i < count; ++i) {
+		sv = &servers[i];
+		if (sv->state == NS_WAIT) {
+			printf("%s: Timeout\n", sv->name);
+			sv->state = NS_BAD;
+		}
+		else if (sv->state == NS_OK) {
+			t = (sv->offset < 0) ? -sv->offset : sv->offset;
+			printf("%s: offset %c%lld.%06llds, delay %lld.%06llds\n", sv->name,
+				(sv->offset < 0) ? '-' : '+', t / 1000000, t % 1000000,
+				sv->delay / 1000000, sv->delay % 1000000);
+			if ((best < 0) || (sv->dist < servers[best].dist)) best = i;
+		}
+	}
+	return best;
+}
 
-					// notes:
-					//	- Windows' ntpd returns vn=3, stratum=0
+static void ntp_adjust(long long offset)
+{
+	struct timeval tv;
+	struct timex tx;
+	char s[64], q[128];
+	long up, last;
+	long long us;
+	time_t t;
 
-					if ((u & 0x00FF0000) == 0) {			// stratum == 0
-						printf("Received stratum=0\n");
-						if (!nvram_match("ntp_kiss_ignore", "1")) {
-							return 2;
-						}
-					}
+	up = get_uptime();
+	last = nvram_get_int("ntp_synced");
+	sprintf(s, "%ld", up);
+	nvram_set("ntp_synced", s);
 
-					ntpt = ntohl(packet[I_TXTIME]) - TIMEFIX;
-					t = (rxtime.tv_sec - txtime.tv_sec) >> 1;
-					diff = (ntpt - rxtime.tv_sec) + t;
+	if ((time(0) < Y2K) || (offset >= STEP_LIMIT) || (offset <= -STEP_LIMIT)) {
+		// never set or way off, jump there
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+		adjtime(&tv, NULL);
 
-					_dprintf("txtime = %ld\n", txtime.tv_sec);
-					_dprintf("rxtime = %ld\n", rxtime.tv_sec);
-					_dprintf("ntpt   = %ld\n", ntpt);
-					_dprintf("rtt/2  = %ld\n", t);
-					_dprintf("diff   = %ld\n", diff);
+		gettimeofday(&tv, NULL);
+		us = tv_to_us(&tv) + offset;
+		tv.tv_sec = us / 1000000;
+		tv.tv_usec = us % 1000000;
+		settimeofday(&tv, NULL);
 
-					if (diff != 0) {
-						gettimeofday(&tv, NULL);
-						tv.tv_sec  += diff;
-//						tv.tv_usec = 0;// sorry, I'm not a time geek :P
-						settimeofday(&tv, NULL);
+		_dprintf("new    = %lu\n", tv.tv_sec);
 
-						_dprintf("new    = %lu\n", tv.tv_sec);
+		strftime(s, sizeof(s), "%a, %d %b %Y %H:%M:%S %z", localtime(&tv.tv_sec));
+		sprintf(q, "Time Updated: %s [%s%llds]", s, offset > 0 ? "+" : "", offset / 1000000);
+		printf("\n\n%s\n", q);
+		syslog(LOG_INFO, q);
+		return;
+	}
 
-						strftime(s, sizeof(s), "%a, %d %b %Y %H:%M:%S %z", localtime(&tv.tv_sec));
-						sprintf(q, "Time Updated: %s [%s%lds]", s, diff > 0 ? "+" : "", diff);
-						printf("\n\n%s\n", q);
-						syslog(LOG_INFO, q);
-					}
-					else {
-						t = time(0);
-						strftime(s, sizeof(s), "%a, %d %b %Y %H:%M:%S %z", localtime(&t));
-						printf("\n\n%s\nNo change was needed.\n", s);
-					}
-					return 0;
-				}
-			}
+	// close enough, slew so that nothing sees time jump
+	tv.tv_sec = offset / 1000000;
+	tv.tv_usec = offset % 1000000;
+	if (tv.tv_usec < 0) {
+		tv.tv_usec += 1000000;
+		--tv.tv_sec;
+	}
+	adjtime(&tv, NULL);
+
+	// what is left after the last sync is drift, take half of it out of the frequency.
+	// adjtime() slews at 500ppm, so anything over half that is an unfinished slew or noise.
+	if ((last > 0) && (up - last >= 900) && (offset < (up - last) * 250LL) && (offset > (up - last) * -250LL)) {
+		memset(&tx, 0, sizeof(tx));
+		if (adjtimex(&tx) != -1) {
+			tx.freq += (long)((offset << 16) / (up - last) / 2);
+			if (tx.freq > FREQ_MAX) tx.freq = FREQ_MAX;
+				else if (tx.freq < -FREQ_MAX) tx.freq = -FREQ_MAX;
+			tx.modes = ADJ_FREQUENCY;
+			adjtimex(&tx);
+			_dprintf("freq   = %ld\n", tx.freq);
 		}
 	}
 
-	close(fd);
-	return 1;
+	t = time(0);
+	strftime(s, sizeof(s), "%a, %d %b %Y %H:%M:%S %z", localtime(&t));
+	printf("\n\n%s\nAdjusting by %lldms.\n", s, offset / 1000);
+}
+
+static void add_kiss(const char *ip)
+{
+	char s[512];
+	char *nvkiss;
+
+	nvkiss = nvram_safe_get("ntp_kiss");
+	while ((nvkiss) && (strlen(nvkiss) > 128)) nvkiss = strchr(nvkiss + 1, ' ');
+	if (nvkiss) strlcpy(s, nvkiss, sizeof(s));
+		else s[0] = 0;
+	add_word(s, ip, sizeof(s));
+	nvram_set("ntp_kiss", s);
 }
 
 
@@ -167,17 +313,22 @@ static int ntpc(struct in_addr addr)
 static int ntpc_main(int argc, char **argv)
 {
 	struct hostent *he;
-	struct in_addr ia;
-	const char *s;
+	ntp_server_t servers[10];
+	char *p;
+	int count;
 	int i;
 
-	for (i = 1; i < argc; ++i) {
+	count = 0;
+	for (i = 1; (i < argc) && (count < 10); ++i) {
+		// host:port, to try against a local test server
+		servers[count].port = 123;
+		if ((p = strchr(argv[i], ':')) != NULL) {
+			*p++ = 0;
+			servers[count].port = atoi(p);
+		}
 		if ((he = gethostbyname(argv[i])) != NULL) {
-			memcpy(&ia, he->h_addr_list[0], sizeof(ia));
-			s = inet_ntoa(ia);
-			if (strcmp(s, argv[i]) == 0) printf("Trying %s: ", s);
-				else printf("Trying %s [%s]:", argv[i], s);
-			if (ntpc(ia) == 0) return 0;
+			memcpy(&servers[count].addr, he->h_addr_list[0], sizeof(servers[count].addr));
+			servers[count++].name = argv[i];
 		}
 		else {
 			printf("Unable to resolve: %s\n", argv[i]);
@@ -185,9 +336,15 @@ static int ntpc_main(int argc, char **argv)
 	}
 
 	if (argc < 2) {
-		printf("Usage: ntpc <server>\n");
+		printf("Usage: ntpc <server>[:<port>] [<server>[:<port>] ...]\n");
+		return 1;
 	}
 
+	if ((count > 0) && ((i = ntp_query(servers, count)) >= 0)) {
+		printf("Using %s [%s]\n", servers[i].name, inet_ntoa(servers[i].addr));
+		ntp_adjust(servers[i].offset);
+		return 0;
+	}
 	return 1;
 }
 
@@ -202,9 +359,9 @@ static int ntpsync_main(int argc, char **argv)
 	char *ips;
 	char *nvkiss;
 	int count;
-	int i;
+	int i, j, n;
 	struct hostent *he;
-	struct in_addr ia;
+	ntp_server_t sv[10];
 	int retries;
 	int nu;
 	char s[512];
@@ -260,56 +417,58 @@ static int ntpsync_main(int argc, char **argv)
 		}
 		if (count == 0) addr[count++] = "pool.ntp.org";
 
-		while (count > 0) {
-			i = (rand() % count);
-			_dprintf("[ntpsync] i=%d addr=%s\n", i, addr[i]);
+		n = 0;
+		nvkiss = nvram_safe_get("ntp_kiss");
+		for (i = 0; i < count; ++i) {
+			if ((he = gethostbyname(addr[i])) == NULL) continue;
+			memcpy(&sv[n].addr, he->h_addr_list[0], sizeof(sv[n].addr));
+			sv[n].port = 123;
+			ips = inet_ntoa(sv[n].addr);
+			_dprintf("[ntpsync] addr=%s ip=%s\n", addr[i], ips);
+			if (find_word(nvkiss, ips)) {
+				_dprintf("kiss: %s\n", ips);
+				continue;
+			}
+			sv[n++].name = addr[i];
+		}
 
-			if ((he = gethostbyname(addr[i])) != NULL) {
-				memcpy(&ia, he->h_addr_list[0], sizeof(ia));
-				ips = inet_ntoa(ia);
-				_dprintf("ip = %s\n", ips);
+		if (n > 0) {
+			i = ntp_query(sv, n);
 
-				nvkiss = nvram_safe_get("ntp_kiss");
-				if (find_word(nvkiss, ips)) {
-					_dprintf("kiss: %s\n", ips);
+			for (j = 0; j < n; ++j) {
+				if (sv[j].state == NS_KISS) {
+					ips = inet_ntoa(sv[j].addr);
+					add_kiss(ips);
+					syslog(LOG_WARNING, "Received a kiss of death packet from %s (%s).", sv[j].name, ips);
 				}
-				else {
-					switch (ntpc(ia)) {
-					case 0:
-						_dprintf("[ntpsync] %ld OK\n", get_uptime());
-						if (mode == INIT) {
-							tt = time(0);
-							if ((nu > 0) && ((tms = localtime(&tt)) != NULL)) {
-
-								// add some randomness to make the servers happier / avoid the xx:00 rush
-								sprintf(s, "cru a ntpsync \"%d ", (tms->tm_min + 20 + (rand() % 20)) % 60);
-
-								// schedule every nu hours
-								for (i = 0; i < 24; ++i) {
-									if ((i % nu) == 0) sprintf(s + strlen(s), "%s%d", i ? "," : "", (i + tms->tm_hour + 1)  % 24);
-								}
-								strcat(s, " * * * ntpsync --cron\"");
-								system(s);
-							}
-						}
+			}
+
+			if (i >= 0) {
+				_dprintf("[ntpsync] %ld OK\n", get_uptime());
+				ntp_adjust(sv[i].offset);
+				free(servers);
+
+				if (mode == INIT) {
+					tt = time(0);
+					if ((nu > 0) && ((tms = localtime(&tt)) != NULL)) {
 
-						// make sure access restriction is ok
-						system("rcheck");
-						_dprintf("[ntpsync] %ld exit\n", get_uptime());
-						return 0;
-					case 2:
-						while ((nvkiss) && (strlen(nvkiss) > 128)) nvkiss = strchr(nvkiss + 1, ' ');
-						if (nvkiss) strlcpy(s, nvkiss, sizeof(s));
-							else s[0] = 0;
-						add_word(s, ips, sizeof(s));
-						nvram_set("ntp_kiss", s);
-						syslog(LOG_WARNING, "Received a kiss of death packet from %s (%s).", addr[i], ips);
-						break;
+						// add some randomness to make the servers happier / avoid the xx:00 rush
+						sprintf(s, "cru a ntpsync \"%d ", (tms->tm_min + 20 + (rand() % 20)) % 60);
+
+						// schedule every nu hours
+						for (i = 0; i < 24; ++i) {
+							if ((i % nu) == 0) sprintf(s + strlen(s), "%s%d", i ? "," : "", (i + tms->tm_hour + 1)  % 24);
+						}
+						strcat(s, " * * * ntpsync --cron\"");
+						system(s);
 					}
 				}
-			}
 
-			addr[i] = addr[--count];
+				// make sure access restriction is ok
+				system("rcheck");
+				_dprintf("[ntpsync] %ld exit\n", get_uptime());
+				return 0;
+			}
 		}
 		free(servers);
 
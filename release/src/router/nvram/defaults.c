@@ -292,6 +292,8 @@ const defaults_t defaults[] = {
 	{ "dns_intcpt",			"0"				},
 	{ "dhcpc_minpkt",		"0"				},
 	{ "dnsmasq_custom",		""				},
+	{ "dnsbl_file",			""				},
+	{ "dnsbl_null",			"0"				},
 //	{ "dnsmasq_norw",		"0"				},
 
 // advanced-firewall
@@ -10,4 +10,16 @@ extern const defaults_t defaults[];
 extern const defaults_t if_generic[];
 extern const defaults_t if_vlan[];
 
+// for the perfect hash of defaults[] made by mkdefhash
+static inline unsigned int defaults_hash(const char *key, unsigned int seed)
+{
+	unsigned int h = 2166136261U ^ (seed * 0x9E3779B9U);
+
+	while (*key) h = (h ^ (unsigned char)*key++) * 16777619U;
+	h ^= h >> 16;
+	h *= 0x85EBCA6BU;
+	h ^= h >> 13;
+	return h;
+}
+
 #endif
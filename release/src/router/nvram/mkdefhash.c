@@ -0,0 +1,121 @@
+/*
+
+	NVRAM Utility
+	Copyright (C) 2006-2009 Jonathan Zarate
+
+*/
+
+//	Runs on the build host: builds a minimal perfect hash of the keys in
+//	defaults[] and writes it out as defaults_hash.h for in_defaults().
+//
+//	Keys are split into buckets by defaults_hash(key, 0), then, biggest
+//	bucket first, each bucket gets the first seed that drops all of its
+//	keys into free slots. A lookup is two hashes and one strcmp.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defaults.h"
+
+
+#define MAX_KEYS	4096
+
+typedef struct {
+	int n;
+	int key[16];
+} bucket_t;
+
+int main(int argc, char **argv)
+{
+	static int keys[MAX_KEYS];
+	static short slot[MAX_KEYS];
+	static unsigned short seed[MAX_KEYS];
+	static bucket_t buckets[MAX_KEYS];
+	static int order[MAX_KEYS];
+	int used[16];
+	int nkeys, nbuckets;
+	int i, j, k;
+	unsigned int d;
+	bucket_t *b;
+
+	// unique keys
+	nkeys = 0;
+	for (i = 0; defaults[i].key; ++i) {
+		for (j = 0; j < nkeys; ++j) {
+			if (strcmp(defaults[keys[j]].key, defaults[i].key) == 0) break;
+		}
+		if (j < nkeys) continue;
+		if (nkeys == MAX_KEYS) {
+			fprintf(stderr, "%s: too many keys\n", argv[0]);
+			return 1;
+		}
+		keys[nkeys++] = i;
+	}
+
+	nbuckets = (nkeys / 4) + 1;
+	for (i = 0; i < nkeys; ++i) {
+		b = &buckets[defaults_hash(defaults[keys[i]].key, 0) % nbuckets];
+		if (b->n == 16) {
+			fprintf(stderr, "%s: bucket overflow\n", argv[0]);
+			return 1;
+		}
+		b->key[b->n++] = keys[i];
+	}
+
+	// biggest first, while there's plenty of room
+	for (i = 0; i < nbuckets; ++i) order[i] = i;
+	for (i = 0; i < nbuckets; ++i) {
+		for (j = i + 1; j < nbuckets; ++j) {
+			if (buckets[order[j]].n > buckets[order[i]].n) {
+				k = order[i];
+				order[i] = order[j];
+				order[j] = k;
+			}
+		}
+	}
+
+	memset(slot, 0xFF, sizeof(slot));
+	for (i = 0; i < nbuckets; ++i) {
+		b = &buckets[order[i]];
+		if (b->n == 0) break;
+		for (d = 1; d < 0x10000; ++d) {
+			for (j = 0; j < b->n; ++j) {
+				used[j] = defaults_hash(defaults[b->key[j]].key, d) % nkeys;
+				if (slot[used[j]] >= 0) break;
+				for (k = 0; k < j; ++k) {
+					if (used[k] == used[j]) break;
+				}
+				if (k < j) break;
+			}
+			if (j == b->n) break;
+		}
+		if (d == 0x10000) {
+			fprintf(stderr, "%s: no seed found\n", argv[0]);
+			return 1;
+		}
+		seed[order[i]] = d;
+		for (j = 0; j < b->n; ++j) {
+			slot[used[j]] = b->key[j];
+		}
+	}
+
+	printf("// generated from defaults.c by mkdefhash, do not edit\n\n");
+	printf("#define DEFHASH_BUCKETS\t%d\n", nbuckets);
+	printf("#define DEFHASH_SIZE\t%d\n\n", nkeys);
+
+	printf("static const unsigned short defhash_seed[DEFHASH_BUCKETS] = {");
+	for (i = 0; i < nbuckets; ++i) {
+		printf("%s%u,", (i % 16) ? " " : "\n\t", seed[i]);
+	}
+	printf("\n};\n\n");
+
+	// index into defaults[]
+	printf("static const unsigned short defhash_slot[DEFHASH_SIZE] = {");
+	for (i = 0; i < nkeys; ++i) {
+		printf("%s%d,", (i % 16) ? " " : "\n\t", slot[i]);
+	}
+	printf("\n};\n");
+
+	return 0;
+}
@@ -10,6 +10,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <regex.h>
 #include <sys/wait.h>
 
 #include <bcmdevs.h>
@@ -20,6 +21,7 @@
 
 #include "nvram_convert.h"
 #include "defaults.h"
+#include "defaults_hash.h"
 
 
 __attribute__ ((noreturn))
@@ -29,8 +31,9 @@ static void help(void)
 		"NVRAM Utility\n"
 		"Copyright (C) 2006-2009 Jonathan Zarate\n\n"	
 		"Usage: nvram set <key=value> | get <key> | unset <key> | "
-		"ren <key> <key> | commit | show [--nosort|--nostat] | "
-		"find <text> | defaults <--yes|--initcheck> | backup <filename> | "
+		"ren <key> <key> | commit | show [--nosort] [--nostat] [--keys|--values] [--binary] | "
+		"find [--prefix|--regex] [--keys|--values] [--binary] <text> | "
+		"defaults <--yes|--initcheck> | backup <filename> | "
 		"restore <filename> [--test] [--force] [--forceall] [--nocommit] | "
 		"export <--quote|--c|--dump|--dump0|--set|--tab> | "
 		"import [--forceall] | "
@@ -48,6 +51,45 @@ static void getall(char *buffer)
 	}
 }
 
+// "key=value" by key
+static int cmp_key(const void *a, const void *b)
+{
+	const unsigned char *x = *(const unsigned char **)a;
+	const unsigned char *y = *(const unsigned char **)b;
+
+	while ((*x == *y) && (*x != '=') && (*x != 0)) {
+		++x;
+		++y;
+	}
+	return ((*x == '=') ? 0 : *x) - ((*y == '=') ? 0 : *y);
+}
+
+// same order as sort(1) in the C locale
+static int cmp_line(const void *a, const void *b)
+{
+	return strcmp(*(const char **)a, *(const char **)b);
+}
+
+// pointers to each "key=value" in buffer, sorted with cmp if there is one
+static char **key_list(char *buffer, int *count, int (*cmp)(const void *, const void *))
+{
+	char **list;
+	char *p;
+	int n;
+
+	n = 0;
+	for (p = buffer; *p; p += strlen(p) + 1) ++n;
+	if ((list = malloc((n + 1) * sizeof(*list))) == NULL) {
+		fprintf(stderr, "Not enough memory\n");
+		exit(1);
+	}
+	n = 0;
+	for (p = buffer; *p; p += strlen(p) + 1) list[n++] = p;
+	if (cmp) qsort(list, n, sizeof(*list), cmp);
+	*count = n;
+	return list;
+}
+
 static int set_main(int argc, char **argv)
 {
 	char *b, *p;
@@ -96,53 +138,131 @@ static int ren_main(int argc, char **argv)
 	return 0;
 }
 
+#define SHOW_LINE	0
+#define SHOW_KEY	1
+#define SHOW_VALUE	2
+
+typedef struct {
+	int sort;
+	int part;				// SHOW_*, what is matched and printed
+	int binary;				// "a=1\0b=2\0\0", like nvram_getall()
+	const char *prefix;		// of the key
+	regex_t *re;
+} show_t;
+
+// returns the number of entries shown
+static int show_list(char *buffer, const show_t *opt)
+{
+	char **list;
+	char *p, *q, *v;
+	char c;
+	int i, n;
+	int shown;
+
+	list = key_list(buffer, &n, opt->sort ? cmp_line : NULL);
+	shown = 0;
+	for (i = 0; i < n; ++i) {
+		p = list[i];
+		if ((opt->prefix) && (strncmp(p, opt->prefix, strlen(opt->prefix)) != 0)) continue;
+
+		if ((v = strchr(p, '=')) == NULL) v = p + strlen(p);
+		c = *v;
+		if (opt->part == SHOW_KEY) *v = 0;
+			else if (opt->part == SHOW_VALUE) p = (c) ? v + 1 : v;
+
+		if (!opt->binary) {
+			for (q = p; *q; ++q) {
+				if (!isprint(*q)) *q = ' ';
+			}
+		}
+		if ((opt->re == NULL) || (regexec(opt->re, p, 0, NULL, 0) == 0)) {
+			if (opt->binary) fwrite(p, strlen(p) + 1, 1, stdout);
+				else puts(p);
+			++shown;
+		}
+		*v = c;
+	}
+	if (opt->binary) putchar(0);
+
+	free(list);
+	return shown;
+}
+
+// sets opt from a --keys, --values or --binary, returns 0 if it's something else
+static int show_opt(const char *arg, show_t *opt)
+{
+	if (strcmp(arg, "--keys") == 0) opt->part = SHOW_KEY;
+		else if (strcmp(arg, "--values") == 0) opt->part = SHOW_VALUE;
+		else if (strcmp(arg, "--binary") == 0) opt->binary = 1;
+		else return 0;
+	return 1;
+}
+
 static int show_main(int argc, char **argv)
 {
-	char *p, *q;
+	char *p;
 	char buffer[NVRAM_SPACE];
 	int n;
 	int count;
-	int show = 1;
 	int stat = 1;
-	int sort = 1;
+	show_t opt;
 
+	memset(&opt, 0, sizeof(opt));
+	opt.sort = 1;
 	for (n = 1; n < argc; ++n) {
-        if (strcmp(argv[n], "--nostat") == 0) stat = 0;
-			else if (strcmp(argv[n], "--nosort") == 0) sort = 0;
-				else help();
-	}
-
-	if (sort) {
-		system("nvram show --nostat --nosort | sort");	// smallest and easiest way :)
-		show = 0;
+		if (strcmp(argv[n], "--nostat") == 0) stat = 0;
+			else if (strcmp(argv[n], "--nosort") == 0) opt.sort = 0;
+			else if (!show_opt(argv[n], &opt)) help();
 	}
+	if (opt.binary) stat = 0;
 
 	getall(buffer);
 	count = 0;
-	for (p = buffer; *p; p += strlen(p) + 1) {
-		q = p;
-		while (*q) {
-			if (!isprint(*q)) *q = ' ';
-			++q;
-		}
-		if (show) puts(p);
-		++count;
-	}
+	for (p = buffer; *p; p += strlen(p) + 1) ++count;
+	n = sizeof(struct nvram_header) + (p - buffer);
+
+	show_list(buffer, &opt);
 	if (stat) {
-		n = sizeof(struct nvram_header) + (p - buffer);
 		printf("---\n%d entries, %d bytes used, %d bytes free.\n", count, n, NVRAM_SPACE - n);
 	}
 	return 0;
 }
 
+//	Same as grep on "nvram show" by default, with a basic regular
+//	expression. Returns 1 if nothing was found.
 static int find_main(int argc, char **argv)
 {
-	char cmd[512];
-	int r;
+	char buffer[NVRAM_SPACE];
+	regex_t re;
+	int flags;
+	int n;
+	show_t opt;
+
+	memset(&opt, 0, sizeof(opt));
+	opt.sort = 1;
+	flags = REG_NOSUB;
+	for (n = 1; n < argc - 1; ++n) {
+		if (strcmp(argv[n], "--prefix") == 0) flags = -1;
+			else if (strcmp(argv[n], "--regex") == 0) flags = REG_EXTENDED | REG_NOSUB;
+			else if (!show_opt(argv[n], &opt)) help();
+	}
+	if (n != argc - 1) help();
 
-	snprintf(cmd, sizeof(cmd), "nvram show --nostat --nosort | sort | grep \"%s\"", argv[1]);
-	r = system(cmd);
-	return (r == -1) ? 1 : WEXITSTATUS(r);
+	if (flags == -1) {
+		opt.prefix = argv[n];
+	}
+	else {
+		if (regcomp(&re, argv[n], flags) != 0) {
+			fprintf(stderr, "Invalid expression\n");
+			return 2;
+		}
+		opt.re = &re;
+	}
+
+	getall(buffer);
+	n = show_list(buffer, &opt);
+	if (opt.re) regfree(opt.re);
+	return (n == 0);
 }
 
 static int defaults_main(int argc, char **argv)
@@ -185,6 +305,8 @@ static int defaults_main(int argc, char **argv)
 	if (force) nvram_unset("nvram_ver");	// prep to prevent problems later
 #endif
 
+	// one read of everything, then the gets below don't go to the kernel
+	nvram_txn_begin();
 
 	for (t = defaults; t->key; t++) {
 		if (((p = nvram_get(t->key)) == NULL) || (force)) {
@@ -245,6 +367,11 @@ static int defaults_main(int argc, char **argv)
 	nvram_set("os_version", tomato_version);
 	nvram_set("os_date", tomato_buildtime);
 
+	if (nvram_txn_commit(NULL) < 0) {
+		printf("Error setting variables.\n");
+		return 1;
+	}
+
 /*	if (nvram_match("dirty", "1")) {
 		nvram_unset("dirty");
 		commit = 1;
@@ -348,13 +475,11 @@ static int export_main(int argc, char **argv)
 
 static int in_defaults(const char *key)
 {
-	const defaults_t *t;
 	int n;
 
-	for (t = defaults; t->key; t++) {
-		if (strcmp(t->key, key) == 0) return 1;
-	}
-	
+	n = defhash_slot[defaults_hash(key, defhash_seed[defaults_hash(key, 0) % DEFHASH_BUCKETS]) % DEFHASH_SIZE];
+	if (strcmp(defaults[n].key, key) == 0) return 1;
+
 	if ((strncmp(key, "rrule", 5) == 0) && ((n = atoi(key + 5)) > 0) && (n < 50)) return 1;
 
 	return 0;
@@ -383,6 +508,7 @@ static int import_main(int argc, char **argv)
 	
 	same = skip = set = 0;
 
+	nvram_txn_begin();
 	while (fgets(s, sizeof(s), f) != NULL) {
 		n = strlen(s);
 		while ((--n > 0) && (isspace(s[n]))) ;
@@ -417,6 +543,7 @@ static int import_main(int argc, char **argv)
 					break;
 				default:
 					printf("Error unescaping %s=%s\n", k, v);
+					nvram_txn_abort();
 					return 1;
 				}
 			}
@@ -446,6 +573,10 @@ static int import_main(int argc, char **argv)
 
 	fclose(f);	
 	
+	if (nvram_txn_commit(NULL) < 0) {
+		printf("Error setting variables.\n");
+		return 1;
+	}
 	printf("---\n%d skipped, %d same, %d set\n", skip, same, set);
 	return 0;
 }
@@ -510,12 +641,14 @@ static int restore_main(int argc, char **argv)
 	unsigned long hw;
 	char current[NVRAM_SPACE];
 	char *b, *bk, *bv;
-	char *c, *ck, *cv;
+	char *ck, *cv;
+	char **blist, **clist;
+	int bn, cn;
 	int nset;
 	int nunset;
 	int nsame;
 	int cmp;
-	int i;
+	int i, j;
 
 	test = 0;
 	force = 0;
@@ -617,6 +750,9 @@ CORRUPT:
 		}
 		set_action(ACT_SW_RESTORE);
 		led(LED_DIAG, 1);
+
+		// sets and unsets all go to the kernel together at the end
+		nvram_txn_begin();
 	}
 
 	nset = nunset = nsame = 0;
@@ -643,40 +779,40 @@ CORRUPT:
 	}
 
 
-	// 3 - unset
+	// 3 - unset, walking both sorted by key
 
 	getall(current);
-	c = current;
-	while (*c) {
-		ck = c;
-		c += strlen(c) + 1;
+	blist = key_list(data.buffer, &bn, cmp_key);
+	clist = key_list(current, &cn, cmp_key);
+	i = 0;
+	for (j = 0; j < cn; ++j) {
+		ck = clist[j];
 		if ((cv = strchr(ck, '=')) == NULL) {
 			printf("Invalid data in NVRAM: %s.", ck);
 			continue;
 		}
-		*cv++ = 0;
 
+		cmp = 1;
+		while ((i < bn) && ((cmp = cmp_key(&blist[i], &ck)) < 0)) ++i;
+		if (cmp == 0) continue;
+
+		*cv = 0;
 		if ((force != 1) || (in_defaults(ck))) {
-			cmp = 1;
-			b = data.buffer;
-			while (*b) {
-				bk = b;
-				b += strlen(b) + 1;
-				bv = strchr(bk, '=');
-				*bv++ = 0;
-				cmp = strcmp(bk, ck);
-				*(bv - 1) = '=';
-				if (cmp == 0) break;
-			}
-			if (cmp != 0) {
-				++nunset;
-				if (test) printf("nvram unset \"%s\"\n", ck);
-					else nvram_unset(ck);
-			}
+			++nunset;
+			if (test) printf("nvram unset \"%s\"\n", ck);
+				else nvram_unset(ck);
 		}
 	}
+	free(blist);
+	free(clist);
 	
 
+	if ((!test) && (nvram_txn_commit(NULL) < 0)) {
+		printf("Error setting variables.\n");
+		set_action(ACT_IDLE);
+		return 1;
+	}
+
 	if ((nset == 0) && (nunset == 0)) commit = 0;
 	printf("\nPerformed %d set and %d unset operations. %d required no changes.\n%s\n",
 		nset, nunset, nsame, commit ? "Committing..." : "Not commiting.");
@@ -775,7 +911,7 @@ static const applets_t applets[] = {
 	{ "ren",		4,	ren_main		},
 	{ "show",		-2,	show_main		},
 	{ "commit",		2,	commit_main		},
-	{ "find",		3,	find_main		},
+	{ "find",		-3,	find_main		},
 	{ "export",		3,	export_main		},
 	{ "import",		-3,	import_main		},
 	{ "defaults",	3,	defaults_main	},
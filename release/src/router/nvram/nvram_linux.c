@@ -37,6 +37,30 @@
 static int nvram_fd = -1;
 static char *nvram_buf = NULL;
 
+/*
+ * Transactions: nvram_txn_begin() takes a copy of everything, nvram_get()
+ * then reads from the copy and nvram_set()/nvram_unset() only record the
+ * change. nvram_txn_commit() sends whatever differs to the kernel in one
+ * write(), which applies all of it under one lock. nvram_getall() does not
+ * see uncommitted changes. Like the mmap, whatever nvram_get() returned
+ * from the copy or a change stays valid for the life of the process, so
+ * once one has been handed out, that memory is never freed.
+ */
+typedef struct {
+	const char *name;
+	const char *value;		/* in the copy, NULL if not set */
+	char *rec;				/* "name\0value\0" or "name\0" once changed */
+	int unset;
+} nvram_txn_ent_t;
+
+static struct {
+	char *copy;
+	nvram_txn_ent_t *ent;
+	unsigned int size;		/* power of 2 */
+	unsigned int used;
+	int handed;				/* nvram_get() returned a pointer into copy or a rec */
+} txn;
+
 int nvram_init(void *unused)
 {
 	if ((nvram_fd = open(PATH_DEV_NVRAM, O_RDWR)) >= 0) {
@@ -52,12 +76,234 @@ int nvram_init(void *unused)
 	return errno;
 }
 
+static unsigned int txn_hash(const char *name)
+{
+	unsigned int h = 2166136261U;
+
+	while (*name) h = (h ^ (unsigned char)*name++) * 16777619U;
+	return h;
+}
+
+static nvram_txn_ent_t *txn_find(const char *name)
+{
+	unsigned int i;
+	nvram_txn_ent_t *e;
+
+	for (i = txn_hash(name) & (txn.size - 1); ; i = (i + 1) & (txn.size - 1)) {
+		e = &txn.ent[i];
+		if ((e->name == NULL) || (strcmp(e->name, name) == 0)) return e;
+	}
+}
+
+static int txn_grow(void)
+{
+	nvram_txn_ent_t *old = txn.ent;
+	unsigned int n = txn.size;
+
+	if ((txn.ent = calloc(n * 2, sizeof(*txn.ent))) == NULL) {
+		txn.ent = old;
+		return -ENOMEM;
+	}
+	txn.size = n * 2;
+	while (n-- > 0) {
+		if (old[n].name) *txn_find(old[n].name) = old[n];
+	}
+	free(old);
+	return 0;
+}
+
+static void txn_free(void)
+{
+	unsigned int i;
+
+	if (txn.ent) {
+		if (!txn.handed) {
+			for (i = 0; i < txn.size; ++i) free(txn.ent[i].rec);
+		}
+		free(txn.ent);
+	}
+	if (!txn.handed) free(txn.copy);
+	memset(&txn, 0, sizeof(txn));
+}
+
+static int txn_set(const char *name, const char *value)
+{
+	nvram_txn_ent_t *e;
+	char *rec;
+	size_t n;
+
+	if (((txn.used + 1) * 2 > txn.size) && (txn_grow() != 0)) return -ENOMEM;
+
+	n = strlen(name) + 1;
+	if ((rec = malloc(n + (value ? strlen(value) + 1 : 0))) == NULL) return -ENOMEM;
+	strcpy(rec, name);
+	if (value) strcpy(rec + n, value);
+
+	e = txn_find(name);
+	if (e->name == NULL) {
+		++txn.used;
+	}
+	else if (e->name == e->rec) {
+		e->name = NULL;		/* not in the copy, it goes with the old rec */
+	}
+	if (!txn.handed) free(e->rec);
+	e->rec = rec;
+	if (e->name == NULL) e->name = rec;
+	e->unset = (value == NULL);
+	return 0;
+}
+
+int nvram_txn_begin(void)
+{
+	char *p, *v;
+	nvram_txn_ent_t *e;
+	int r;
+
+	if (txn.copy) return -EBUSY;
+
+	if ((txn.copy = malloc(NVRAM_SPACE)) == NULL) return -ENOMEM;
+	if ((r = nvram_getall(txn.copy, NVRAM_SPACE)) != 0) {
+		txn_free();
+		return (r < 0) ? r : -EIO;
+	}
+
+	txn.size = 1024;
+	if ((txn.ent = calloc(txn.size, sizeof(*txn.ent))) == NULL) {
+		txn_free();
+		return -ENOMEM;
+	}
+
+	for (p = txn.copy; *p; p = v + strlen(v) + 1) {
+		if ((v = strchr(p, '=')) == NULL) break;
+		*v++ = 0;
+		if ((txn.used + 1) * 2 > txn.size) {
+			if (txn_grow() != 0) {
+				txn_free();
+				return -ENOMEM;
+			}
+		}
+		e = txn_find(p);
+		if (e->name == NULL) ++txn.used;
+		e->name = p;
+		e->value = v;
+	}
+	return 0;
+}
+
+void nvram_txn_abort(void)
+{
+	txn_free();
+}
+
+/*
+ * Returns the number of variables changed, or < 0 on error. If changed is
+ * given, it is set to a malloc'd list of their names as "a\0b\0\0".
+ */
+int nvram_txn_commit(char **changed)
+{
+	unsigned int i;
+	nvram_txn_ent_t *e;
+	char *buf, *p, *c, *cp;
+	const char *v;
+	size_t len, clen;
+	int n;
+	int r;
+
+	if (changed) *changed = NULL;
+	if (txn.copy == NULL) return -EINVAL;
+
+	len = clen = 1;
+	for (i = 0; i < txn.size; ++i) {
+		if ((e = &txn.ent[i])->rec == NULL) continue;
+		len += strlen(e->rec) + 2;
+		if (!e->unset) len += strlen(e->rec + strlen(e->rec) + 1);
+		clen += strlen(e->rec) + 1;
+	}
+	buf = malloc(len);
+	c = changed ? malloc(clen) : NULL;
+	if ((buf == NULL) || ((changed) && (c == NULL))) {
+		free(buf);
+		free(c);
+		txn_free();
+		return -ENOMEM;
+	}
+
+	p = buf;
+	cp = c;
+	n = 0;
+	for (i = 0; i < txn.size; ++i) {
+		if ((e = &txn.ent[i])->rec == NULL) continue;
+		if (e->unset) {
+			if (e->value == NULL) continue;
+			p += sprintf(p, "%s", e->rec) + 1;
+		}
+		else {
+			v = e->rec + strlen(e->rec) + 1;
+			if ((e->value) && (strcmp(e->value, v) == 0)) continue;
+			p += sprintf(p, "%s=%s", e->rec, v) + 1;
+		}
+		if (cp) {
+			strcpy(cp, e->rec);
+			cp += strlen(cp) + 1;
+		}
+		++n;
+	}
+	*p = 0;
+	if (cp) *cp = 0;
+
+	r = 0;
+	if (p > buf) {
+		if (nvram_fd < 0) r = nvram_init(NULL);
+		if (r == 0) {
+			len = p - buf;
+			r = write(nvram_fd, buf, len);
+			if (r < 0) perror(PATH_DEV_NVRAM);
+			r = (r == len) ? 0 : -EIO;
+		}
+	}
+
+	free(buf);
+	txn_free();
+	if (r != 0) {
+		free(c);
+		return r;
+	}
+	if (changed) *changed = c;
+	return n;
+}
+
+int nvram_set_many(const struct nvram_tuple *t, char **changed)
+{
+	int r;
+
+	if ((r = nvram_txn_begin()) != 0) return r;
+	for (; t; t = t->next) {
+		if ((r = nvram_set(t->name, t->value)) != 0) {
+			nvram_txn_abort();
+			return r;
+		}
+	}
+	return nvram_txn_commit(changed);
+}
+
 char *nvram_get(const char *name)
 {
 	char tmp[100];
 	char *value;
 	size_t count = strlen(name) + 1;
 	unsigned long *off = (unsigned long *)tmp;
+	nvram_txn_ent_t *e;
+
+	if (txn.copy) {
+		e = txn_find(name);
+		if (e->rec) {
+			if (e->unset) return NULL;
+			txn.handed = 1;
+			return e->rec + strlen(e->rec) + 1;
+		}
+		if (e->value) txn.handed = 1;
+		return (char *)e->value;
+	}
 
 	if (nvram_fd < 0) {
 		if (nvram_init(NULL) != 0) return NULL;
@@ -105,6 +351,8 @@ static int _nvram_set(const char *name, const char *value)
 	char *buf = tmp;
 	int ret;
 
+	if (txn.copy) return txn_set(name, value);
+
 	if (nvram_fd < 0) {
 		if ((ret = nvram_init(NULL)) != 0) return ret;
 	}
@@ -725,14 +725,10 @@ int start_firewall(void)
 	}
 #endif
 
-	if (nvram_get_int("upnp_enable") & 3) {
-		f_write("/etc/upnp/save", NULL, 0, 0, 0);
-		if (killall("miniupnpd", SIGUSR2) == 0) {
-			f_wait_notexists("/etc/upnp/save", 5);
-		}
-	}
-
-	if (eval("iptables-restore", (char *)ipt_fname) == 0) {
+	// the upnp chains belong to miniupnpd, leave its mappings in place
+	if (nvram_get_int("upnp_enable") & 3) n = eval("iptables-restore", "--keep", "upnp", (char *)ipt_fname);
+		else n = eval("iptables-restore", (char *)ipt_fname);
+	if (n == 0) {
 		led(LED_DIAG, 0);
 	}
 	else {
@@ -756,11 +752,6 @@ int start_firewall(void)
 		*/
 	}
 
-	if (nvram_get_int("upnp_enable") & 3) {
-		f_write("/etc/upnp/load", NULL, 0, 0, 0);
-		killall("miniupnpd", SIGUSR2);
-	}
-
 	simple_unlock("restrictions");
 	sched_restrictions();
 	enable_ip_forward();
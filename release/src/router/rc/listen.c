@@ -31,6 +31,7 @@
 #include <linux/if_packet.h>
 #include <linux/if_ether.h>
 #endif
+#include <linux/filter.h>
 
 
 //	#define DEBUG
@@ -135,6 +136,37 @@ static int raw_socket(int ifindex)
 	return fd;
 }
 
+// only IPv4 sent to our MAC and going off the LAN wakes us up
+static int attach_filter(int fd, const unsigned char *mac, u_int32_t lan_ip, u_int32_t lan_mask)
+{
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LD + BPF_H + BPF_ABS, 12),							// ethertype
+		BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, ETH_P_IP, 0, 9),
+		BPF_STMT(BPF_LD + BPF_W + BPF_ABS, 0),							// dst mac
+		BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, 0, 0, 7),
+		BPF_STMT(BPF_LD + BPF_H + BPF_ABS, 4),
+		BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, 0, 0, 5),
+		BPF_STMT(BPF_LD + BPF_W + BPF_ABS, 30),							// ip daddr
+		BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, 0, 3, 0),
+		BPF_STMT(BPF_ALU + BPF_AND + BPF_K, 0),
+		BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, 0, 1, 0),
+		BPF_STMT(BPF_RET + BPF_K, ETH_HLEN + sizeof(struct iphdr)),	// headers are enough
+		BPF_STMT(BPF_RET + BPF_K, 0),
+	};
+	struct sock_fprog prog;
+
+	if (lan_mask == 0) lan_mask = 0xFFFFFFFF;
+	code[3].k = (mac[0] << 24) | (mac[1] << 16) | (mac[2] << 8) | mac[3];
+	code[5].k = (mac[4] << 8) | mac[5];
+	code[7].k = ntohl(lan_ip);
+	code[8].k = ntohl(lan_mask);
+	code[9].k = ntohl(lan_ip & lan_mask);
+
+	prog.len = sizeof(code) / sizeof(code[0]);
+	prog.filter = code;
+	return setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
 static u_int16_t checksum(void *addr, int count)
 {
 	// Compute Internet Checksum for "count" bytes beginning at location "addr".
@@ -174,6 +206,8 @@ static int listen_interface(char *interface)
 	int bytes;
 	u_int16_t check;
 	struct in_addr ipaddr, netmask;
+	u_int32_t lan_ip, lan_mask;
+	int l2tp;
 
 
 	if (read_interface(interface, &ifindex, mac) < 0) {
@@ -186,25 +220,54 @@ static int listen_interface(char *interface)
 		return L_ERROR;
 	}
 
+	// nothing here changes without a restart of listen
+	lan_ip = inet_addr(nvram_safe_get("lan_ipaddr"));
+	lan_mask = inet_addr(nvram_safe_get("lan_netmask"));
+
+	l2tp = nvram_match("wan_proto", "l2tp");
+	ipaddr.s_addr = 0;
+	if (nvram_match("wan_proto", "pptp")) {
+		inet_aton(nvram_safe_get("pptp_server_ip"), &ipaddr);
+	}
+	else if (l2tp) {
+#ifdef TCONFIG_L2TP
+		inet_aton(nvram_safe_get("lan_ipaddr"), &ipaddr);	// checkme: why?	zzz
+#endif
+	}
+	else {
+		inet_aton(nvram_safe_get("wan_ipaddr"), &ipaddr);
+	}
+	inet_aton(nvram_safe_get("wan_netmask"), &netmask);
+	LOG("gateway=%08x", ipaddr.s_addr);
+	LOG("netmask=%08x", netmask.s_addr);
+
+	if (attach_filter(fd, mac, lan_ip, lan_mask) < 0) {
+		LOG("SO_ATTACH_FILTER failed, checking every packet\n");
+	}
+
+	// ip-up kills us once the link is up, so this only needs checking now and then
+	retval = 0;
 	while (1) {
-		if (!wait_action_idle(5)) {	// Don't execute during upgrading
-			ret = L_UPGRADE;
-			break;
-		}
-		if (check_wanup()) {
-			ret = L_ESTABLISHED;
-			break;
+		if (retval <= 0) {
+			if (!wait_action_idle(5)) {	// Don't execute during upgrading
+				ret = L_UPGRADE;
+				break;
+			}
+			if (check_wanup()) {
+				ret = L_ESTABLISHED;
+				break;
+			}
 		}
 
-		tv.tv_sec = 100000;
+		tv.tv_sec = 60;
 		tv.tv_usec = 0;
 		FD_ZERO(&rfds);
 		FD_SET(fd, &rfds);
 		LOG("Waitting for select... \n");
 		retval = select(fd + 1, &rfds, NULL, NULL, &tv);
 
-		if (retval == 0) {
-			printf("no packet recieved! \n\n");
+		if (retval <= 0) {
+			LOG("no packet recieved! \n\n");
 			continue;
 		}
 
@@ -219,25 +282,24 @@ static int listen_interface(char *interface)
 
 		if (bytes < (int) (sizeof(struct iphdr))) {
 			LOG("message too short, ignoring\n");
-			ret = L_FAIL;
-			goto EXIT;
+			continue;
 		}
 
+		// the filter should have done these already
+
 		if (memcmp(mac, packet.dst_mac, 6) != 0) {
 			LOG("dest %02x:%02x:%02x:%02x:%02x:%02x mac not the router\n",
 				packet.dst_mac[0], packet.dst_mac[1], packet.dst_mac[2],
 				packet.dst_mac[3], packet.dst_mac[4], packet.dst_mac[5]);
-			ret = L_FAIL;
-			goto EXIT;
+			continue;
 		}
 
-		if (inet_addr(nvram_safe_get("lan_ipaddr")) == *(u_int32_t *)packet.daddr) {
+		if (lan_ip == *(u_int32_t *)packet.daddr) {
 			LOG("dest ip equal to lan ipaddr\n");
-			ret = L_FAIL;
-			goto EXIT;
+			continue;
 		}
 
-		LOG("inet_addr=%x, packet.daddr=%x",inet_addr(nvram_safe_get("lan_ipaddr")),*(u_int32_t *)packet.daddr);
+		LOG("inet_addr=%x, packet.daddr=%x", lan_ip, *(u_int32_t *)packet.daddr);
 
 		//for (i=0; i<34;i++) {
 		//	if (i%16==0) printf("\n");
@@ -262,10 +324,9 @@ static int listen_interface(char *interface)
 		LOG("ip.saddr=%08x", *(u_int32_t *)&(packet.saddr));
 		LOG("ip.daddr=%08x", *(u_int32_t *)&(packet.daddr));
 
-		if (*(u_int16_t *)packet.type == 0x0800) {
+		if (ntohs(*(u_int16_t *)packet.type) != ETH_P_IP) {
 			LOG("not ip protocol");
-			ret = L_FAIL;
-			goto EXIT;
+			continue;
 		}
 
 		/* ignore any extra garbage bytes */
@@ -278,40 +339,23 @@ static int listen_interface(char *interface)
 		if (check != checksum(&(packet.version), sizeof(struct iphdr))) {
 			LOG("bad IP header checksum, ignoring\n");
 			LOG("check received = %X, should be %X",check, checksum(&(packet.version), sizeof(struct iphdr)));
-			ret = L_FAIL;
-			goto EXIT;
+			continue;
 		}
 
 		LOG("oooooh!!! got some!\n");
 
-		if (nvram_match("wan_proto", "pptp")) {
-			inet_aton(nvram_safe_get("pptp_server_ip"), &ipaddr);
-		}
-		else if (nvram_match("wan_proto", "l2tp")) {
-#ifdef TCONFIG_L2TP
-			inet_aton(nvram_safe_get("lan_ipaddr"), &ipaddr);	// checkme: why?	zzz
-#endif
-		}
-		else {
-			inet_aton(nvram_safe_get("wan_ipaddr"), &ipaddr);
-		}
-		inet_aton(nvram_safe_get("wan_netmask"), &netmask);
-		LOG("gateway=%08x", ipaddr.s_addr);
-		LOG("netmask=%08x", netmask.s_addr);
-
 		if ((ipaddr.s_addr & netmask.s_addr) != (*(u_int32_t *)&(packet.daddr) & netmask.s_addr)) {
-			if (nvram_match("wan_proto", "l2tp")) {
-				ret = L_SUCCESS;
-				goto EXIT;
+			if (l2tp) {
+				ret = wait_action_idle(5) ? L_SUCCESS : L_UPGRADE;
+				break;
 			}
 			else {
 				ret = L_FAIL;
-				goto EXIT;
+				break;
 			}
 		}
 	}
 
-EXIT:
 	if (fd) close(fd);
 	return ret;
 }
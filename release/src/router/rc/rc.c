@@ -76,6 +76,7 @@ static const applets_t applets[] = {
 	{ "listen",				listen_main				},
 	{ "service",			service_main			},
 	{ "sched",				sched_main				},
+	{ "wlsta",				wlsta_main				},
 	{ "mtd-write",			mtd_write_main			},
 	{ "mtd-erase",			mtd_unlock_erase_main	},
 	{ "mtd-unlock",			mtd_unlock_erase_main	},
@@ -212,6 +212,7 @@ extern void ipt_triggered(ipt_table_t table);
 extern int rcheck_main(int argc, char *argv[]);
 extern void ipt_restrictions(void);
 extern void sched_restrictions(void);
+extern int dnsmasq_restrictions(void);
 
 // qos.c
 extern void ipt_qos(void);
@@ -295,6 +296,11 @@ extern int sched_main(int argc, char *argv[]);
 extern void start_sched(void);
 extern void stop_sched(void);
 
+// wlsta.c
+extern int wlsta_main(int argc, char *argv[]);
+extern void start_wlsta(void);
+extern void stop_wlsta(void);
+
 
 #ifdef TOMATO_SL
 // usb.c
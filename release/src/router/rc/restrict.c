@@ -53,6 +53,44 @@ static int in_sched(int now_mins, int now_dow, int sched_begin, int sched_end, i
 	return 0;
 }
 
+// minutes until in_sched() changes, or -1 if it never does
+static int next_change(int now_mins, int now_wday, int insch, int sched_begin, int sched_end, int sched_dow)
+{
+	int edges[2];
+	int nedges;
+	int day, i, t;
+	int next;
+
+	// a rule can only switch where its period begins or ends
+	if ((sched_begin < 0) || (sched_end < 0)) {
+		edges[0] = 0;
+		nedges = 1;
+	}
+	else {
+		edges[0] = sched_begin;
+		edges[1] = sched_end;
+		nedges = 2;
+	}
+
+	next = -1;
+	for (day = 0; day <= 7; ++day) {
+		for (i = 0; i < nedges; ++i) {
+			t = (day * 1440) + edges[i] - now_mins;
+			if ((t <= 0) || ((next > 0) && (t >= next))) continue;
+			if (in_sched(edges[i], 1 << ((now_wday + day) % 7), sched_begin, sched_end, sched_dow) != insch) next = t;
+		}
+		if (next > 0) break;
+	}
+	return next;
+}
+
+static const char rcheck_fname[] = "/etc/iptables.rcheck";
+
+static void rule_chain(char *buf, int nrule, char comp)
+{
+	sprintf(buf, "r%s%02d", (comp != '|') ? "dev" : "res", nrule);
+}
+
 
 int rcheck_main(int argc, char *argv[])
 {
@@ -64,15 +102,21 @@ int rcheck_main(int argc, char *argv[])
 	time_t now;
 	struct tm *tms;
 	int now_dow;
+	int now_wday;
 	int now_mins;
 	int n;
 	int nrule;
 	char comp;
+	char comps[MAX_NRULES];
 	int insch;
 	unsigned long long activated;
+	unsigned long long bit;
+	unsigned long long changed;
 	int count;
 	int radio;
 	int r;
+	int next;
+	FILE *f;
 
 	if (!nvram_contains_word("log_events", "acre")) {
 		setlogmask(LOG_MASK(LOG_EMERG));	// can't set to 0
@@ -86,16 +130,19 @@ int rcheck_main(int argc, char *argv[])
 			nvram_set("rrules_timewarn", "1");
 			syslog(LOG_INFO, "Time not yet set. Only \"all day, everyday\" restrictions will be activated.");
 		}
-		now_mins = now_dow = 0;
+		now_mins = now_dow = now_wday = 0;
 	}
 	else {
 		tms = localtime(&now);
-		now_dow = 1 << tms->tm_wday;
+		now_wday = tms->tm_wday;
+		now_dow = 1 << now_wday;
 		now_mins = (tms->tm_hour * 60) + tms->tm_min;
 	}
 
 	activated = strtoull(nvram_safe_get("rrules_activated"), NULL, 16);
+	changed = 0;
 	count = 0;
+	next = -1;
 	radio = nvram_match("wl_radio", "1") ? -1 : -2;
 	for (nrule = 0; nrule < MAX_NRULES; ++nrule) {
 		sprintf(buf, "rrule%d", nrule);
@@ -111,10 +158,13 @@ int rcheck_main(int argc, char *argv[])
 		}
 		else {
 			insch = in_sched(now_mins, now_dow, sched_begin, sched_end, sched_dow);
+
+			n = next_change(now_mins, now_wday, insch, sched_begin, sched_end, sched_dow);
+			if ((n > 0) && ((next < 0) || (n < next))) next = n;
 		}
 
-		n = 1 << nrule;
-		if ((insch) == ((activated & n) != 0)) {
+		bit = 1ULL << nrule;
+		if ((insch) == ((activated & bit) != 0)) {
 			continue;
 		}
 
@@ -124,38 +174,62 @@ int rcheck_main(int argc, char *argv[])
 			if ((radio != 0) && (radio != -2)) radio = !insch;
 		}
 		else {
-			sprintf(buf, "r%s%02d", (comp != '|') ? "dev" : "res", nrule);
+			// applied below, all in one go
+			comps[nrule] = comp;
+			changed |= bit;
+		}
 
-			r = eval("iptables", "-D", "restrict", "-j", buf);
-			if (insch) {
-				// ignore error above (if any)
+		if (insch) activated |= bit;
+			else activated &= ~bit;
+	}
 
-				r = eval("iptables", "-A", "restrict", "-j", buf);
+	if (changed) {
+		r = -1;
+		if ((f = fopen(rcheck_fname, "w")) != NULL) {
+			fprintf(f, "*filter\n");
+			for (nrule = 0; nrule < MAX_NRULES; ++nrule) {
+				bit = 1ULL << nrule;
+				if ((changed & bit) == 0) continue;
+				rule_chain(buf, nrule, comps[nrule]);
+				fprintf(f, "-%c restrict -j %s\n", (activated & bit) ? 'A' : 'D', buf);
 			}
+			fprintf(f, "COMMIT\n");
+			fclose(f);
+			r = eval("iptables-restore", "--noflush", (char *)rcheck_fname);
+		}
 
-			if (r != 0) {
-				syslog(LOG_ERR, "Iptables command failed. Retrying in 15 minutes.");
-				continue;
-			}
-/*
-			if (eval("iptables", insch ? "-A" : "-D", "restrict", "-j", buf) != 0) {
-				syslog(LOG_ERR, "iptables command failed");
-				continue;
+		if (r != 0) {
+			// the chain isn't what we think it is, go one at a time
+			for (nrule = 0; nrule < MAX_NRULES; ++nrule) {
+				bit = 1ULL << nrule;
+				if ((changed & bit) == 0) continue;
+				rule_chain(buf, nrule, comps[nrule]);
+
+				r = eval("iptables", "-D", "restrict", "-j", buf);
+				if (activated & bit) {
+					// ignore error above (if any)
+
+					r = eval("iptables", "-A", "restrict", "-j", buf);
+				}
+
+				if (r != 0) {
+					syslog(LOG_ERR, "Iptables command failed. Retrying in 15 minutes.");
+					activated ^= bit;
+					if ((next < 0) || (next > 15)) next = 15;
+				}
 			}
-*/
 		}
-
-		if (insch) activated |= n;
-			else activated &= ~n;
 	}
 
 	sprintf(buf, "%llx", activated);
 	nvram_set("rrules_activated", buf);
 
-	if (count > 0) {
-		if ((argc != 2) || (strcmp(argv[1], "--cron") != 0)) {
-			system("cru a rcheck '*/15 * * * * rcheck --cron'");
-		}
+	if ((count > 0) && (next > 0)) {
+		// run again at exactly the next start or end of a rule
+		now += (next * 60) - (now % 60);
+		tms = localtime(&now);
+		sprintf(buf, "cru a rcheck \"%d %d %d %d * rcheck --cron\"", tms->tm_min, tms->tm_hour, tms->tm_mday, tms->tm_mon + 1);
+		system(buf);
 	}
 	else {
 		unsched_restrictions();
@@ -374,3 +448,53 @@ void ipt_restrictions(void)
 
 	if (need_web) modprobe("ipt_web");
 }
+
+// DNS blocklists for rules with an rrule##_dnsbl list. dnsmasq evaluates the schedule itself.
+// The lines for dnsmasq.conf go to /etc/dnsmasq.rrules, returns 1 if they changed since the last call.
+int dnsmasq_restrictions(void)
+{
+	FILE *f;
+	char buf[4096];
+	char *p, *q;
+	char *comps;
+	char *old, *new;
+	int n;
+	int nrule;
+	int sched_begin;
+	int sched_end;
+	int sched_dow;
+
+	if ((f = fopen("/etc/dnsmasq.rrules.new", "w")) == NULL) return 1;
+
+	for (nrule = 0; nrule < MAX_NRULES; ++nrule) {
+		sprintf(buf, "rrule%d_dnsbl", nrule);
+		if (((q = nvram_get(buf)) == NULL) || (*q == 0)) continue;
+
+		sprintf(buf, "rrule%d", nrule);
+		if ((p = nvram_get(buf)) == NULL) continue;
+		if (sscanf(p, "%d|%d|%d|%d|", &n, &sched_begin, &sched_end, &sched_dow) != 4) continue;
+		if (n == 0) continue;
+		if (strlen(p) >= sizeof(buf)) continue;
+		strcpy(buf, p);
+
+		if (vstrsep(buf, "|", &p, &p, &p, &p, &comps) != 5) continue;
+		if (comps[0] == '~') continue;	// wireless disable rule
+
+		fprintf(f, "blocklist=%s,r%02d\n"
+			"blocklist-rule=r%02d,%d,%d,%d",
+			q, nrule, nrule, sched_begin, sched_end, sched_dow);
+		while ((p = strsep(&comps, ">")) != NULL) {
+			if (*p) fprintf(f, ",%s", p);
+		}
+		fprintf(f, "\n");
+	}
+	fclose(f);
+
+	f_read_alloc_string("/etc/dnsmasq.rrules", &old, 64 * 1024);
+	f_read_alloc_string("/etc/dnsmasq.rrules.new", &new, 64 * 1024);
+	n = (new == NULL) || (strcmp(old ? old : "", new) != 0);
+	free(old);
+	free(new);
+	rename("/etc/dnsmasq.rrules.new", "/etc/dnsmasq.rrules");
+	return n;
+}
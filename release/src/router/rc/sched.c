@@ -6,163 +6,372 @@
 */
 
 #include <time.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include "rc.h"
 
 
 //	#define DLOG(args...) syslog(LOG_DEBUG, args)
 #define DLOG(args...) do { } while(0)
 
+#define SCHED_SOCK	"/var/run/sched.sock"
+#define SCHED_PID	"/var/run/sched.pid"
 
-static void unsched(const char *key)
+
+typedef struct {
+	const char *key;
+	time_t next;	// 0 = not scheduled
+	time_t last;
+	int heap;		// position in heap[], -1 if not there
+} sched_job_t;
+
+static sched_job_t jobs[] = {
+	{ "sch_rboot",	0, 0, -1 },
+	{ "sch_rcon",	0, 0, -1 },
+	{ "sch_c1",		0, 0, -1 },
+	{ "sch_c2",		0, 0, -1 },
+	{ "sch_c3",		0, 0, -1 },
+};
+#define NJOBS	(sizeof(jobs) / sizeof(jobs[0]))
+
+// min-heap on next, the first to run is always heap[0]
+static sched_job_t *heap[NJOBS];
+static int nheap;
+
+
+static void heap_swap(int a, int b)
 {
-	char s[64];
+	sched_job_t *j;
+
+	j = heap[a];
+	heap[a] = heap[b];
+	heap[b] = j;
+	heap[a]->heap = a;
+	heap[b]->heap = b;
+}
+
+static void heap_up(int i)
+{
+	int p;
+
+	while (i > 0) {
+		p = (i - 1) / 2;
+		if (heap[p]->next <= heap[i]->next) break;
+		heap_swap(i, p);
+		i = p;
+	}
+}
+
+static void heap_down(int i)
+{
+	int c;
 
-	DLOG("%s: %s", __FUNCTION__, key);
+	while ((c = (i * 2) + 1) < nheap) {
+		if ((c + 1 < nheap) && (heap[c + 1]->next < heap[c]->next)) ++c;
+		if (heap[i]->next <= heap[c]->next) break;
+		heap_swap(i, c);
+		i = c;
+	}
+}
+
+static void heap_remove(sched_job_t *j)
+{
+	int i;
 
-	sprintf(s, "cru d %s", key);
-	system(s);
+	if ((i = j->heap) < 0) return;
+	j->heap = -1;
+	if (i != --nheap) {
+		j = heap[nheap];
+		heap[i] = j;
+		j->heap = i;
+		heap_up(i);
+		heap_down(j->heap);
+	}
 }
 
-static void sched(const char *key, int resched)
+static void heap_add(sched_job_t *j)
+{
+	heap[nheap] = j;
+	j->heap = nheap;
+	heap_up(nheap++);
+}
+
+// next run after now, or 0 if disabled
+static time_t next_run(sched_job_t *j, time_t now)
 {
 	int en;
 	int t;
 	int dow;
-	char s[64];
-	char w[32];
 	int i;
 	struct tm tm;
-	long tt, qq;
+	time_t tt;
 
 	// en,time,days
-	if ((sscanf(nvram_safe_get(key), "%d,%d,%d", &en, &t, &dow) != 3) || (!en)) {
-		unsched(key);
-		return;
+	if ((sscanf(nvram_safe_get(j->key), "%d,%d,%d", &en, &t, &dow) != 3) || (!en)) return 0;
+
+	if ((dow & 0x7F) == 0) dow = 0x7F;
+
+	if (t >= 0) {	// specific time
+		for (i = 0; i <= 7; ++i) {
+			tm = *localtime(&now);
+			tm.tm_mday += i;
+			tm.tm_hour = t / 60;
+			tm.tm_min = t % 60;
+			tm.tm_sec = 0;
+			tm.tm_isdst = -1;
+			if (((tt = mktime(&tm)) > now) && (dow & (1 << tm.tm_wday))) return tt;
+		}
+		return 0;
 	}
 
-	DLOG("%s: %s", __FUNCTION__, key);
+	// every ...
+	t = -t * 60;
+	tt = ((j->last) && (j->last + t > now)) ? j->last : now;
+	tt += t;
 
-	if (resched) {
-		sprintf(s, "%s_last", key);
-		sprintf(w, "%ld", time(0));
-		nvram_set(s, w);
+	// skip to the start of the next allowed day
+	for (i = 0; i < 7; ++i) {
+		tm = *localtime(&tt);
+		if (dow & (1 << tm.tm_wday)) return tt;
+		tm.tm_mday += 1;
+		tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+		tm.tm_isdst = -1;
+		tt = mktime(&tm);
+	}
+	return 0;
+}
 
-		DLOG("%s: set %s=%s", __FUNCTION__, s, w);
+static void resched(sched_job_t *j, time_t now)
+{
+	heap_remove(j);
+	if ((j->next = next_run(j, now)) != 0) heap_add(j);
 
-		if (t >= -5) return;
+	DLOG("%s: %s next=%ld", __FUNCTION__, j->key, j->next);
+}
+
+static void resched_all(void)
+{
+	char s[64];
+	time_t now;
+	int i;
+
+	now = time(0);
+	for (i = 0; i < NJOBS; ++i) {
+		sprintf(s, "%s_last", jobs[i].key);
+		jobs[i].last = strtoul(nvram_safe_get(s), NULL, 10);
+		resched(&jobs[i], now);
 	}
+}
 
-	if ((dow & 0x7F) == 0) dow = 0x7F;
-	w[0] = 0;
-	w[1] = 0;
-	for (i = 0; i < 7; ++i) {
-		if (dow & (1 << i)) {
-			sprintf(w + strlen(w), ",%d", i);
+static void run_job(const char *key)
+{
+	int n;
+	char s[64];
+	int log;
+
+	log = nvram_contains_word("log_events", "sched");
+
+	wait_action_idle(5 * 60);
+
+	if (strcmp(key, "sch_rboot") == 0) {
+		syslog(LOG_INFO, "Performing scheduled %s...", "reboot");
+		system("reboot");
+	}
+	else if (strcmp(key, "sch_rcon") == 0) {
+		if (log) syslog(LOG_INFO, "Performing scheduled %s...", "reconnect");
+		system("service wan restart");
+	}
+	else if (strncmp(key, "sch_c", 5) == 0) {
+		n = atoi(key + 5);
+		if ((n >= 1) && (n <= 3)) {
+			if (log) {
+				sprintf(s, "custom #%d", n);
+				syslog(LOG_INFO, "Performing scheduled %s...", s);
+			}
+
+			sprintf(s, "%s_cmd", key);
+			DLOG("%s: run=%s", __FUNCTION__, nvram_safe_get(s));
+			run_nvscript(s, "", 60);
 		}
 	}
+}
 
-	if (t >= 0) {	// specific time
-		sprintf(s, "cru a %s \"%d %d * * %s sched %s\"", key, t % 60, t / 60, w + 1, key);
+static void start_job(sched_job_t *j, time_t now)
+{
+	char s[64];
+	char w[32];
+
+	DLOG("%s: %s", __FUNCTION__, j->key);
+
+	j->last = now;
+	sprintf(s, "%s_last", j->key);
+	sprintf(w, "%ld", now);
+	nvram_set(s, w);
+
+	// keep serving the socket while the job runs
+	if (fork() == 0) {
+		run_job(j->key);
+		_exit(0);
 	}
-	else {	// every ...
-		t = -t;
-		if (t <= 5) {	// 1 to 5m = a simple cron job
-			sprintf(s, "cru a %s \"*/%d * * * %s sched %s\"", key, t, w + 1, key);
-		}
-		else {
-			t *= 60;
-			DLOG("%s: t=%d", __FUNCTION__, t);
-
-			tt = time(0) + 59;
-			tm = *localtime(&tt);
-			DLOG("%s: now=%d:%02d %02d/%02d", __FUNCTION__, tm.tm_hour, tm.tm_min, tm.tm_mon + 1, tm.tm_mday);
-
-			sprintf(s, "%s_last", key);
-			DLOG("%s: %s_last=%s, tt=%ld", __FUNCTION__, key, nvram_safe_get(s), tt);
-			qq = strtoul(nvram_safe_get(s), NULL, 10);
-			if ((qq + t) > tt) tt = qq;
-
-			tt += t;
-			while (1) {
-				tm = *localtime(&tt);	// copy struct, otherwise we get weird stuff (!?)
-				DLOG("%s: %d:%02d %02d/%02d, tt=%ld", __FUNCTION__, tm.tm_hour, tm.tm_min, tm.tm_mon + 1, tm.tm_mday, tt);
-//				printf("%d:%02d %02d/%02d, w=%d, dow=%d, x=%d, tt=%ld\n", tm.tm_hour, tm.tm_min, tm.tm_mon + 1, tm.tm_mday, tm.tm_wday,
-//					dow, (dow & (1 << tm.tm_wday)), tt);
-				if (dow & (1 << tm.tm_wday)) break;
-				tt += 60;
-			}
 
-			sprintf(s, "cru a %s \"%d %d %d %d * sched %s\"", key, tm.tm_min, tm.tm_hour, tm.tm_mday, tm.tm_mon + 1, key);
+	resched(j, now);
+}
+
+static sched_job_t *find_job(const char *key)
+{
+	int i;
+
+	for (i = 0; i < NJOBS; ++i) {
+		if (strcmp(jobs[i].key, key) == 0) return &jobs[i];
+	}
+	return NULL;
+}
+
+static void do_control(int fd)
+{
+	struct timeval tv;
+	char buf[128];
+	int n;
+	int i;
+	sched_job_t *j;
+	FILE *f;
+
+	tv.tv_sec = 5;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	if ((n = read(fd, buf, sizeof(buf) - 1)) <= 0) {
+		close(fd);
+		return;
+	}
+	buf[n] = 0;
+	buf[strcspn(buf, "\r\n")] = 0;
+
+	if ((f = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		return;
+	}
+
+	if (strcmp(buf, "status") == 0) {
+		// key next last
+		for (i = 0; i < NJOBS; ++i) {
+			fprintf(f, "%s %ld %ld\n", jobs[i].key, jobs[i].next, jobs[i].last);
 		}
 	}
+	else if (strcmp(buf, "reload") == 0) {
+		resched_all();
+		fprintf(f, "ok\n");
+	}
+	else if ((strncmp(buf, "run ", 4) == 0) && ((j = find_job(buf + 4)) != NULL)) {
+		start_job(j, time(0));
+		fprintf(f, "ok\n");
+	}
+	else {
+		fprintf(f, "error\n");
+	}
+	fclose(f);
+}
 
-	DLOG("%s: %s", __FUNCTION__, s);
+static int sched_query(const char *cmd)
+{
+	struct sockaddr_un sa;
+	char buf[256];
+	int fd;
+	int n;
 
-	system(s);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return 0;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, SCHED_SOCK);
+	if ((connect(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) || (write(fd, cmd, strlen(cmd)) != strlen(cmd))) {
+		close(fd);
+		return 0;
+	}
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		fwrite(buf, n, 1, stdout);
+	}
+	close(fd);
+	return 1;
 }
 
-static inline int is_sched(const char *key)
+static void sched_daemon(void)
 {
-	return *nvram_safe_get(key) == '1';
+	struct sockaddr_un sa;
+	struct timeval tv;
+	fd_set rfds;
+	int sfd;
+	int fd;
+	time_t now;
+	time_t prev;
+	sched_job_t *j;
+	char s[32];
+
+	while (time(0) < Y2K) {
+		sleep(1);
+	}
+
+	if ((sfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return;
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, SCHED_SOCK);
+	unlink(SCHED_SOCK);
+	if ((bind(sfd, (struct sockaddr *)&sa, sizeof(sa)) != 0) || (listen(sfd, 5) != 0)) {
+		syslog(LOG_ERR, "Unable to create %s", SCHED_SOCK);
+		close(sfd);
+		sfd = -1;
+	}
+
+	signal(SIGCHLD, handle_reap);
+
+	// jobs run in children named "sched" too, so stop_sched() goes by pid
+	sprintf(s, "%d", getpid());
+	f_write_string(SCHED_PID, s, 0, 0644);
+
+	resched_all();
+
+	prev = time(0);
+	while (1) {
+		now = time(0);
+
+		// the clock was set, work everything out again
+		if ((now < prev - 60) || (now > prev + 120)) resched_all();
+		prev = now;
+
+		while ((nheap > 0) && ((j = heap[0])->next <= now)) {
+			start_job(j, now);
+		}
+
+		// wake up at least once a minute to notice clock changes
+		tv.tv_sec = 60;
+		if ((nheap > 0) && (heap[0]->next - now < 60)) tv.tv_sec = heap[0]->next - now;
+		tv.tv_usec = 0;
+
+		FD_ZERO(&rfds);
+		if (sfd >= 0) FD_SET(sfd, &rfds);
+		if (select(sfd + 1, &rfds, NULL, NULL, &tv) <= 0) continue;
+
+		if ((fd = accept(sfd, NULL, NULL)) >= 0) do_control(fd);
+	}
 }
 
 int sched_main(int argc, char *argv[])
 {
-	int n;
 	char s[64];
-	int log;
 
 	if (argc == 2) {
 		DLOG("%s: %s", __FUNCTION__, argv[1]);
 
-		log = nvram_contains_word("log_events", "sched");
-
 		if (strncmp(argv[1], "sch_", 4) == 0) {
-			wait_action_idle(5 * 60);
-
-			if (is_sched(argv[1])) {
-				if (strcmp(argv[1], "sch_rboot") == 0) {
-					syslog(LOG_INFO, "Performing scheduled %s...", "reboot");
-					system("reboot");
-					return 0;
-				}
-				else if (strcmp(argv[1], "sch_rcon") == 0) {
-					sched(argv[1], 1);
-					if (log) syslog(LOG_INFO, "Performing scheduled %s...", "reconnect");
-					system("service wan restart");
-				}
-				else if (strncmp(argv[1], "sch_c", 5) == 0) {
-					n = atoi(argv[1] + 5);
-					if ((n >= 1) && (n <= 3)) {
-						sched(argv[1], 1);
-
-						if (log) {
-							sprintf(s, "custom #%d", n);
-							syslog(LOG_INFO, "Performing scheduled %s...", s);
-						}
-
-						signal(SIGCHLD, handle_reap);
-
-						sprintf(s, "%s_cmd", argv[1]);
-						DLOG("%s: run=%s", __FUNCTION__, nvram_safe_get(s));
-						run_nvscript(s, "", 60);
-					}
-				}
-			}
-			else {
-				unsched(argv[1]);
-			}
+			sprintf(s, "run %s\n", argv[1]);
+			if (!sched_query(s)) run_job(argv[1]);
+		}
+		else if (strcmp(argv[1], "status") == 0) {
+			return !sched_query("status\n");
 		}
 		else if (strcmp(argv[1], "start") == 0) {
-			while (time(0) < Y2K) {
-				sleep(1);
-			}
-
-			sched("sch_rboot", 0);
-			sched("sch_rcon", 0);
-			sched("sch_c1", 0);
-			sched("sch_c2", 0);
-			sched("sch_c3", 0);
+			sched_daemon();
 		}
 	}
 
@@ -173,18 +382,20 @@ void start_sched(void)
 {
 	DLOG("%s", __FUNCTION__);
 
-	killall("sched", SIGTERM);
+	stop_sched();
 	xstart("sched", "start");
 }
 
 void stop_sched(void)
 {
+	char s[32];
+	int pid;
+
 	DLOG("%s", __FUNCTION__);
 
-	killall("sched", SIGTERM);
-	unsched("sch_rboot");
-	unsched("sch_rcon");
-	unsched("sch_sc1");
-	unsched("sch_sc2");
-	unsched("sch_sc3");
+	if (f_read_string(SCHED_PID, s, sizeof(s)) > 0) {
+		if ((pid = atoi(s)) > 1) kill(pid, SIGTERM);
+	}
+	unlink(SCHED_PID);
+	unlink(SCHED_SOCK);
 }
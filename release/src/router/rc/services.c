@@ -242,6 +242,16 @@ void start_dnsmasq()
 
 	if (hf) fclose(hf);
 
+	// dns blocklists
+	if (((nv = nvram_get("dnsbl_file")) != NULL) && (*nv)) {
+		fprintf(f, "blocklist=%s\n", nv);
+	}
+	dnsmasq_restrictions();
+	fappend(f, "/etc/dnsmasq.rrules");
+	if (nvram_match("dnsbl_null", "1")) {
+		fprintf(f, "blocklist-reply=null\n");
+	}
+
 	//
 
 	fprintf(f, "%s\n\n", nvram_safe_get("dnsmasq_custom"));
@@ -710,12 +720,14 @@ void start_services(void)
 //	start_upnp();
 	start_rstats(0);
 	start_sched();
+	start_wlsta();
 }
 
 void stop_services(void)
 {
 	clear_resolv();
 
+	stop_wlsta();
 	stop_sched();
 	stop_rstats();
 //	stop_upnp();
@@ -736,14 +748,19 @@ void exec_service(void)
 	const int A_STOP = 2;
 	const int A_RESTART = 1|2;
 	char buffer[128];
+	char done[128];
+	char s[64];
 	char *service;
 	char *act;
 	char *next;
 	int action;
 	int i;
+	int fw_last, fw;
 
 	strlcpy(buffer, nvram_safe_get("action_service"), sizeof(buffer));
 	next = buffer;
+	done[0] = 0;
+	fw = 0;
 
 TOP:
 	act = strsep(&next, ",");
@@ -755,6 +772,18 @@ TOP:
 
 	TRACE_PT("service=%s action=%s\n", service, act);
 
+	// the firewall was just restarted by the one before this
+	fw_last = fw;
+	fw = 0;
+
+	// repeats only need doing once
+	snprintf(s, sizeof(s), "%s-%s", service, act);
+	if (find_word(done, s)) goto CLEAR;
+	if (strlen(done) + strlen(s) + 2 <= sizeof(done)) {
+		if (done[0]) strcat(done, ",");
+		strcat(done, s);
+	}
+
 	if (strcmp(act, "start") == 0) action = A_START;
 		else if (strcmp(act, "stop") == 0) action = A_STOP;
 		else if (strcmp(act, "restart") == 0) action = A_RESTART;
@@ -777,6 +806,11 @@ TOP:
 	}
 
 	if (strcmp(service, "firewall") == 0) {
+		if ((action == A_RESTART) && (fw_last)) {
+			stop_igmp_proxy();
+			start_igmp_proxy();
+			goto CLEAR;
+		}
 		if (action & A_STOP) {
 			stop_firewall();
 			stop_igmp_proxy();
@@ -784,6 +818,7 @@ TOP:
 		if (action & A_START) {
 			start_firewall();
 			start_igmp_proxy();
+			fw = 1;
 		}
 		goto CLEAR;
 	}
@@ -796,6 +831,7 @@ TOP:
 			i = nvram_get_int("rrules_radio");	// -1 = not used, 0 = enabled by rule, 1 = disabled by rule
 
 			start_firewall();
+			fw = 1;
 
 			// if radio was disabled by access restriction, but no rule is handling it now, enable it
 			if (i == 1) {
@@ -803,6 +839,9 @@ TOP:
 					if (!get_radio()) eval("radio", "on");
 				}
 			}
+
+			// restart dnsmasq only if the rrule##_dnsbl blocklists changed
+			if (dnsmasq_restrictions()) start_dnsmasq();
 		}
 		goto CLEAR;
 	}
@@ -812,6 +851,7 @@ TOP:
 			stop_qos();
 		}
 		stop_firewall(); start_firewall();		// always restarted
+		fw = 1;
 		if (action & A_START) {
 			start_qos();
 			if (nvram_match("qos_reset", "1")) f_write_string("/proc/net/clear_marks", "1", 0, 0);
@@ -824,6 +864,7 @@ TOP:
 			stop_upnp();
 		}
 		stop_firewall(); start_firewall();		// always restarted
+		fw = 1;
 		if (action & A_START) {
 			start_upnp();
 		}
@@ -855,6 +896,7 @@ TOP:
 			stop_httpd();
 		}
 		stop_firewall(); start_firewall();		// always restarted
+		fw = 1;
 		if (action & A_START) {
 			start_httpd();
 			create_passwd();
@@ -882,6 +924,7 @@ TOP:
 			stop_cron();
 		}
 		stop_firewall(); start_firewall();		// always restarted
+		fw = 1;
 		if (action & A_START) {
 			start_cron();
 			start_syslog();
@@ -38,13 +38,13 @@
 
 #include <sys/ioctl.h>
 #include <arpa/inet.h>
+#include <linux/rtnetlink.h>
 #include <sys/sysinfo.h>
 #include <time.h>
 #include <bcmdevs.h>
 
 
 #define IFUP (IFF_UP | IFF_RUNNING | IFF_BROADCAST | IFF_MULTICAST)
-#define sin_addr(s) (((struct sockaddr_in *)(s))->sin_addr)
 
 
 static void make_secrets(void)
@@ -185,13 +185,49 @@ int stop_pptp(void)
 // -----------------------------------------------------------------------------
 
 
+// wait up to timeout seconds for an address on ifname
+static int wait_addr(const char *ifname, rtnl_addr_t *addr, int timeout)
+{
+	rtnl_addr_t *list;
+	rtnl_event_t ev;
+	time_t end;
+	int fd;
+	int i, n;
+	int r;
+
+	memset(addr, 0, sizeof(*addr));
+	r = 0;
+
+	// listen before looking, so one that's added in between isn't missed
+	fd = rtnl_open(RTMGRP_IPV4_IFADDR);
+
+	n = rtnl_addr(&list);
+	for (i = 0; i < n; ++i) {
+		if (strcmp(list[i].ifname, ifname) == 0) {
+			*addr = list[i];
+			r = 1;
+			break;
+		}
+	}
+	free(list);
+
+	end = time(0) + timeout;
+	while ((!r) && (fd >= 0) && (time(0) < end) && (rtnl_event(fd, &ev, (end - time(0)) * 1000) > 0)) {
+		if ((ev.type == RTM_NEWADDR) && (strcmp(ev.u.addr.ifname, ifname) == 0)) {
+			*addr = ev.u.addr;
+			r = 1;
+		}
+	}
+	if (fd >= 0) close(fd);
+	return r;
+}
+
 // Get the IP, Subnetmask, Geteway from WAN interface and set nvram
 static void start_tmp_ppp(int num)
 {
 	int timeout;
 	char *ifname;
-	struct ifreq ifr;
-	int s;
+	rtnl_addr_t addr;
 
 	_dprintf("%s: num=%d\n", __FUNCTION__, num);
 
@@ -204,27 +240,13 @@ static void start_tmp_ppp(int num)
 		_dprintf("[%d] waiting for %s %d...\n", __LINE__, ifname, timeout);
 	}
 
-	if ((s = socket(AF_INET, SOCK_RAW, IPPROTO_RAW)) < 0) return;
-	strlcpy(ifr.ifr_name, ifname, IFNAMSIZ);
-
-	// Set temporary IP address
-	timeout = 3;
-	while (ioctl(s, SIOCGIFADDR, &ifr) && timeout--){
-		_dprintf("[%d] waiting for %s...\n", __LINE__, ifname);
-		sleep(1);
-	};
-	nvram_set("wan_ipaddr", inet_ntoa(sin_addr(&(ifr.ifr_addr))));
-	nvram_set("wan_netmask", "255.255.255.255");
-
-	// Set temporary P-t-P address
-	timeout = 3;
-	while (ioctl(s, SIOCGIFDSTADDR, &ifr) && timeout--){
-		_dprintf("[%d] waiting for %s...\n", __LINE__, ifname);
-		sleep(1);
+	// Set temporary IP and P-t-P addresses
+	if (!wait_addr(ifname, &addr, 3)) {
+		_dprintf("[%d] no address on %s\n", __LINE__, ifname);
 	}
-	nvram_set("wan_gateway", inet_ntoa(sin_addr(&(ifr.ifr_dstaddr))));
-	
-	close(s);
+	nvram_set("wan_ipaddr", inet_ntoa(addr.local));
+	nvram_set("wan_netmask", "255.255.255.255");
+	nvram_set("wan_gateway", inet_ntoa(addr.address));
 
 	start_wan_done(ifname);
 }
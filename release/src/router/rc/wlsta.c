@@ -0,0 +1,103 @@
+/*
+
+	Tomato Firmware
+	Copyright (C) 2006-2009 Jonathan Zarate
+
+*/
+
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "rc.h"
+
+
+//	#define DLOG(args...) syslog(LOG_DEBUG, args)
+#define DLOG(args...) do { } while(0)
+
+#define MAX_AGE		3		// seconds a list is good for
+#define ACTIVE		60		// keep it fresh this long after the last query
+
+
+static wlsta_t sta[WLSTA_MAX];
+static int nsta;
+static long collected = -MAX_AGE;
+static long asked = -ACTIVE;
+
+
+static void collect(long now)
+{
+	if ((nsta = wlsta_collect(nvram_safe_get("wl0_ifname"), sta, WLSTA_MAX)) < 0) nsta = 0;
+	collected = now;
+
+	DLOG("%s: %d stations", __FUNCTION__, nsta);
+}
+
+/*
+	The driver here has no association events for userspace, so the list is
+	refreshed every MAX_AGE seconds while the Device List is being watched,
+	and collected on demand if it's older than that. Clients get the whole
+	array of wlsta_t and then EOF, see wlsta_get().
+*/
+int wlsta_main(int argc, char *argv[])
+{
+	struct sockaddr_un sa;
+	struct timeval tv;
+	fd_set rfds;
+	int sfd;
+	int fd;
+	long now;
+	int n, r;
+	char *p;
+
+	if ((sfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return 1;
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, WLSTA_SOCK);
+	unlink(WLSTA_SOCK);
+	if ((bind(sfd, (struct sockaddr *)&sa, sizeof(sa)) != 0) || (listen(sfd, 5) != 0)) {
+		syslog(LOG_ERR, "Unable to create %s", WLSTA_SOCK);
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	while (1) {
+		now = get_uptime();
+		if ((now - asked < ACTIVE) && (now - collected >= MAX_AGE)) collect(now);
+
+		FD_ZERO(&rfds);
+		FD_SET(sfd, &rfds);
+		tv.tv_sec = MAX_AGE;
+		tv.tv_usec = 0;
+		if (select(sfd + 1, &rfds, NULL, NULL, (now - asked < ACTIVE) ? &tv : NULL) <= 0) continue;
+		if ((fd = accept(sfd, NULL, NULL)) < 0) continue;
+
+		now = get_uptime();
+		if (now - collected >= MAX_AGE) collect(now);
+		asked = now;
+
+		tv.tv_sec = 5;
+		tv.tv_usec = 0;
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		p = (char *)sta;
+		n = nsta * sizeof(sta[0]);
+		while (n > 0) {
+			if ((r = write(fd, p, n)) <= 0) break;
+			p += r;
+			n -= r;
+		}
+		close(fd);
+	}
+}
+
+void start_wlsta(void)
+{
+	killall("wlsta", SIGTERM);
+	xstart("wlsta");
+}
+
+void stop_wlsta(void)
+{
+	killall("wlsta", SIGTERM);
+	unlink(WLSTA_SOCK);
+}
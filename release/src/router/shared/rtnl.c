@@ -0,0 +1,337 @@
+/*
+
+	Tomato Firmware
+	Copyright (C) 2006-2009 Jonathan Zarate
+
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include "shared.h"
+
+
+//	rtnetlink: reads the neighbour, route, link and address tables as arrays
+//	of structs instead of parsing the text in /proc/net, and waits for
+//	changes to them.
+
+// the attributes that follow a message header of type hdr
+#define RTNL_RTA(nlh, hdr)		((struct rtattr *)((char *)NLMSG_DATA(nlh) + NLMSG_ALIGN(sizeof(hdr))))
+#define RTNL_PAYLOAD(nlh, hdr)	((int)(nlh)->nlmsg_len - (int)NLMSG_LENGTH(sizeof(hdr)))
+
+typedef int (*rtnl_parse_t)(struct nlmsghdr *nlh, void *item);
+
+
+int rtnl_open(unsigned int groups)
+{
+	struct sockaddr_nl sa;
+	int fd;
+
+	if ((fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE)) < 0) return -1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	sa.nl_groups = groups;
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void rta_parse(struct rtattr **tb, int max, struct rtattr *rta, int len)
+{
+	memset(tb, 0, sizeof(*tb) * (max + 1));
+	while (RTA_OK(rta, len)) {
+		if (rta->rta_type <= max) tb[rta->rta_type] = rta;
+		rta = RTA_NEXT(rta, len);
+	}
+}
+
+static void rta_addr(struct in_addr *a, struct rtattr *rta)
+{
+	if ((rta) && (RTA_PAYLOAD(rta) >= sizeof(*a))) memcpy(a, RTA_DATA(rta), sizeof(*a));
+}
+
+static void rta_name(char *name, struct rtattr *rta)
+{
+	if (rta) {
+		snprintf(name, 16, "%.*s", (int)RTA_PAYLOAD(rta), (char *)RTA_DATA(rta));
+	}
+}
+
+static int parse_link(struct nlmsghdr *nlh, void *item)
+{
+	rtnl_link_t *l = item;
+	struct ifinfomsg *ifi = NLMSG_DATA(nlh);
+	struct rtattr *tb[IFLA_MAX + 1];
+
+	if (RTNL_PAYLOAD(nlh, *ifi) < 0) return 0;
+	rta_parse(tb, IFLA_MAX, RTNL_RTA(nlh, *ifi), RTNL_PAYLOAD(nlh, *ifi));
+
+	memset(l, 0, sizeof(*l));
+	l->ifindex = ifi->ifi_index;
+	l->flags = ifi->ifi_flags;
+	if ((tb[IFLA_MTU]) && (RTA_PAYLOAD(tb[IFLA_MTU]) >= sizeof(l->mtu))) memcpy(&l->mtu, RTA_DATA(tb[IFLA_MTU]), sizeof(l->mtu));
+	if ((tb[IFLA_ADDRESS]) && (RTA_PAYLOAD(tb[IFLA_ADDRESS]) == sizeof(l->mac))) memcpy(l->mac, RTA_DATA(tb[IFLA_ADDRESS]), sizeof(l->mac));
+	rta_name(l->ifname, tb[IFLA_IFNAME]);
+	return 1;
+}
+
+static int parse_addr(struct nlmsghdr *nlh, void *item)
+{
+	rtnl_addr_t *a = item;
+	struct ifaddrmsg *ifa = NLMSG_DATA(nlh);
+	struct rtattr *tb[IFA_MAX + 1];
+
+	if ((RTNL_PAYLOAD(nlh, *ifa) < 0) || (ifa->ifa_family != AF_INET)) return 0;
+	rta_parse(tb, IFA_MAX, RTNL_RTA(nlh, *ifa), RTNL_PAYLOAD(nlh, *ifa));
+
+	memset(a, 0, sizeof(*a));
+	a->ifindex = ifa->ifa_index;
+	a->prefixlen = ifa->ifa_prefixlen;
+	// IFA_ADDRESS is the peer on point-to-point links
+	rta_addr(&a->local, tb[IFA_LOCAL] ? tb[IFA_LOCAL] : tb[IFA_ADDRESS]);
+	rta_addr(&a->address, tb[IFA_ADDRESS] ? tb[IFA_ADDRESS] : tb[IFA_LOCAL]);
+	rta_addr(&a->broadcast, tb[IFA_BROADCAST]);
+	rta_name(a->ifname, tb[IFA_LABEL]);
+	return 1;
+}
+
+static int parse_route(struct nlmsghdr *nlh, void *item)
+{
+	rtnl_route_t *r = item;
+	struct rtmsg *rtm = NLMSG_DATA(nlh);
+	struct rtattr *tb[RTA_MAX + 1];
+
+	if ((RTNL_PAYLOAD(nlh, *rtm) < 0) || (rtm->rtm_family != AF_INET)) return 0;
+	rta_parse(tb, RTA_MAX, RTNL_RTA(nlh, *rtm), RTNL_PAYLOAD(nlh, *rtm));
+
+	memset(r, 0, sizeof(*r));
+	r->dst_len = rtm->rtm_dst_len;
+	r->table = rtm->rtm_table;
+	r->protocol = rtm->rtm_protocol;
+	r->scope = rtm->rtm_scope;
+	r->type = rtm->rtm_type;
+	rta_addr(&r->dst, tb[RTA_DST]);
+	rta_addr(&r->gateway, tb[RTA_GATEWAY]);
+	rta_addr(&r->prefsrc, tb[RTA_PREFSRC]);
+	if ((tb[RTA_PRIORITY]) && (RTA_PAYLOAD(tb[RTA_PRIORITY]) >= sizeof(r->metric))) memcpy(&r->metric, RTA_DATA(tb[RTA_PRIORITY]), sizeof(r->metric));
+	if ((tb[RTA_OIF]) && (RTA_PAYLOAD(tb[RTA_OIF]) >= sizeof(r->ifindex))) memcpy(&r->ifindex, RTA_DATA(tb[RTA_OIF]), sizeof(r->ifindex));
+	return 1;
+}
+
+static int parse_neigh(struct nlmsghdr *nlh, void *item)
+{
+	rtnl_neigh_t *n = item;
+	struct ndmsg *ndm = NLMSG_DATA(nlh);
+	struct rtattr *tb[NDA_MAX + 1];
+
+	if ((RTNL_PAYLOAD(nlh, *ndm) < 0) || (ndm->ndm_family != AF_INET)) return 0;
+	rta_parse(tb, NDA_MAX, RTNL_RTA(nlh, *ndm), RTNL_PAYLOAD(nlh, *ndm));
+	if (tb[NDA_DST] == NULL) return 0;
+
+	memset(n, 0, sizeof(*n));
+	n->ifindex = ndm->ndm_ifindex;
+	n->state = ndm->ndm_state;
+	rta_addr(&n->addr, tb[NDA_DST]);
+	if ((tb[NDA_LLADDR]) && (RTA_PAYLOAD(tb[NDA_LLADDR]) == sizeof(n->mac))) memcpy(n->mac, RTA_DATA(tb[NDA_LLADDR]), sizeof(n->mac));
+	return 1;
+}
+
+// returns the number of items in the malloc'd *list, or -1
+static int rtnl_dump(int type, rtnl_parse_t parse, int size, void **list)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct rtgenmsg g;
+	} req;
+	struct sockaddr_nl sa;
+	struct nlmsghdr *nlh;
+	char buf[16 * 1024];
+	char *items, *p;
+	int fd;
+	int len;
+	int n, max;
+
+	*list = NULL;
+	if ((fd = rtnl_open(0)) < 0) return -1;
+
+	memset(&req, 0, sizeof(req));
+	req.nlh.nlmsg_len = sizeof(req);
+	req.nlh.nlmsg_type = type;
+	req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ROOT | NLM_F_MATCH;
+	req.nlh.nlmsg_seq = time(0);
+	req.g.rtgen_family = AF_INET;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+
+	items = NULL;
+	n = max = 0;
+	if (sendto(fd, &req, sizeof(req), 0, (struct sockaddr *)&sa, sizeof(sa)) < 0) goto ERROR;
+
+	while (1) {
+		if ((len = recv(fd, buf, sizeof(buf), 0)) < 0) {
+			if (errno == EINTR) continue;
+			goto ERROR;
+		}
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+			if (nlh->nlmsg_seq != req.nlh.nlmsg_seq) continue;
+			if (nlh->nlmsg_type == NLMSG_DONE) goto DONE;
+			if (nlh->nlmsg_type == NLMSG_ERROR) goto ERROR;
+			if (n == max) {
+				max = max ? (max * 2) : 64;
+				if ((p = realloc(items, max * size)) == NULL) goto ERROR;
+				items = p;
+			}
+			if (parse(nlh, items + (n * size))) ++n;
+		}
+	}
+
+DONE:
+	close(fd);
+	*list = items;
+	return n;
+
+ERROR:
+	close(fd);
+	free(items);
+	return -1;
+}
+
+int rtnl_link(rtnl_link_t **list)
+{
+	return rtnl_dump(RTM_GETLINK, parse_link, sizeof(**list), (void **)list);
+}
+
+int rtnl_addr(rtnl_addr_t **list)
+{
+	return rtnl_dump(RTM_GETADDR, parse_addr, sizeof(**list), (void **)list);
+}
+
+// neighbours and routes only have the ifindex, names come from one link dump
+static void set_ifname(char *ifname, int ifindex, rtnl_link_t *links, int nlinks)
+{
+	int i;
+
+	for (i = 0; i < nlinks; ++i) {
+		if (links[i].ifindex == ifindex) {
+			strcpy(ifname, links[i].ifname);
+			return;
+		}
+	}
+	if ((ifindex <= 0) || (if_indextoname(ifindex, ifname) == NULL)) ifname[0] = 0;
+}
+
+int rtnl_route(rtnl_route_t **list)
+{
+	rtnl_link_t *links;
+	int nlinks;
+	int i, n;
+
+	if ((n = rtnl_dump(RTM_GETROUTE, parse_route, sizeof(**list), (void **)list)) > 0) {
+		nlinks = rtnl_link(&links);
+		for (i = 0; i < n; ++i) set_ifname((*list)[i].ifname, (*list)[i].ifindex, links, nlinks);
+		free(links);
+	}
+	return n;
+}
+
+int rtnl_neigh(rtnl_neigh_t **list)
+{
+	rtnl_link_t *links;
+	int nlinks;
+	int i, n;
+
+	if ((n = rtnl_dump(RTM_GETNEIGH, parse_neigh, sizeof(**list), (void **)list)) > 0) {
+		nlinks = rtnl_link(&links);
+		for (i = 0; i < n; ++i) set_ifname((*list)[i].ifname, (*list)[i].ifindex, links, nlinks);
+		free(links);
+	}
+	return n;
+}
+
+/*
+	Waits up to timeout milliseconds (-1 = forever) for a change on a socket
+	from rtnl_open(RTMGRP_...). Returns 1 and the change in ev, 0 on timeout
+	or -1 on error. The kernel sends one change per datagram.
+*/
+int rtnl_event(int fd, rtnl_event_t *ev, int timeout)
+{
+	struct timeval tv;
+	struct timeval end;
+	fd_set rfds;
+	struct nlmsghdr *nlh;
+	char buf[4096];
+	int len;
+	int r;
+
+	gettimeofday(&end, NULL);
+	end.tv_sec += timeout / 1000;
+	end.tv_usec += (timeout % 1000) * 1000;
+	if (end.tv_usec >= 1000000) {
+		++end.tv_sec;
+		end.tv_usec -= 1000000;
+	}
+
+	while (1) {
+		if (timeout >= 0) {
+			gettimeofday(&tv, NULL);
+			tv.tv_sec = end.tv_sec - tv.tv_sec;
+			tv.tv_usec = end.tv_usec - tv.tv_usec;
+			if (tv.tv_usec < 0) {
+				--tv.tv_sec;
+				tv.tv_usec += 1000000;
+			}
+			if (tv.tv_sec < 0) return 0;
+		}
+		FD_ZERO(&rfds);
+		FD_SET(fd, &rfds);
+		if ((r = select(fd + 1, &rfds, NULL, NULL, (timeout >= 0) ? &tv : NULL)) == 0) return 0;
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+
+		if ((len = recv(fd, buf, sizeof(buf), 0)) < 0) {
+			if ((errno == EINTR) || (errno == ENOBUFS)) continue;
+			return -1;
+		}
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+			ev->type = nlh->nlmsg_type;
+			switch (nlh->nlmsg_type) {
+			case RTM_NEWLINK:
+			case RTM_DELLINK:
+				if (parse_link(nlh, &ev->u.link)) return 1;
+				break;
+			case RTM_NEWADDR:
+			case RTM_DELADDR:
+				if (parse_addr(nlh, &ev->u.addr)) return 1;
+				break;
+			case RTM_NEWROUTE:
+			case RTM_DELROUTE:
+				if (parse_route(nlh, &ev->u.route)) {
+					set_ifname(ev->u.route.ifname, ev->u.route.ifindex, NULL, 0);
+					return 1;
+				}
+				break;
+			case RTM_NEWNEIGH:
+			case RTM_DELNEIGH:
+				if (parse_neigh(nlh, &ev->u.neigh)) {
+					set_ifname(ev->u.neigh.ifname, ev->u.neigh.ifindex, NULL, 0);
+					return 1;
+				}
+				break;
+			}
+		}
+	}
+}
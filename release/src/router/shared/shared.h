@@ -194,5 +194,107 @@ extern int base64_decoded_len(int len);										// maximum possible, not actual
 // strings.c
 extern const char *find_word(const char *buffer, const char *word);
 extern int remove_word(char *buffer, const char *word);
+#if !defined(__UCLIBC__) && defined(__GLIBC__) && !__GLIBC_PREREQ(2, 38)
+extern size_t strlcpy(char *dst, const char *src, size_t size);		// host builds only, see wlsta_stub.c
+#endif
+
+
+// trx.c
+#define TRX_MORE		0
+#define TRX_OK			1
+#define TRX_BAD_HEADER	-1
+#define TRX_BAD_CRC		-2
+
+typedef struct {
+	int result;
+	int skip;					// vendor header before the trx header, -1 if not known yet
+	int have;
+	int need;
+	uint8_t hdr[64];
+	uint32_t len;				// trx length, from the header
+	uint32_t crc32;
+	uint32_t crc;
+	uint32_t left;				// bytes still to be checked
+	uint32_t crc_table[256];
+} trx_check_t;
+
+extern void trx_check_init(trx_check_t *t);
+extern int trx_check(trx_check_t *t, const void *buf, int len);
+
+
+// wlsta.c
+#define WLSTA_MAX		256
+#define WLSTA_SOCK		"/var/run/wlsta.sock"
+
+typedef struct {
+	char ifname[16];			// wl0_ifname, or the wds interface
+	uint8_t mac[6];
+	int16_t rssi;
+	uint32_t max_rate;			// kbps, the highest in the rateset; sta_info has no current rate
+	uint32_t idle;				// seconds since data was received
+	uint32_t in;				// seconds since associated
+	uint32_t flags;				// WL_STA_*
+} wlsta_t;
+
+extern int wlsta_collect(char *wlif, wlsta_t *sta, int max);
+extern int wlsta_get(char *wlif, wlsta_t *sta, int max);
+
+
+// rtnl.c
+typedef struct {
+	int ifindex;
+	unsigned int flags;			// IFF_*
+	unsigned int mtu;
+	uint8_t mac[6];
+	char ifname[16];
+} rtnl_link_t;
+
+typedef struct {
+	int ifindex;
+	struct in_addr local;
+	struct in_addr address;		// the peer on point-to-point links, else = local
+	struct in_addr broadcast;
+	uint8_t prefixlen;
+	char ifname[16];			// label, eth0:1 for an alias
+} rtnl_addr_t;
+
+typedef struct {
+	struct in_addr dst;
+	struct in_addr gateway;
+	struct in_addr prefsrc;
+	uint8_t dst_len;
+	uint8_t table;				// RT_TABLE_*
+	uint8_t protocol;			// RTPROT_*
+	uint8_t scope;				// RT_SCOPE_*
+	uint8_t type;				// RTN_*
+	uint32_t metric;
+	int ifindex;
+	char ifname[16];
+} rtnl_route_t;
+
+typedef struct {
+	struct in_addr addr;
+	uint8_t mac[6];				// 0 if not known
+	uint16_t state;				// NUD_*
+	int ifindex;
+	char ifname[16];
+} rtnl_neigh_t;
+
+typedef struct {
+	int type;					// RTM_NEWLINK, RTM_DELADDR, ...
+	union {
+		rtnl_link_t link;
+		rtnl_addr_t addr;
+		rtnl_route_t route;
+		rtnl_neigh_t neigh;
+	} u;
+} rtnl_event_t;
+
+extern int rtnl_open(unsigned int groups);
+extern int rtnl_link(rtnl_link_t **list);
+extern int rtnl_addr(rtnl_addr_t **list);
+extern int rtnl_route(rtnl_route_t **list);
+extern int rtnl_neigh(rtnl_neigh_t **list);
+extern int rtnl_event(int fd, rtnl_event_t *ev, int timeout);
 
 #endif
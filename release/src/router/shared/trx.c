@@ -0,0 +1,119 @@
+/*
+
+	Tomato Firmware
+	Copyright (C) 2006-2009 Jonathan Zarate
+
+*/
+#include <string.h>
+#include <stdint.h>
+#include <typedefs.h>
+#include <bcmutils.h>
+#include <trxhdr.h>
+
+#include "shared.h"
+
+
+//	Checks a firmware image as it arrives: finds the TRX header behind
+//	any vendor header, then runs the CRC over the image so that a bad
+//	file is known before anything is committed.
+
+void trx_check_init(trx_check_t *t)
+{
+	uint32_t c;
+	int i, j;
+
+	memset(t, 0, sizeof(*t));
+	t->skip = -1;
+	t->need = 8;
+	for (i = 255; i >= 0; --i) {
+		c = i;
+		for (j = 8; j > 0; --j) {
+			if (c & 1) c = (c >> 1) ^ 0xEDB88320L;
+				else c >>= 1;
+		}
+		t->crc_table[i] = c;
+	}
+}
+
+static void trx_crc(trx_check_t *t, const uint8_t *p, int len)
+{
+	uint32_t crc = t->crc;
+
+	while (len-- > 0) {
+		crc = t->crc_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	}
+	t->crc = crc;
+}
+
+static int trx_header(trx_check_t *t)
+{
+	uint32_t sig;
+	struct trx_header trx;
+
+	if (t->skip < 0) {
+		memcpy(&sig, t->hdr, sizeof(sig));
+		switch (sig) {
+		case 0x47343557: // W54G	G, GL
+		case 0x53343557: // W54S	GS
+		case 0x73343557: // W54s	GS v4
+		case 0x55343557: // W54U	SL
+		case 0x31345257: // WR41	WRH54G
+#if TOMATO_N
+		case 0x42435745: // EWCB	WRT300N v1
+		case 0x3035314E: // N150	WRT150N
+#endif
+			t->skip = 32;	// code header
+			break;
+		case TRX_MAGIC:
+			t->skip = 0;
+			break;
+		default:
+			memcpy(&sig, t->hdr + 4, sizeof(sig));
+			if (sig != 0x50705710) return TRX_BAD_HEADER;	// WR850G
+			t->skip = 8;
+			break;
+		}
+		t->need = t->skip + sizeof(trx);
+		return TRX_MORE;
+	}
+
+	if ((t->skip == 32) && (memcmp(t->hdr + 14, "U2ND", 4) != 0)) return TRX_BAD_HEADER;
+
+	memcpy(&trx, t->hdr + t->skip, sizeof(trx));
+	if ((trx.magic != TRX_MAGIC) || (trx.len <= sizeof(trx))) return TRX_BAD_HEADER;
+
+	t->len = trx.len;
+	t->crc32 = trx.crc32;
+	t->crc = 0xFFFFFFFF;
+	trx_crc(t, t->hdr + t->skip + OFFSETOF(struct trx_header, flag_version),
+		sizeof(trx) - OFFSETOF(struct trx_header, flag_version));
+	t->left = trx.len - sizeof(trx);
+	return TRX_MORE;
+}
+
+//	returns TRX_MORE until the whole image has been seen
+int trx_check(trx_check_t *t, const void *buf, int len)
+{
+	const uint8_t *p = buf;
+	int n;
+
+	if (t->result != TRX_MORE) return t->result;
+
+	while (t->have < t->need) {
+		if (len <= 0) return TRX_MORE;
+		n = MIN(len, t->need - t->have);
+		memcpy(t->hdr + t->have, p, n);
+		t->have += n;
+		p += n;
+		len -= n;
+		if ((t->have == t->need) && ((t->result = trx_header(t)) != TRX_MORE)) return t->result;
+	}
+
+	n = MIN((uint32_t)len, t->left);
+	trx_crc(t, p, n);
+	t->left -= n;
+	if (t->left == 0) {
+		t->result = (t->crc == t->crc32) ? TRX_OK : TRX_BAD_CRC;
+	}
+	return t->result;
+}
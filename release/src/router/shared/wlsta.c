@@ -0,0 +1,158 @@
+/*
+
+	Tomato Firmware
+	Copyright (C) 2006-2009 Jonathan Zarate
+
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <net/if.h>
+
+#include <wlutils.h>
+
+#include "shared.h"
+
+
+//	Station list for the Device List page: associated stations and WDS
+//	peers with their RSSI and sta_info. wlsta keeps a copy of it, so a page
+//	refresh is one read from WLSTA_SOCK instead of a few ioctls per station.
+
+
+typedef struct {
+	char ifname[16];
+	struct ether_addr ea;
+} wds_t;
+
+// wds doesn't show up under SIOCGIFCONF; seems to start at 17 (?)
+static int get_wds(wds_t *wds, int max)
+{
+	struct ifreq ifr;
+	int sd;
+	int i, n;
+
+	n = 0;
+	if ((sd = socket(PF_INET, SOCK_DGRAM, 0)) >= 0) {
+		for (i = 1; (i < 32) && (n < max); ++i) {
+			ifr.ifr_ifindex = i;
+			if ((ioctl(sd, SIOCGIFNAME, &ifr) == 0) &&
+				(strncmp(ifr.ifr_name, "wds", 3) == 0) &&
+				(wl_ioctl(ifr.ifr_name, WLC_WDS_GET_REMOTE_HWADDR, &wds[n].ea.octet, sizeof(wds[n].ea.octet)) == 0)) {
+				strlcpy(wds[n].ifname, ifr.ifr_name, sizeof(wds[n].ifname));
+				++n;
+			}
+		}
+		close(sd);
+	}
+	return n;
+}
+
+// returns the number of stations, or -1
+int wlsta_collect(char *wlif, wlsta_t *sta, int max)
+{
+	struct maclist *mlist;
+	int mlsize;
+	scb_val_t rssi;
+	sta_info_t sti;
+	wds_t wds[16];
+	int nwds;
+	int cmd;
+	int i, j, n;
+	unsigned int r;
+	wlsta_t *s;
+
+	mlsize = sizeof(struct maclist) + ((max - 1) * sizeof(struct ether_addr));
+	if ((mlist = malloc(mlsize)) == NULL) return -1;
+
+	n = 0;
+	nwds = -1;
+	cmd = WLC_GET_ASSOCLIST;
+	while (1) {
+		mlist->count = max;
+		if (wl_ioctl(wlif, cmd, mlist, mlsize) == 0) {
+			for (i = 0; (i < mlist->count) && (n < max); ++i) {
+				rssi.ea = mlist->ea[i];
+				rssi.val = 0;
+				if (wl_ioctl(wlif, WLC_GET_RSSI, &rssi, sizeof(rssi)) != 0) continue;
+
+				// sta_info0<mac>
+				memset(&sti, 0, sizeof(sti));
+				strcpy((char *)&sti, "sta_info");
+				memcpy((char *)&sti + 9, rssi.ea.octet, 6);
+				if (wl_ioctl(wlif, WLC_GET_VAR, &sti, sizeof(sti)) != 0) continue;
+
+				s = &sta[n];
+				strlcpy(s->ifname, wlif, sizeof(s->ifname));
+				if (sti.flags & WL_STA_WDS) {
+					if (cmd != WLC_GET_WDSLIST) continue;
+					if ((sti.flags & WL_WDS_LINKUP) == 0) continue;
+
+					// look the interfaces up once, not for every peer
+					if (nwds < 0) nwds = get_wds(wds, ASIZE(wds));
+					for (j = 0; j < nwds; ++j) {
+						if (memcmp(wds[j].ea.octet, rssi.ea.octet, sizeof(rssi.ea.octet)) == 0) {
+							strlcpy(s->ifname, wds[j].ifname, sizeof(s->ifname));
+							break;
+						}
+					}
+				}
+
+				memcpy(s->mac, rssi.ea.octet, sizeof(s->mac));
+				s->rssi = rssi.val;
+				s->max_rate = 0;
+				for (j = 0; (j < sti.rateset.count) && (j < WL_NUMRATES); ++j) {
+					r = (sti.rateset.rates[j] & 0x7F) * 500;
+					if (r > s->max_rate) s->max_rate = r;
+				}
+				s->idle = sti.idle;
+				s->in = sti.in;
+				s->flags = sti.flags;
+				++n;
+			}
+		}
+		if (cmd == WLC_GET_WDSLIST) break;
+		cmd = WLC_GET_WDSLIST;
+	}
+
+	free(mlist);
+	return n;
+}
+
+// ask wlsta, or collect it here if it's not running
+int wlsta_get(char *wlif, wlsta_t *sta, int max)
+{
+	struct sockaddr_un sa;
+	struct timeval tv;
+	int fd;
+	int n, size;
+	int r = 0;
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0) {
+		tv.tv_sec = 5;
+		tv.tv_usec = 0;
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+		memset(&sa, 0, sizeof(sa));
+		sa.sun_family = AF_UNIX;
+		strcpy(sa.sun_path, WLSTA_SOCK);
+		if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0) {
+			n = 0;
+			size = max * sizeof(*sta);
+			while ((n < size) && ((r = read(fd, (char *)sta + n, size - n)) > 0)) {
+				n += r;
+			}
+			close(fd);
+			if (r >= 0) return n / sizeof(*sta);
+		}
+		else {
+			close(fd);
+		}
+	}
+	return wlsta_collect(wlif, sta, max);
+}
+
@@ -0,0 +1,140 @@
+/*
+
+	Tomato Firmware
+	Copyright (C) 2006-2009 Jonathan Zarate
+
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <net/if.h>
+
+#include <wlutils.h>
+
+#include "shared.h"
+
+
+//	A fake radio, so wlsta_collect() can be run and timed on the build host:
+//	make wlsta-stub && ./wlsta-stub [loops]
+//	WL_STUB="stations,wds" sets the size of the list, 40,2 by default.
+//	This is never linked into libshared.
+
+
+static int stub_calls;
+
+static void stub_size(int *nsta, int *nwds)
+{
+	const char *p;
+
+	*nsta = 40;
+	*nwds = 2;
+	if ((p = getenv("WL_STUB")) != NULL) sscanf(p, "%d,%d", nsta, nwds);
+}
+
+static void stub_mac(struct ether_addr *ea, int i, int wds)
+{
+	memcpy(ea->octet, "\x00\x90\x4c\x00\x00\x00", 6);
+	ea->octet[3] = wds;
+	ea->octet[4] = i >> 8;
+	ea->octet[5] = i;
+}
+
+// SIOCGIFNAME only; wds interfaces are 17 and up, like on the router
+int ioctl(int sd, unsigned long cmd, ...)
+{
+	struct ifreq *ifr;
+	va_list ap;
+	int nsta, nwds;
+
+	va_start(ap, cmd);
+	ifr = va_arg(ap, struct ifreq *);
+	va_end(ap);
+
+	++stub_calls;
+	stub_size(&nsta, &nwds);
+	if (cmd != SIOCGIFNAME) return -1;
+	if (ifr->ifr_ifindex <= 4) sprintf(ifr->ifr_name, "eth%d", ifr->ifr_ifindex);
+		else if ((ifr->ifr_ifindex >= 17) && (ifr->ifr_ifindex < 17 + nwds)) sprintf(ifr->ifr_name, "wds0.%d", ifr->ifr_ifindex - 16);
+		else return -1;
+	return 0;
+}
+
+int wl_ioctl(char *name, int cmd, void *buf, int len)
+{
+	struct maclist *ml = buf;
+	scb_val_t *rssi = buf;
+	sta_info_t *sti = buf;
+	struct ether_addr ea;
+	int nsta, nwds;
+	int i, n;
+
+	++stub_calls;
+	stub_size(&nsta, &nwds);
+	switch (cmd) {
+	case WLC_GET_ASSOCLIST:
+	case WLC_GET_WDSLIST:
+		n = (cmd == WLC_GET_WDSLIST) ? nwds : nsta;
+		if (n > (int)ml->count) n = ml->count;
+		for (i = 0; i < n; ++i) stub_mac(&ml->ea[i], i, cmd == WLC_GET_WDSLIST);
+		ml->count = n;
+		return 0;
+	case WLC_GET_RSSI:
+		rssi->val = -40 - rssi->ea.octet[5] % 50;
+		return 0;
+	case WLC_GET_VAR:
+		memcpy(ea.octet, (char *)buf + 9, 6);
+		memset(sti, 0, sizeof(*sti));
+		sti->ver = WL_STA_VER;
+		sti->len = sizeof(*sti);
+		sti->ea = ea;
+		sti->flags = WL_STA_ASSOC | WL_STA_AUTHO;
+		if (ea.octet[3]) sti->flags |= WL_STA_WDS | WL_WDS_LINKUP;
+		sti->idle = ea.octet[5] % 7;
+		sti->in = 600 + ea.octet[5];
+		sti->rateset.count = 2;
+		sti->rateset.rates[0] = 22;
+		sti->rateset.rates[1] = 108 | 0x80;
+		return 0;
+	case WLC_WDS_GET_REMOTE_HWADDR:
+		if (strncmp(name, "wds0.", 5) != 0) return -1;
+		stub_mac((struct ether_addr *)buf, atoi(name + 5) - 1, 1);
+		return 0;
+	}
+	return -1;
+}
+
+#if !defined(__UCLIBC__) && defined(__GLIBC__) && !__GLIBC_PREREQ(2, 38)
+// uClibc has it, older glibc doesn't
+size_t strlcpy(char *dst, const char *src, size_t size)
+{
+	snprintf(dst, size, "%s", src);
+	return strlen(src);
+}
+#endif
+
+int main(int argc, char **argv)
+{
+	wlsta_t sta[WLSTA_MAX];
+	struct timeval t0, t1;
+	int i, n, loops;
+
+	loops = (argc > 1) ? atoi(argv[1]) : 1;
+	if (loops < 1) loops = 1;
+	gettimeofday(&t0, NULL);
+	for (i = 0; i < loops; ++i) {
+		n = wlsta_collect("eth1", sta, WLSTA_MAX);
+	}
+	gettimeofday(&t1, NULL);
+
+	for (i = 0; i < n; ++i) {
+		printf("%-8s %02X:%02X:%02X:%02X:%02X:%02X %4d %6u %3u %5u\n", sta[i].ifname,
+			sta[i].mac[0], sta[i].mac[1], sta[i].mac[2], sta[i].mac[3], sta[i].mac[4], sta[i].mac[5],
+			sta[i].rssi, sta[i].max_rate, sta[i].idle, sta[i].in);
+	}
+	printf("%d stations, %d calls, %ld us per collection\n", n, stub_calls / loops,
+		((t1.tv_sec - t0.tv_sec) * 1000000L + (t1.tv_usec - t0.tv_usec)) / loops);
+	return 0;
+}